@@ -1,6 +1,7 @@
 #ifndef INSTRUCTION_H
 #define INSTRUCTION_H
 
+#include <cstddef>
 #include <cstdint>
 
 namespace TPV {
@@ -65,13 +66,15 @@ enum class Opcode : uint8_t {
   // r1 = 0: define function in global module
   // imm1 = address of function in current module
   FUNCEND,
-  SET_ARG,  // r1, imm
-  GET_ARG,  // rd, imm
-  CALL,     // rd, r1, 32bit imm1 | @:label
-            // rd = return address
+  SET_ARG,  // r1, imm ;argument imm of the next CALL = r1
+  GET_ARG,  // rd, imm ;rd = argument imm, a function's arity is the highest
+            // imm + 1
+  CALL,     // rd, r1, 32bit imm1 | @label
+            // rd = return value
             // r1 = 0: call function in current module
-            // imm1 = address of function in current module
-  RETURN,   // rd
+            // imm1 = index of function in current module, in FUNCDEF order
+            // exactly arity arguments must be set
+  RETURN,   // rd ;return rd to the caller, the end of a function returns NIL
 
   NEW_ARRAY,      // rd
   SET_ARRAY,      // rd, r1, r2
@@ -81,8 +84,385 @@ enum class Opcode : uint8_t {
 
   IGL,
   NOP,
+
+  // whole-array ops over arrays that hold only ints or only floats, see
+  // vm/simd.hpp. Binary ones take two arrays of the same length and type
+  VADD,    // rd, r1, r2 ;rd = new array of r1[i] + r2[i]
+  VSUB,    // rd, r1, r2
+  VMUL,    // rd, r1, r2
+  VDIV,    // rd, r1, r2
+  VEQ,     // rd, r1, r2 ;rd = new int array of r1[i] == r2[i], 1 or 0
+  VNEQ,    // rd, r1, r2
+  VGT,     // rd, r1, r2
+  VGTE,    // rd, r1, r2
+  VLT,     // rd, r1, r2
+  VLTE,    // rd, r1, r2
+  VDOT,    // rd, r1, r2 ;rd = sum of r1[i] * r2[i]
+  VSCALE,  // rd, r1, r2 ;rd = new array of r1[i] * r2, r2 has the element type
+  VSUM,    // rd, r1
+  VMIN,    // rd, r1     ;r1 must not be empty
+  VMAX,    // rd, r1     ;r1 must not be empty
+
+  TAILCALL,  // r1, 32bit imm1 | @label
+             // CALL whose result is returned right away: the callee takes
+             // over the running frame and returns to its caller. Not in main
+  // compiled bytecode depends on the numbers above, new bytecode ops go here
+
+  // internal opcodes, only produced at load time and never valid in bytecode
+  END,  // appended to every decoded function, stops dispatch
+  MOV,  // rd, r1 ;rd = r1, written where inline_calls spliced in a callee
+  NEW_ARRAY_SCRATCH,  // rd, imm ;NEW_ARRAY whose array never leaves the frame,
+                      // rd = the frame's scratch array imm, see vm/escape.hpp
+
+  // superinstructions, see fusion.hpp
+  // the fused op takes the slot of the first instruction of the pair and runs
+  // both, the second instruction stays in place for jumps that land on it
+  EQ_JMP_IF,
+  NEQ_JMP_IF,
+  GT_JMP_IF,
+  GTE_JMP_IF,
+  LT_JMP_IF,
+  LTE_JMP_IF,
+  SETI_ADD,
+  SETI_SUB,
+  GET_ARRAY_ADD,
+  GET_ARRAY_SUB,
+  GET_ARRAY_MUL,
+  GET_ARRAY_DIV,
+  // pairs whose typed half type inference proved, see first_op
+  EQ_INT_PROVEN_JMP_IF,
+  EQ_FLOAT_PROVEN_JMP_IF,
+  NEQ_INT_PROVEN_JMP_IF,
+  NEQ_FLOAT_PROVEN_JMP_IF,
+  GT_INT_PROVEN_JMP_IF,
+  GT_FLOAT_PROVEN_JMP_IF,
+  GTE_INT_PROVEN_JMP_IF,
+  GTE_FLOAT_PROVEN_JMP_IF,
+  LT_INT_PROVEN_JMP_IF,
+  LT_FLOAT_PROVEN_JMP_IF,
+  LTE_INT_PROVEN_JMP_IF,
+  LTE_FLOAT_PROVEN_JMP_IF,
+  SETI_ADD_INT_PROVEN,
+  SETI_SUB_INT_PROVEN,
+
+  // quickened forms, a generic op rewrites its slot into one of these after
+  // it saw both operands with the same type, and back once they differ
+  ADD_INT,
+  ADD_FLOAT,
+  SUB_INT,
+  SUB_FLOAT,
+  MUL_INT,
+  MUL_FLOAT,
+  DIV_INT,
+  DIV_FLOAT,
+  EQ_INT,
+  EQ_FLOAT,
+  NEQ_INT,
+  NEQ_FLOAT,
+  GT_INT,
+  GT_FLOAT,
+  GTE_INT,
+  GTE_FLOAT,
+  LT_INT,
+  LT_FLOAT,
+  LTE_INT,
+  LTE_FLOAT,
+  // proven forms, written at load time by the type inference pass where
+  // both operands can only have that type, they never check the operands
+  ADD_INT_PROVEN,
+  ADD_FLOAT_PROVEN,
+  SUB_INT_PROVEN,
+  SUB_FLOAT_PROVEN,
+  MUL_INT_PROVEN,
+  MUL_FLOAT_PROVEN,
+  DIV_INT_PROVEN,
+  DIV_FLOAT_PROVEN,
+  EQ_INT_PROVEN,
+  EQ_FLOAT_PROVEN,
+  NEQ_INT_PROVEN,
+  NEQ_FLOAT_PROVEN,
+  GT_INT_PROVEN,
+  GT_FLOAT_PROVEN,
+  GTE_INT_PROVEN,
+  GTE_FLOAT_PROVEN,
+  LT_INT_PROVEN,
+  LT_FLOAT_PROVEN,
+  LTE_INT_PROVEN,
+  LTE_FLOAT_PROVEN,
+};
+
+// opcodes that may appear in bytecode, keep in sync with the last one
+constexpr uint8_t OPCODE_COUNT = static_cast<uint8_t>(Opcode::TAILCALL) + 1;
+// every opcode the VM has a handler for, keep in sync with the last opcode
+constexpr size_t HANDLER_COUNT =
+    static_cast<size_t>(Opcode::LTE_FLOAT_PROVEN) + 1;
+
+// operand layout of each opcode in the bytecode stream, registers are one
+// byte, imm is a 32bit big endian word, str is null-terminated
+enum class Operands : uint8_t {
+  NONE,       //
+  RD,         // rd
+  R1,         // r1
+  RD_R1,      // rd, r1
+  RD_R1_R2,   // rd, r1, r2
+  RD_IMM,     // rd, imm
+  RD_STR,     // rd, str
+  RD_R1_IMM,  // rd, r1, imm
+  R1_IMM,     // r1, imm
+  R1_R2_IMM,  // r1, r2, imm
+  IMM,        // imm
 };
 
+// the bytecode op whose slot an internal op took: the first instruction of a
+// superinstruction, the generic form of a quickened or proven op or the
+// NEW_ARRAY a NEW_ARRAY_SCRATCH replaced. op itself for everything else
+constexpr Opcode base_op(Opcode op) {
+  switch (op) {
+    case Opcode::NEW_ARRAY_SCRATCH:
+      return Opcode::NEW_ARRAY;
+    case Opcode::EQ_JMP_IF:
+    case Opcode::EQ_INT_PROVEN_JMP_IF:
+    case Opcode::EQ_FLOAT_PROVEN_JMP_IF:
+      return Opcode::EQ;
+    case Opcode::NEQ_JMP_IF:
+    case Opcode::NEQ_INT_PROVEN_JMP_IF:
+    case Opcode::NEQ_FLOAT_PROVEN_JMP_IF:
+      return Opcode::NEQ;
+    case Opcode::GT_JMP_IF:
+    case Opcode::GT_INT_PROVEN_JMP_IF:
+    case Opcode::GT_FLOAT_PROVEN_JMP_IF:
+      return Opcode::GT;
+    case Opcode::GTE_JMP_IF:
+    case Opcode::GTE_INT_PROVEN_JMP_IF:
+    case Opcode::GTE_FLOAT_PROVEN_JMP_IF:
+      return Opcode::GTE;
+    case Opcode::LT_JMP_IF:
+    case Opcode::LT_INT_PROVEN_JMP_IF:
+    case Opcode::LT_FLOAT_PROVEN_JMP_IF:
+      return Opcode::LT;
+    case Opcode::LTE_JMP_IF:
+    case Opcode::LTE_INT_PROVEN_JMP_IF:
+    case Opcode::LTE_FLOAT_PROVEN_JMP_IF:
+      return Opcode::LTE;
+    case Opcode::SETI_ADD:
+    case Opcode::SETI_SUB:
+    case Opcode::SETI_ADD_INT_PROVEN:
+    case Opcode::SETI_SUB_INT_PROVEN:
+      return Opcode::SETI;
+    case Opcode::GET_ARRAY_ADD:
+    case Opcode::GET_ARRAY_SUB:
+    case Opcode::GET_ARRAY_MUL:
+    case Opcode::GET_ARRAY_DIV:
+      return Opcode::GET_ARRAY;
+    case Opcode::ADD_INT:
+    case Opcode::ADD_FLOAT:
+    case Opcode::ADD_INT_PROVEN:
+    case Opcode::ADD_FLOAT_PROVEN:
+      return Opcode::ADD;
+    case Opcode::SUB_INT:
+    case Opcode::SUB_FLOAT:
+    case Opcode::SUB_INT_PROVEN:
+    case Opcode::SUB_FLOAT_PROVEN:
+      return Opcode::SUB;
+    case Opcode::MUL_INT:
+    case Opcode::MUL_FLOAT:
+    case Opcode::MUL_INT_PROVEN:
+    case Opcode::MUL_FLOAT_PROVEN:
+      return Opcode::MUL;
+    case Opcode::DIV_INT:
+    case Opcode::DIV_FLOAT:
+    case Opcode::DIV_INT_PROVEN:
+    case Opcode::DIV_FLOAT_PROVEN:
+      return Opcode::DIV;
+    case Opcode::EQ_INT:
+    case Opcode::EQ_FLOAT:
+    case Opcode::EQ_INT_PROVEN:
+    case Opcode::EQ_FLOAT_PROVEN:
+      return Opcode::EQ;
+    case Opcode::NEQ_INT:
+    case Opcode::NEQ_FLOAT:
+    case Opcode::NEQ_INT_PROVEN:
+    case Opcode::NEQ_FLOAT_PROVEN:
+      return Opcode::NEQ;
+    case Opcode::GT_INT:
+    case Opcode::GT_FLOAT:
+    case Opcode::GT_INT_PROVEN:
+    case Opcode::GT_FLOAT_PROVEN:
+      return Opcode::GT;
+    case Opcode::GTE_INT:
+    case Opcode::GTE_FLOAT:
+    case Opcode::GTE_INT_PROVEN:
+    case Opcode::GTE_FLOAT_PROVEN:
+      return Opcode::GTE;
+    case Opcode::LT_INT:
+    case Opcode::LT_FLOAT:
+    case Opcode::LT_INT_PROVEN:
+    case Opcode::LT_FLOAT_PROVEN:
+      return Opcode::LT;
+    case Opcode::LTE_INT:
+    case Opcode::LTE_FLOAT:
+    case Opcode::LTE_INT_PROVEN:
+    case Opcode::LTE_FLOAT_PROVEN:
+      return Opcode::LTE;
+    default:
+      return op;
+  }
+}
+
+// the op the slot of a superinstruction runs before the instruction after it,
+// with the proven form where the pair has one. op itself for everything else
+constexpr Opcode first_op(Opcode op) {
+  switch (op) {
+    case Opcode::EQ_INT_PROVEN_JMP_IF:
+      return Opcode::EQ_INT_PROVEN;
+    case Opcode::EQ_FLOAT_PROVEN_JMP_IF:
+      return Opcode::EQ_FLOAT_PROVEN;
+    case Opcode::NEQ_INT_PROVEN_JMP_IF:
+      return Opcode::NEQ_INT_PROVEN;
+    case Opcode::NEQ_FLOAT_PROVEN_JMP_IF:
+      return Opcode::NEQ_FLOAT_PROVEN;
+    case Opcode::GT_INT_PROVEN_JMP_IF:
+      return Opcode::GT_INT_PROVEN;
+    case Opcode::GT_FLOAT_PROVEN_JMP_IF:
+      return Opcode::GT_FLOAT_PROVEN;
+    case Opcode::GTE_INT_PROVEN_JMP_IF:
+      return Opcode::GTE_INT_PROVEN;
+    case Opcode::GTE_FLOAT_PROVEN_JMP_IF:
+      return Opcode::GTE_FLOAT_PROVEN;
+    case Opcode::LT_INT_PROVEN_JMP_IF:
+      return Opcode::LT_INT_PROVEN;
+    case Opcode::LT_FLOAT_PROVEN_JMP_IF:
+      return Opcode::LT_FLOAT_PROVEN;
+    case Opcode::LTE_INT_PROVEN_JMP_IF:
+      return Opcode::LTE_INT_PROVEN;
+    case Opcode::LTE_FLOAT_PROVEN_JMP_IF:
+      return Opcode::LTE_FLOAT_PROVEN;
+    case Opcode::EQ_JMP_IF:
+    case Opcode::NEQ_JMP_IF:
+    case Opcode::GT_JMP_IF:
+    case Opcode::GTE_JMP_IF:
+    case Opcode::LT_JMP_IF:
+    case Opcode::LTE_JMP_IF:
+    case Opcode::SETI_ADD:
+    case Opcode::SETI_SUB:
+    case Opcode::SETI_ADD_INT_PROVEN:
+    case Opcode::SETI_SUB_INT_PROVEN:
+    case Opcode::GET_ARRAY_ADD:
+    case Opcode::GET_ARRAY_SUB:
+    case Opcode::GET_ARRAY_MUL:
+    case Opcode::GET_ARRAY_DIV:
+      return base_op(op);
+    default:
+      return op;
+  }
+}
+
+// internal opcodes report the layout of the instruction they stand for
+constexpr Operands operands_of(Opcode op) {
+  if (base_op(op) != op) {
+    return operands_of(base_op(op));
+  }
+
+  switch (op) {
+    case Opcode::SETI:
+    case Opcode::SETF:
+    case Opcode::GET_ARG:
+      return Operands::RD_IMM;
+    case Opcode::SETS:
+      return Operands::RD_STR;
+    case Opcode::SETNIL:
+    case Opcode::POP:
+    case Opcode::RETURN:
+    case Opcode::NEW_ARRAY:
+      return Operands::RD;
+    case Opcode::STORE:
+    case Opcode::LOAD:
+    case Opcode::BITSHL:
+    case Opcode::BITSHRL:
+    case Opcode::BITSHRA:
+    case Opcode::CALL:
+      return Operands::RD_R1_IMM;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::LT:
+    case Opcode::LTE:
+    case Opcode::BITAND:
+    case Opcode::BITOR:
+    case Opcode::BITXOR:
+    case Opcode::SET_ARRAY:
+    case Opcode::GET_ARRAY:
+    case Opcode::RM_ARRAY:
+    case Opcode::VADD:
+    case Opcode::VSUB:
+    case Opcode::VMUL:
+    case Opcode::VDIV:
+    case Opcode::VEQ:
+    case Opcode::VNEQ:
+    case Opcode::VGT:
+    case Opcode::VGTE:
+    case Opcode::VLT:
+    case Opcode::VLTE:
+    case Opcode::VDOT:
+    case Opcode::VSCALE:
+      return Operands::RD_R1_R2;
+    case Opcode::CVT_I_D:
+    case Opcode::CVT_D_I:
+    case Opcode::NEGATE:
+    case Opcode::BITNOT:
+    case Opcode::GET_ARRAY_LEN:
+    case Opcode::VSUM:
+    case Opcode::VMIN:
+    case Opcode::VMAX:
+    case Opcode::MOV:
+      return Operands::RD_R1;
+    case Opcode::JMP:
+      return Operands::IMM;
+    case Opcode::JMP_IF:
+    case Opcode::FUNCDEF:
+    case Opcode::FUNCDEF_G:
+    case Opcode::SET_ARG:
+    case Opcode::TAILCALL:
+      return Operands::R1_IMM;
+    case Opcode::VMCALL:
+      return Operands::R1_R2_IMM;
+    case Opcode::PUSH:
+      return Operands::R1;
+    case Opcode::HLT:
+    case Opcode::FUNCEND:
+    case Opcode::IGL:
+    case Opcode::NOP:
+    case Opcode::END:
+      return Operands::NONE;
+    default:
+      return Operands::NONE;
+  }
+}
+
+// fixed width instruction produced by the decoder and run by the VM
+// imm is already resolved:
+// SETI/SETF: raw 32bit value
+// SETS: index into TPV_Function::str_literals and str_constants
+// JMP/JMP_IF: target instruction index
+// CALL/TAILCALL: function index in FUNCDEF order, an index into
+// TPV_Function::call_targets once VM::load_bytes linked the code
+// NEW_ARRAY_SCRATCH: index into the frame's scratch arrays
+// the decoded array always ends with END
+struct Instr {
+  Opcode op;
+  uint8_t rd;
+  uint8_t r1;
+  uint8_t r2;
+  int32_t imm;
+};
+
+static_assert(sizeof(Instr) == 8);
+
 }  // namespace TPV
 
 #endif  // !INSTRUCTION_H
\ No newline at end of file
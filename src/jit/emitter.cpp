@@ -0,0 +1,230 @@
+#include "emitter.hpp"
+
+#include <map>
+
+#include "../utils.hpp"
+
+namespace TPV {
+
+void Emitter::put(std::initializer_list<uint8_t> stencil) {
+  this->code.insert(this->code.end(), stencil);
+}
+
+void Emitter::put32(int32_t value) {
+  auto bits = static_cast<uint32_t>(value);
+  for (int i = 0; i < 4; i++) {
+    this->code.push_back(static_cast<uint8_t>(bits >> (8 * i)));
+  }
+}
+
+void Emitter::patch32(size_t at, int32_t value) {
+  auto bits = static_cast<uint32_t>(value);
+  for (int i = 0; i < 4; i++) {
+    this->code[at + i] = static_cast<uint8_t>(bits >> (8 * i));
+  }
+}
+
+void Emitter::mem(Reg reg, int32_t disp) {
+  // mod 10 (disp32), rm 111 (rdi)
+  put({static_cast<uint8_t>(0x87 | (to_integral(reg) << 3))});
+  put32(disp);
+}
+
+void Emitter::bind_instr(uint32_t idx) {
+  if (this->instr_offsets.size() <= idx) {
+    this->instr_offsets.resize(idx + 1, 0);
+  }
+  this->instr_offsets[idx] = this->code.size();
+}
+
+void Emitter::load(Reg dst, int32_t disp) {
+  put({0x8B});
+  mem(dst, disp);
+}
+
+void Emitter::store(int32_t disp, Reg src) {
+  put({0x89});
+  mem(src, disp);
+}
+
+void Emitter::store_imm(int32_t disp, int32_t imm) {
+  put({0xC7});
+  mem(Reg::EAX, disp);
+  put32(imm);
+}
+
+void Emitter::cmp_mem_imm(int32_t disp, int32_t imm) {
+  // 81 /7
+  put({0x81});
+  mem(static_cast<Reg>(7), disp);
+  put32(imm);
+}
+
+void Emitter::cmp_mem(Reg lhs, int32_t disp) {
+  put({0x3B});
+  mem(lhs, disp);
+}
+
+void Emitter::cmp_imm(Reg lhs, int32_t imm) {
+  // 81 /7, register direct
+  put({0x81, static_cast<uint8_t>(0xF8 | to_integral(lhs))});
+  put32(imm);
+}
+
+void Emitter::alu(Alu op, Reg dst, int32_t disp) {
+  put({to_integral(op)});
+  mem(dst, disp);
+}
+
+void Emitter::imul(Reg dst, int32_t disp) {
+  put({0x0F, 0xAF});
+  mem(dst, disp);
+}
+
+void Emitter::idiv_ecx() {
+  put({0x99, 0xF7, 0xF9});
+}
+
+void Emitter::not_eax() {
+  put({0xF7, 0xD0});
+}
+
+void Emitter::neg_eax() {
+  put({0xF7, 0xD8});
+}
+
+void Emitter::shift_eax(Shift op, uint8_t imm) {
+  put({0xC1, static_cast<uint8_t>(0xC0 | (to_integral(op) << 3)), imm});
+}
+
+void Emitter::add_self(Reg reg) {
+  const auto r = to_integral(reg);
+  put({0x01, static_cast<uint8_t>(0xC0 | (r << 3) | r)});
+}
+
+void Emitter::xor_eax(int32_t imm) {
+  put({0x35});
+  put32(imm);
+}
+
+void Emitter::setcc(Cond cond, Reg dst) {
+  put({0x0F, static_cast<uint8_t>(0x90 | to_integral(cond)),
+       static_cast<uint8_t>(0xC0 | to_integral(dst))});
+}
+
+void Emitter::and_al_cl() {
+  put({0x20, 0xC8});
+}
+
+void Emitter::or_al_cl() {
+  put({0x08, 0xC8});
+}
+
+void Emitter::movzx_eax_al() {
+  put({0x0F, 0xB6, 0xC0});
+}
+
+void Emitter::movss_load(Reg dst, int32_t disp) {
+  put({0xF3, 0x0F, 0x10});
+  mem(dst, disp);
+}
+
+void Emitter::movss_store(int32_t disp, Reg src) {
+  put({0xF3, 0x0F, 0x11});
+  mem(src, disp);
+}
+
+void Emitter::sse(Sse op, Reg dst, int32_t disp) {
+  put({0xF3, 0x0F, to_integral(op)});
+  mem(dst, disp);
+}
+
+void Emitter::ucomiss(Reg lhs, int32_t disp) {
+  put({0x0F, 0x2E});
+  mem(lhs, disp);
+}
+
+void Emitter::cvtsi2ss(Reg dst, int32_t disp) {
+  put({0xF3, 0x0F, 0x2A});
+  mem(dst, disp);
+}
+
+void Emitter::cvtsi2ss_xmm0_eax() {
+  put({0xF3, 0x0F, 0x2A, 0xC0});
+}
+
+void Emitter::cvttss2si_eax(int32_t disp) {
+  put({0xF3, 0x0F, 0x2C});
+  mem(Reg::EAX, disp);
+}
+
+void Emitter::movd_eax_xmm0() {
+  put({0x66, 0x0F, 0x7E, 0xC0});
+}
+
+void Emitter::jmp_instr(uint32_t idx) {
+  put({0xE9});
+  this->relocs.push_back(
+      {.at = this->code.size(), .target = Target::INSTR, .idx = idx});
+  put32(0);
+}
+
+void Emitter::jcc_instr(Cond cond, uint32_t idx) {
+  put({0x0F, static_cast<uint8_t>(0x80 | to_integral(cond))});
+  this->relocs.push_back(
+      {.at = this->code.size(), .target = Target::INSTR, .idx = idx});
+  put32(0);
+}
+
+void Emitter::jcc_exit(Cond cond, uint32_t idx) {
+  put({0x0F, static_cast<uint8_t>(0x80 | to_integral(cond))});
+  this->relocs.push_back(
+      {.at = this->code.size(), .target = Target::EXIT, .idx = idx});
+  put32(0);
+}
+
+void Emitter::exit(uint32_t idx) {
+  // mov eax, idx; ret
+  put({0xB8});
+  put32(static_cast<int32_t>(idx));
+  put({0xC3});
+}
+
+size_t Emitter::jmp_local() {
+  put({0xE9});
+  put32(0);
+  return this->code.size() - 4;
+}
+
+size_t Emitter::jcc_local(Cond cond) {
+  put({0x0F, static_cast<uint8_t>(0x80 | to_integral(cond))});
+  put32(0);
+  return this->code.size() - 4;
+}
+
+void Emitter::bind(size_t jump) {
+  patch32(jump, static_cast<int32_t>(this->code.size() - (jump + 4)));
+}
+
+std::vector<uint8_t> Emitter::finish() {
+  // one stub per instruction that can be left from the middle
+  std::map<uint32_t, size_t> stubs;
+  for (const auto& reloc : this->relocs) {
+    if (reloc.target == Target::EXIT && !stubs.contains(reloc.idx)) {
+      stubs[reloc.idx] = this->code.size();
+      exit(reloc.idx);
+    }
+  }
+
+  for (const auto& reloc : this->relocs) {
+    const auto target = reloc.target == Target::EXIT
+                            ? stubs[reloc.idx]
+                            : this->instr_offsets.at(reloc.idx);
+    patch32(reloc.at, static_cast<int32_t>(target - (reloc.at + 4)));
+  }
+  this->relocs.clear();
+
+  return std::move(this->code);
+}
+
+}  // namespace TPV
@@ -0,0 +1,151 @@
+#ifndef EMITTER_HPP
+#define EMITTER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <initializer_list>
+#include <utility>
+#include <vector>
+
+namespace TPV {
+
+// x86-64 condition codes, the low nibble of jcc and setcc
+enum class Cond : uint8_t {
+  B = 0x2,
+  AE = 0x3,
+  E = 0x4,
+  NE = 0x5,
+  A = 0x7,
+  P = 0xA,
+  NP = 0xB,
+  L = 0xC,
+  GE = 0xD,
+  LE = 0xE,
+  G = 0xF,
+};
+
+// general purpose and xmm registers the stencils use, all caller saved
+enum class Reg : uint8_t { EAX = 0, ECX = 1, XMM0 = 0, XMM1 = 1 };
+
+// opcode bytes of `op r32, [mem]`
+enum class Alu : uint8_t {
+  ADD = 0x03,
+  OR = 0x0B,
+  AND = 0x23,
+  SUB = 0x2B,
+  XOR = 0x33,
+};
+
+// opcode bytes of `op xmm, [mem]` (after F3 0F)
+enum class Sse : uint8_t { ADD = 0x58, MUL = 0x59, SUB = 0x5C, DIV = 0x5E };
+
+// /r field of `shift r32, imm8`
+enum class Shift : uint8_t { SHL = 4, SHR = 5, SAR = 7 };
+
+// builds native code for one function out of stencils: fixed byte templates
+// whose holes (displacements, immediates, jump offsets) are patched after
+// copying. Every memory operand is [rdi + disp32], rdi holds the slot array
+// and is never touched. Jumps to instructions and to exits are resolved by
+// finish(), so they may point forward
+class Emitter {
+ public:
+  size_t size() const { return this->code.size(); }
+
+  // instruction idx starts here
+  void bind_instr(uint32_t idx);
+
+  // mov r32, [rdi + disp]
+  void load(Reg dst, int32_t disp);
+  // mov [rdi + disp], r32
+  void store(int32_t disp, Reg src);
+  // mov dword [rdi + disp], imm
+  void store_imm(int32_t disp, int32_t imm);
+  // cmp dword [rdi + disp], imm
+  void cmp_mem_imm(int32_t disp, int32_t imm);
+  // cmp r32, [rdi + disp]
+  void cmp_mem(Reg lhs, int32_t disp);
+  // cmp r32, imm
+  void cmp_imm(Reg lhs, int32_t imm);
+  // op r32, [rdi + disp]
+  void alu(Alu op, Reg dst, int32_t disp);
+  // imul r32, [rdi + disp]
+  void imul(Reg dst, int32_t disp);
+  // cdq; idiv ecx
+  void idiv_ecx();
+  // not eax / neg eax
+  void not_eax();
+  void neg_eax();
+  // shl/shr/sar eax, imm
+  void shift_eax(Shift op, uint8_t imm);
+  // add r32, r32, doubling drops the float sign bit so zero flag is set for
+  // +0.0 and -0.0 only
+  void add_self(Reg reg);
+  // xor eax, imm
+  void xor_eax(int32_t imm);
+  // setcc r8 (al or cl)
+  void setcc(Cond cond, Reg dst);
+  // and al, cl / or al, cl
+  void and_al_cl();
+  void or_al_cl();
+  // movzx eax, al
+  void movzx_eax_al();
+
+  // movss xmm, [rdi + disp]
+  void movss_load(Reg dst, int32_t disp);
+  // movss [rdi + disp], xmm
+  void movss_store(int32_t disp, Reg src);
+  // op xmm, [rdi + disp]
+  void sse(Sse op, Reg dst, int32_t disp);
+  // ucomiss xmm, [rdi + disp]
+  void ucomiss(Reg lhs, int32_t disp);
+  // cvtsi2ss xmm, dword [rdi + disp] / cvtsi2ss xmm0, eax
+  void cvtsi2ss(Reg dst, int32_t disp);
+  void cvtsi2ss_xmm0_eax();
+  // cvttss2si eax, [rdi + disp]
+  void cvttss2si_eax(int32_t disp);
+  // movd eax, xmm0
+  void movd_eax_xmm0();
+
+  // jmp / jcc to the start of instruction idx
+  void jmp_instr(uint32_t idx);
+  void jcc_instr(Cond cond, uint32_t idx);
+  // jcc to a stub that leaves native code at instruction idx
+  void jcc_exit(Cond cond, uint32_t idx);
+  // leave native code here, resuming the interpreter at instruction idx
+  void exit(uint32_t idx);
+
+  // forward jumps inside one instruction, bind() points them at the
+  // current position
+  size_t jmp_local();
+  size_t jcc_local(Cond cond);
+  void bind(size_t jump);
+
+  // append the exit stubs, patch every jump and hand out the code. Offsets of
+  // instruction starts are in instr_offsets
+  std::vector<uint8_t> finish();
+
+  std::vector<size_t> instr_offsets;
+
+ private:
+  enum class Target : uint8_t { INSTR, EXIT };
+
+  struct Reloc {
+    size_t at;  // offset of the rel32 hole
+    Target target;
+    uint32_t idx;
+  };
+
+  // copy a stencil and patch the 32 bit holes that follow it
+  void put(std::initializer_list<uint8_t> stencil);
+  void put32(int32_t value);
+  void patch32(size_t at, int32_t value);
+  // [rdi + disp32] with reg in the /r field
+  void mem(Reg reg, int32_t disp);
+
+  std::vector<uint8_t> code;
+  std::vector<Reloc> relocs;
+};
+
+}  // namespace TPV
+
+#endif  // !EMITTER_HPP
@@ -0,0 +1,60 @@
+#include "exec_memory.hpp"
+
+#include <cstring>
+#include <utility>
+
+#include "jit.hpp"
+
+#if TPV_HAS_JIT
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+namespace TPV {
+
+std::optional<Exec_Memory> Exec_Memory::map(const std::vector<uint8_t>& code) {
+#if TPV_HAS_JIT
+  if (code.empty()) {
+    return std::nullopt;
+  }
+
+  const auto page = static_cast<size_t>(sysconf(_SC_PAGESIZE));
+  const auto size = (code.size() + page - 1) / page * page;
+
+  void* pages = mmap(nullptr, size, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+  if (pages == MAP_FAILED) {
+    return std::nullopt;
+  }
+
+  std::memcpy(pages, code.data(), code.size());
+  if (mprotect(pages, size, PROT_READ | PROT_EXEC) != 0) {
+    munmap(pages, size);
+    return std::nullopt;
+  }
+
+  return Exec_Memory(static_cast<uint8_t*>(pages), size);
+#else
+  return std::nullopt;
+#endif
+}
+
+Exec_Memory::Exec_Memory(Exec_Memory&& other) noexcept
+    : base(std::exchange(other.base, nullptr)),
+      size(std::exchange(other.size, 0)) {}
+
+Exec_Memory& Exec_Memory::operator=(Exec_Memory&& other) noexcept {
+  std::swap(this->base, other.base);
+  std::swap(this->size, other.size);
+  return *this;
+}
+
+Exec_Memory::~Exec_Memory() {
+#if TPV_HAS_JIT
+  if (this->base) {
+    munmap(this->base, this->size);
+  }
+#endif
+}
+
+}  // namespace TPV
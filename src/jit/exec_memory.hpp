@@ -0,0 +1,35 @@
+#ifndef EXEC_MEMORY_HPP
+#define EXEC_MEMORY_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+namespace TPV {
+
+// pages holding generated code. They are writable only while the code is
+// copied in and executable only afterwards, never both (W^X)
+class Exec_Memory {
+ public:
+  // map fresh pages, copy code in and flip them to read + execute
+  static std::optional<Exec_Memory> map(const std::vector<uint8_t>& code);
+
+  Exec_Memory(Exec_Memory&& other) noexcept;
+  Exec_Memory& operator=(Exec_Memory&& other) noexcept;
+  Exec_Memory(const Exec_Memory&) = delete;
+  Exec_Memory& operator=(const Exec_Memory&) = delete;
+  ~Exec_Memory();
+
+  const uint8_t* data() const { return this->base; }
+
+ private:
+  Exec_Memory(uint8_t* base, size_t size) : base(base), size(size) {}
+
+  uint8_t* base = nullptr;
+  size_t size = 0;
+};
+
+}  // namespace TPV
+
+#endif  // !EXEC_MEMORY_HPP
@@ -0,0 +1,418 @@
+#include "jit.hpp"
+
+#include <array>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+#include "../utils.hpp"
+#include "../vm/handlers.hpp"
+#include "../vm/vm.hpp"
+#include "emitter.hpp"
+#include "stencils.hpp"
+#include "trace.hpp"
+
+namespace TPV {
+
+namespace {
+
+// ops that write rd when they run natively
+bool writes_rd(Opcode op) {
+  switch (op) {
+    case Opcode::JMP:
+    case Opcode::JMP_IF:
+    case Opcode::NOP:
+      return false;
+    default:
+      return true;
+  }
+}
+
+// leave at idx unless reg holds tag
+void guard(Emitter& em, uint8_t reg, int32_t tag, uint32_t idx) {
+  em.cmp_mem_imm(tag_of(reg), tag);
+  em.jcc_exit(Cond::NE, idx);
+}
+
+// arithmetic and compares: a proven slot needs no guards, a quickened one
+// says which types ran so far and only gets that path, a generic one checks
+// the tags and gets both
+void emit_binary(Emitter& em, const Instr& ins, uint32_t idx) {
+  const auto op = base_op(ins.op);
+  // a fused slot is its first half here, the second one has its own slot
+  const auto slot_op = first_op(ins.op);
+  const auto result_tag = [&](ValueType type) {
+    return to_integral(result_type(op, type));
+  };
+
+  if (slot_op == proven(op, ValueType::TPV_INT)) {
+    emit_int_op(em, op, ins, idx);
+    em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_INT));
+    return;
+  }
+  if (slot_op == proven(op, ValueType::TPV_FLOAT)) {
+    emit_float_op(em, op, ins, idx);
+    em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_FLOAT));
+    return;
+  }
+  if (slot_op == quickened(op, ValueType::TPV_INT)) {
+    guard(em, ins.r1, INT_TAG, idx);
+    guard(em, ins.r2, INT_TAG, idx);
+    emit_int_op(em, op, ins, idx);
+    em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_INT));
+    return;
+  }
+  if (slot_op == quickened(op, ValueType::TPV_FLOAT)) {
+    guard(em, ins.r1, FLOAT_TAG, idx);
+    guard(em, ins.r2, FLOAT_TAG, idx);
+    emit_float_op(em, op, ins, idx);
+    em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_FLOAT));
+    return;
+  }
+
+  em.load(Reg::EAX, tag_of(ins.r1));
+  em.cmp_mem(Reg::EAX, tag_of(ins.r2));
+  em.jcc_exit(Cond::NE, idx);
+  em.cmp_imm(Reg::EAX, INT_TAG);
+  const auto not_int = em.jcc_local(Cond::NE);
+  emit_int_op(em, op, ins, idx);
+  em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_INT));
+  const auto done = em.jmp_local();
+
+  em.bind(not_int);
+  em.cmp_imm(Reg::EAX, FLOAT_TAG);
+  em.jcc_exit(Cond::NE, idx);
+  emit_float_op(em, op, ins, idx);
+  em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_FLOAT));
+  em.bind(done);
+}
+
+// rd = op r1 on ints only
+void emit_bitwise(Emitter& em, const Instr& ins, uint32_t idx) {
+  const auto op = base_op(ins.op);
+
+  guard(em, ins.r1, INT_TAG, idx);
+  if (op == Opcode::BITAND || op == Opcode::BITOR || op == Opcode::BITXOR) {
+    guard(em, ins.r2, INT_TAG, idx);
+  }
+  emit_bitwise_op(em, op, ins);
+  em.store_imm(tag_of(ins.rd), INT_TAG);
+}
+
+// CVT_I_D, CVT_D_I and NEGATE take either type, int first
+void emit_unary(Emitter& em, const Instr& ins, uint32_t idx) {
+  const auto op = base_op(ins.op);
+  const auto result_tag = [&](ValueType type) {
+    return to_integral(result_type(op, type));
+  };
+
+  em.load(Reg::EAX, tag_of(ins.r1));
+  em.cmp_imm(Reg::EAX, INT_TAG);
+  const auto not_int = em.jcc_local(Cond::NE);
+  emit_unary_op(em, op, ins, ValueType::TPV_INT);
+  em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_INT));
+  const auto done = em.jmp_local();
+
+  em.bind(not_int);
+  em.cmp_imm(Reg::EAX, FLOAT_TAG);
+  em.jcc_exit(Cond::NE, idx);
+  emit_unary_op(em, op, ins, ValueType::TPV_FLOAT);
+  em.store_imm(tag_of(ins.rd), result_tag(ValueType::TPV_FLOAT));
+  em.bind(done);
+}
+
+// taken when r1 is a non zero int, or a float other than +0.0 and -0.0
+void emit_jmp_if(Emitter& em, const Instr& ins, uint32_t idx) {
+  const auto target = static_cast<uint32_t>(ins.imm);
+
+  em.load(Reg::EAX, tag_of(ins.r1));
+  em.cmp_imm(Reg::EAX, INT_TAG);
+  const auto not_int = em.jcc_local(Cond::NE);
+  emit_truth_test(em, ins.r1, ValueType::TPV_INT);
+  em.jcc_instr(Cond::NE, target);
+  const auto done = em.jmp_local();
+
+  em.bind(not_int);
+  em.cmp_imm(Reg::EAX, FLOAT_TAG);
+  em.jcc_exit(Cond::NE, idx);
+  emit_truth_test(em, ins.r1, ValueType::TPV_FLOAT);
+  em.jcc_instr(Cond::NE, target);
+  em.bind(done);
+}
+
+void emit_instr(Emitter& em, const Instr& ins, uint32_t idx) {
+  switch (base_op(ins.op)) {
+    case Opcode::NOP:
+      break;
+    case Opcode::SETI:
+      em.store_imm(bits_of(ins.rd), ins.imm);
+      em.store_imm(tag_of(ins.rd), INT_TAG);
+      break;
+    case Opcode::SETF:
+      em.store_imm(bits_of(ins.rd), ins.imm);
+      em.store_imm(tag_of(ins.rd), FLOAT_TAG);
+      break;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::LT:
+    case Opcode::LTE:
+      emit_binary(em, ins, idx);
+      break;
+    case Opcode::BITAND:
+    case Opcode::BITOR:
+    case Opcode::BITXOR:
+    case Opcode::BITNOT:
+    case Opcode::BITSHL:
+    case Opcode::BITSHRL:
+    case Opcode::BITSHRA:
+      emit_bitwise(em, ins, idx);
+      break;
+    case Opcode::CVT_I_D:
+    case Opcode::CVT_D_I:
+    case Opcode::NEGATE:
+      emit_unary(em, ins, idx);
+      break;
+    case Opcode::JMP:
+      em.jmp_instr(static_cast<uint32_t>(ins.imm));
+      break;
+    case Opcode::JMP_IF:
+      emit_jmp_if(em, ins, idx);
+      break;
+    default:
+      em.exit(idx);
+      break;
+  }
+}
+
+Jit_Slot to_slot(const Value& value) {
+  const auto type = value.type();
+  if (type == ValueType::TPV_INT || type == ValueType::TPV_FLOAT) {
+    return {.bits = static_cast<int32_t>(value.bits), .tag = to_integral(type)};
+  }
+  return {.bits = 0, .tag = to_integral(type)};
+}
+
+bool ensure_compiled(const TPV_Function& func, Jit_Function& jit) {
+  if (jit.memory) {
+    return true;
+  }
+  return !jit.failed && jit_compile(func, jit);
+}
+
+Jit_Function& jit_of(TPV_Function& func) {
+  if (!func.jit) {
+    func.jit = std::make_shared<Jit_Function>(func);
+  }
+  return *func.jit;
+}
+
+// copy the frame's registers in, run code and copy back what it wrote. The
+// frame continues at the instruction native code stopped at, which is returned
+uint32_t run_native(VM& vm,
+                    Jit_Function& jit,
+                    const uint8_t* code,
+                    const std::vector<uint8_t>& written) {
+  auto& frame = vm.frames.back();
+  auto* regs = frame.registers;
+
+  for (size_t r = 0; r < jit.slots.size(); r++) {
+    jit.slots[r] = to_slot(regs[r]);
+  }
+
+  const auto address = reinterpret_cast<uintptr_t>(code);
+  const auto exit = reinterpret_cast<Jit_Entry>(address)(jit.slots.data());
+
+  for (auto r : written) {
+    const auto& slot = jit.slots[r];
+    if (slot.tag == INT_TAG) {
+      regs[r] = from_raw_value(static_cast<TPV_INT>(slot.bits));
+    } else if (slot.tag == FLOAT_TAG) {
+      regs[r] = from_raw_value(std::bit_cast<TPV_FLOAT>(slot.bits));
+    }
+  }
+  frame.pc = exit;
+  return exit;
+}
+
+// run the method code from pc
+void enter(VM& vm, Jit_Function& jit, Jit_Function::Entry& entry, uint32_t pc) {
+  const auto exit = run_native(vm, jit,
+                               jit.memory->data() + jit.instr_offsets[pc],
+                               jit.written);
+
+  // stopping on an instruction native code has means a guard failed
+  if (jit.native[exit] && ++entry.bailouts >= JIT_MAX_BAILOUTS) {
+    entry.state = Jit_Function::State::DISABLED;
+  }
+}
+
+// run the trace of the loop at header
+void enter_trace(VM& vm, Jit_Function& jit, Jit_Function::Entry& entry,
+                 uint32_t header) {
+  const auto exit =
+      run_native(vm, jit, entry.trace->memory.data(), entry.trace->written);
+
+  // back at the header means the entry types did not match, after a few of
+  // those the loop is recorded again with what it runs with now
+  if (exit == header && ++entry.bailouts >= JIT_MAX_BAILOUTS) {
+    entry.trace.reset();
+    entry.bailouts = 0;
+    entry.aborts += 1;
+    entry.state = Jit_Function::State::COLD;
+  }
+}
+
+}  // namespace
+
+Jit_Function::Jit_Function(const TPV_Function& func)
+    : entries(func.code.size()),
+      native(func.code.size()),
+      native_before(func.code.size() + 1),
+      slots(func.num_registers) {
+  std::array<bool, MAX_REGISTERS> is_written{};
+
+  for (size_t i = 0; i < func.code.size(); i++) {
+    const auto& ins = func.code[i];
+    this->native[i] = jit_supported(ins.op);
+    this->native_before[i + 1] = this->native_before[i] + this->native[i];
+    if (this->native[i] && writes_rd(base_op(ins.op))) {
+      is_written[ins.rd] = true;
+    }
+  }
+
+  for (size_t r = 0; r < is_written.size(); r++) {
+    if (is_written[r]) {
+      this->written.push_back(static_cast<uint8_t>(r));
+    }
+  }
+}
+
+bool jit_supported(Opcode op) {
+  switch (base_op(op)) {
+    case Opcode::NOP:
+    case Opcode::SETI:
+    case Opcode::SETF:
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::LT:
+    case Opcode::LTE:
+    case Opcode::BITAND:
+    case Opcode::BITOR:
+    case Opcode::BITXOR:
+    case Opcode::BITNOT:
+    case Opcode::BITSHL:
+    case Opcode::BITSHRL:
+    case Opcode::BITSHRA:
+    case Opcode::CVT_I_D:
+    case Opcode::CVT_D_I:
+    case Opcode::NEGATE:
+    case Opcode::JMP:
+    case Opcode::JMP_IF:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool jit_compile(const TPV_Function& func, Jit_Function& jit) {
+  if (!TPV_HAS_JIT) {
+    jit.failed = true;
+    return false;
+  }
+
+  Emitter em;
+  for (uint32_t i = 0; i < func.code.size(); i++) {
+    em.bind_instr(i);
+    emit_instr(em, func.code[i], i);
+  }
+
+  auto memory = Exec_Memory::map(em.finish());
+  if (!memory) {
+    jit.failed = true;
+    return false;
+  }
+
+  jit.instr_offsets = std::move(em.instr_offsets);
+  jit.memory = std::move(memory);
+  return true;
+}
+
+void jit_back_edge(VM& vm, uint32_t target) {
+  auto& frame = vm.frames.back();
+  const auto back_edge = frame.pc - 1;
+  frame.pc = target;
+
+  auto& func = *frame.function;
+  auto& jit = jit_of(func);
+  auto& entry = jit.entries[target];
+
+  if (entry.state == Jit_Function::State::COLD) {
+    if (++entry.count < JIT_HOT_LOOP) {
+      return;
+    }
+    entry.count = 0;
+
+    if (TPV_HAS_JIT && entry.aborts < JIT_MAX_TRACE_ABORTS) {
+      // recording runs one iteration, after a failure the interpreter goes on
+      // from wherever it stopped
+      auto trace = record_trace(vm);
+      entry.trace = trace ? compile_trace(*trace, target) : nullptr;
+      if (!entry.trace) {
+        entry.aborts += 1;
+        return;
+      }
+      entry.state = Jit_Function::State::TRACED;
+    } else {
+      // no trace, so fall back to the method code, but only if the whole body
+      // is native, otherwise it would leave on every iteration
+      const auto body_size = back_edge + 1 - target;
+      const bool body_native =
+          jit.native_before[back_edge + 1] - jit.native_before[target] ==
+          body_size;
+      entry.state = body_native && ensure_compiled(func, jit)
+                        ? Jit_Function::State::ENABLED
+                        : Jit_Function::State::DISABLED;
+    }
+  }
+
+  if (entry.state == Jit_Function::State::TRACED) {
+    enter_trace(vm, jit, entry, target);
+  } else if (entry.state == Jit_Function::State::ENABLED) {
+    enter(vm, jit, entry, target);
+  }
+}
+
+void jit_call(VM& vm) {
+  auto& frame = vm.frames.back();
+  auto& jit = jit_of(*frame.function);
+  auto& entry = jit.entries[0];
+
+  if (entry.state == Jit_Function::State::COLD) {
+    if (++entry.count < JIT_HOT_CALL) {
+      return;
+    }
+
+    entry.state = jit.native[0] && ensure_compiled(*frame.function, jit)
+                      ? Jit_Function::State::ENABLED
+                      : Jit_Function::State::DISABLED;
+  }
+
+  if (entry.state == Jit_Function::State::ENABLED) {
+    enter(vm, jit, entry, 0);
+  }
+}
+
+}  // namespace TPV
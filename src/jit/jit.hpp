@@ -0,0 +1,104 @@
+#ifndef JIT_HPP
+#define JIT_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "../instructions.hpp"
+#include "../value.hpp"
+#include "exec_memory.hpp"
+
+// native code needs x86-64 and mmap, elsewhere everything stays interpreted
+#if defined(__x86_64__) && defined(__linux__)
+#define TPV_HAS_JIT 1
+#else
+#define TPV_HAS_JIT 0
+#endif
+
+namespace TPV {
+
+class VM;
+
+// back edges taken to a loop header before the loop runs natively
+constexpr uint32_t JIT_HOT_LOOP = 1000;
+// calls of a function before its body runs natively
+constexpr uint32_t JIT_HOT_CALL = 100;
+// guard failures an entry tolerates before it goes back to interpreting
+constexpr uint32_t JIT_MAX_BAILOUTS = 16;
+// longest trace recorded for one loop iteration
+constexpr size_t JIT_MAX_TRACE = 256;
+// failed recordings of a loop before it falls back to the method code
+constexpr uint32_t JIT_MAX_TRACE_ABORTS = 4;
+
+// what native code sees of a register: raw int or float bits and the
+// ValueType. Native code never makes objects, it exits before touching one
+struct Jit_Slot {
+  int32_t bits;
+  int32_t tag;
+};
+
+// native code takes the slots of the frame and returns the index of the
+// instruction the interpreter continues at
+using Jit_Entry = uint32_t (*)(Jit_Slot* slots);
+
+struct Jit_Trace;
+
+// hot loops are traced (trace.hpp): one recorded iteration compiled with the
+// types it ran with. Loops that cannot be traced and hot functions run the
+// method code, all of func.code compiled with guards on every op
+struct Jit_Function {
+  enum class State : uint8_t {
+    COLD,      // counting
+    TRACED,    // runs entry.trace
+    ENABLED,   // runs the method code
+    DISABLED,  // stays interpreted
+  };
+
+  struct Entry {
+    uint32_t count = 0;
+    uint32_t bailouts = 0;
+    uint32_t aborts = 0;
+    State state = State::COLD;
+    std::shared_ptr<Jit_Trace> trace;
+  };
+
+  explicit Jit_Function(const TPV_Function& func);
+
+  // per instruction: loop header or call entry bookkeeping
+  std::vector<Entry> entries;
+  // per instruction: base op has a native translation
+  std::vector<bool> native;
+  // native[0, i) count, so a loop body is checked in O(1)
+  std::vector<uint32_t> native_before;
+  // registers native code may write, copied back on exit
+  std::vector<uint8_t> written;
+
+  // set by the first compile, failed stays true if that did not work
+  std::optional<Exec_Memory> memory;
+  std::vector<size_t> instr_offsets;
+  bool failed = false;
+
+  std::vector<Jit_Slot> slots;
+};
+
+// true if base_op(op) runs natively
+bool jit_supported(Opcode op);
+
+// translate func.code into native code, false if it could not be mapped
+bool jit_compile(const TPV_Function& func, Jit_Function& jit);
+
+// the running instruction jumps backwards to target: count the loop, trace it
+// once it is hot and run the trace from then on. Sets the frame's pc either
+// way
+void jit_back_edge(VM& vm, uint32_t target);
+
+// a new frame was just pushed for a call, run its body natively once the
+// function is hot
+void jit_call(VM& vm);
+
+}  // namespace TPV
+
+#endif  // !JIT_HPP
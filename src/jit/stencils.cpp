@@ -0,0 +1,206 @@
+#include "stencils.hpp"
+
+namespace TPV {
+
+namespace {
+
+constexpr int32_t SIGN_BIT = INT32_MIN;
+
+Cond int_cond(Opcode op) {
+  switch (op) {
+    case Opcode::EQ:
+      return Cond::E;
+    case Opcode::NEQ:
+      return Cond::NE;
+    case Opcode::GT:
+      return Cond::G;
+    case Opcode::GTE:
+      return Cond::GE;
+    case Opcode::LT:
+      return Cond::L;
+    default:
+      return Cond::LE;
+  }
+}
+
+}  // namespace
+
+ValueType result_type(Opcode op, ValueType operand) {
+  switch (op) {
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+      return operand;
+    case Opcode::SETF:
+    case Opcode::CVT_I_D:
+    case Opcode::NEGATE:
+      return ValueType::TPV_FLOAT;
+    default:
+      // SETI, compares, bitwise ops and CVT_D_I
+      return ValueType::TPV_INT;
+  }
+}
+
+void emit_int_op(Emitter& em, Opcode op, const Instr& ins, uint32_t exit_idx) {
+  switch (op) {
+    case Opcode::ADD:
+      em.load(Reg::EAX, bits_of(ins.r1));
+      em.alu(Alu::ADD, Reg::EAX, bits_of(ins.r2));
+      break;
+    case Opcode::SUB:
+      em.load(Reg::EAX, bits_of(ins.r1));
+      em.alu(Alu::SUB, Reg::EAX, bits_of(ins.r2));
+      break;
+    case Opcode::MUL:
+      em.load(Reg::EAX, bits_of(ins.r1));
+      em.imul(Reg::EAX, bits_of(ins.r2));
+      break;
+    case Opcode::DIV:
+      em.load(Reg::ECX, bits_of(ins.r2));
+      em.cmp_imm(Reg::ECX, 0);
+      em.jcc_exit(Cond::E, exit_idx);
+      em.load(Reg::EAX, bits_of(ins.r1));
+      em.idiv_ecx();
+      break;
+    default:
+      em.load(Reg::EAX, bits_of(ins.r1));
+      em.cmp_mem(Reg::EAX, bits_of(ins.r2));
+      em.setcc(int_cond(op), Reg::EAX);
+      em.movzx_eax_al();
+      break;
+  }
+  em.store(bits_of(ins.rd), Reg::EAX);
+}
+
+// compares follow C++: every compare with NaN is false except !=
+void emit_float_op(Emitter& em, Opcode op, const Instr& ins, uint32_t exit_idx) {
+  auto arith = [&](Sse sse) {
+    em.movss_load(Reg::XMM0, bits_of(ins.r1));
+    em.sse(sse, Reg::XMM0, bits_of(ins.r2));
+    em.movss_store(bits_of(ins.rd), Reg::XMM0);
+  };
+  auto compare = [&](uint8_t lhs, uint8_t rhs) {
+    em.movss_load(Reg::XMM0, bits_of(lhs));
+    em.ucomiss(Reg::XMM0, bits_of(rhs));
+  };
+
+  switch (op) {
+    case Opcode::ADD:
+      return arith(Sse::ADD);
+    case Opcode::SUB:
+      return arith(Sse::SUB);
+    case Opcode::MUL:
+      return arith(Sse::MUL);
+    case Opcode::DIV:
+      // +0.0 and -0.0 both count as zero
+      em.load(Reg::ECX, bits_of(ins.r2));
+      em.add_self(Reg::ECX);
+      em.jcc_exit(Cond::E, exit_idx);
+      return arith(Sse::DIV);
+    case Opcode::EQ:
+      compare(ins.r1, ins.r2);
+      em.setcc(Cond::E, Reg::EAX);
+      em.setcc(Cond::NP, Reg::ECX);
+      em.and_al_cl();
+      break;
+    case Opcode::NEQ:
+      compare(ins.r1, ins.r2);
+      em.setcc(Cond::NE, Reg::EAX);
+      em.setcc(Cond::P, Reg::ECX);
+      em.or_al_cl();
+      break;
+    case Opcode::GT:
+      compare(ins.r1, ins.r2);
+      em.setcc(Cond::A, Reg::EAX);
+      break;
+    case Opcode::GTE:
+      compare(ins.r1, ins.r2);
+      em.setcc(Cond::AE, Reg::EAX);
+      break;
+    case Opcode::LT:
+      compare(ins.r2, ins.r1);
+      em.setcc(Cond::A, Reg::EAX);
+      break;
+    default:
+      compare(ins.r2, ins.r1);
+      em.setcc(Cond::AE, Reg::EAX);
+      break;
+  }
+  em.movzx_eax_al();
+  em.store(bits_of(ins.rd), Reg::EAX);
+}
+
+void emit_bitwise_op(Emitter& em, Opcode op, const Instr& ins) {
+  em.load(Reg::EAX, bits_of(ins.r1));
+  switch (op) {
+    case Opcode::BITAND:
+      em.alu(Alu::AND, Reg::EAX, bits_of(ins.r2));
+      break;
+    case Opcode::BITOR:
+      em.alu(Alu::OR, Reg::EAX, bits_of(ins.r2));
+      break;
+    case Opcode::BITXOR:
+      em.alu(Alu::XOR, Reg::EAX, bits_of(ins.r2));
+      break;
+    case Opcode::BITNOT:
+      em.not_eax();
+      break;
+    case Opcode::BITSHL:
+      em.shift_eax(Shift::SHL, static_cast<uint8_t>(ins.imm));
+      break;
+    case Opcode::BITSHRL:
+      em.shift_eax(Shift::SHR, static_cast<uint8_t>(ins.imm));
+      break;
+    default:
+      em.shift_eax(Shift::SAR, static_cast<uint8_t>(ins.imm));
+      break;
+  }
+  em.store(bits_of(ins.rd), Reg::EAX);
+}
+
+void emit_unary_op(Emitter& em, Opcode op, const Instr& ins, ValueType from) {
+  const bool is_int = from == ValueType::TPV_INT;
+
+  switch (op) {
+    case Opcode::CVT_I_D:
+      if (is_int) {
+        em.cvtsi2ss(Reg::XMM0, bits_of(ins.r1));
+        em.movd_eax_xmm0();
+      } else {
+        em.load(Reg::EAX, bits_of(ins.r1));
+      }
+      break;
+    case Opcode::CVT_D_I:
+      if (is_int) {
+        em.load(Reg::EAX, bits_of(ins.r1));
+      } else {
+        em.cvttss2si_eax(bits_of(ins.r1));
+      }
+      break;
+    default:
+      em.load(Reg::EAX, bits_of(ins.r1));
+      if (is_int) {
+        // NEGATE of an int gives a float, negated before converting so 0
+        // stays +0.0
+        em.neg_eax();
+        em.cvtsi2ss_xmm0_eax();
+        em.movd_eax_xmm0();
+      } else {
+        em.xor_eax(SIGN_BIT);
+      }
+      break;
+  }
+  em.store(bits_of(ins.rd), Reg::EAX);
+}
+
+void emit_truth_test(Emitter& em, uint8_t reg, ValueType type) {
+  if (type == ValueType::TPV_INT) {
+    em.cmp_mem_imm(bits_of(reg), 0);
+  } else {
+    em.load(Reg::ECX, bits_of(reg));
+    em.add_self(Reg::ECX);
+  }
+}
+
+}  // namespace TPV
@@ -0,0 +1,50 @@
+#ifndef STENCILS_HPP
+#define STENCILS_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "../instructions.hpp"
+#include "../utils.hpp"
+#include "../value.hpp"
+#include "emitter.hpp"
+#include "jit.hpp"
+
+namespace TPV {
+
+// typed op bodies shared by the method JIT (jit.cpp) and traces (trace.cpp).
+// They only write the bits of rd, the caller decides whether the tag of rd
+// needs a store
+
+constexpr int32_t INT_TAG = to_integral(ValueType::TPV_INT);
+constexpr int32_t FLOAT_TAG = to_integral(ValueType::TPV_FLOAT);
+
+constexpr int32_t bits_of(uint8_t reg) {
+  return reg * sizeof(Jit_Slot) + offsetof(Jit_Slot, bits);
+}
+
+constexpr int32_t tag_of(uint8_t reg) {
+  return reg * sizeof(Jit_Slot) + offsetof(Jit_Slot, tag);
+}
+
+// type of rd after a native op ran on an r1 of type operand
+ValueType result_type(Opcode op, ValueType operand);
+
+// arithmetic and compares on two ints / two floats. A zero divisor leaves
+// native code at exit_idx, the interpreter reports it
+void emit_int_op(Emitter& em, Opcode op, const Instr& ins, uint32_t exit_idx);
+void emit_float_op(Emitter& em, Opcode op, const Instr& ins, uint32_t exit_idx);
+
+// BITAND ... BITSHRA, ints only
+void emit_bitwise_op(Emitter& em, Opcode op, const Instr& ins);
+
+// CVT_I_D, CVT_D_I and NEGATE on an r1 of type from
+void emit_unary_op(Emitter& em, Opcode op, const Instr& ins, ValueType from);
+
+// set flags so NE means JMP_IF on reg (of type type) jumps: a non zero int,
+// or a float other than +0.0 and -0.0
+void emit_truth_test(Emitter& em, uint8_t reg, ValueType type);
+
+}  // namespace TPV
+
+#endif  // !STENCILS_HPP
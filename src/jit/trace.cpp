@@ -0,0 +1,303 @@
+#include "trace.hpp"
+
+#include <array>
+
+#include "../vm/handlers.hpp"
+#include "../vm/vm.hpp"
+#include "jit.hpp"
+#include "stencils.hpp"
+
+namespace TPV {
+
+namespace {
+
+using Types = std::array<std::optional<ValueType>, MAX_REGISTERS>;
+
+// the handler of a native op, JMP and JMP_IF are followed by the recorder
+void run_op(VM& vm, const Instr& ins) {
+  switch (ins.op) {
+    case Opcode::SETI:
+      return op_SETI(vm, ins);
+    case Opcode::SETF:
+      return op_SETF(vm, ins);
+    case Opcode::ADD:
+      return op_ADD(vm, ins);
+    case Opcode::SUB:
+      return op_SUB(vm, ins);
+    case Opcode::MUL:
+      return op_MUL(vm, ins);
+    case Opcode::DIV:
+      return op_DIV(vm, ins);
+    case Opcode::EQ:
+      return op_EQ(vm, ins);
+    case Opcode::NEQ:
+      return op_NEQ(vm, ins);
+    case Opcode::GT:
+      return op_GT(vm, ins);
+    case Opcode::GTE:
+      return op_GTE(vm, ins);
+    case Opcode::LT:
+      return op_LT(vm, ins);
+    case Opcode::LTE:
+      return op_LTE(vm, ins);
+    case Opcode::BITAND:
+      return op_BITAND(vm, ins);
+    case Opcode::BITOR:
+      return op_BITOR(vm, ins);
+    case Opcode::BITXOR:
+      return op_BITXOR(vm, ins);
+    case Opcode::BITNOT:
+      return op_BITNOT(vm, ins);
+    case Opcode::BITSHL:
+      return op_BITSHL(vm, ins);
+    case Opcode::BITSHRL:
+      return op_BITSHRL(vm, ins);
+    case Opcode::BITSHRA:
+      return op_BITSHRA(vm, ins);
+    case Opcode::CVT_I_D:
+      return op_CVT_I_D(vm, ins);
+    case Opcode::CVT_D_I:
+      return op_CVT_D_I(vm, ins);
+    case Opcode::NEGATE:
+      return op_NEGATE(vm, ins);
+    default:
+      return;
+  }
+}
+
+// registers an op reads, r2 only for three register ops
+bool reads_r1(Opcode op) {
+  switch (operands_of(op)) {
+    case Operands::RD_R1:
+    case Operands::RD_R1_R2:
+    case Operands::RD_R1_IMM:
+    case Operands::R1_IMM:
+      return true;
+    default:
+      return false;
+  }
+}
+
+bool reads_r2(Opcode op) {
+  return operands_of(op) == Operands::RD_R1_R2;
+}
+
+bool writes_rd(Opcode op) {
+  return op != Opcode::JMP && op != Opcode::JMP_IF && op != Opcode::NOP;
+}
+
+bool is_number(ValueType type) {
+  return type == ValueType::TPV_INT || type == ValueType::TPV_FLOAT;
+}
+
+// emit the body of one step, false if the types do not add up
+bool emit_step(Emitter& em, const Trace_Step& step, const Types& types) {
+  const auto& ins = step.ins;
+  const auto t1 = types[ins.r1];
+  const auto t2 = types[ins.r2];
+
+  switch (ins.op) {
+    case Opcode::NOP:
+    case Opcode::JMP:
+      return true;
+    case Opcode::JMP_IF:
+      if (!t1 || !is_number(*t1)) {
+        return false;
+      }
+      emit_truth_test(em, ins.r1, *t1);
+      if (step.taken) {
+        em.jcc_exit(Cond::E, step.pc + 1);
+      } else {
+        em.jcc_exit(Cond::NE, static_cast<uint32_t>(ins.imm));
+      }
+      return true;
+    case Opcode::SETI:
+    case Opcode::SETF:
+      em.store_imm(bits_of(ins.rd), ins.imm);
+      return true;
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::LT:
+    case Opcode::LTE:
+      if (!t1 || !t2 || *t1 != *t2 || !is_number(*t1)) {
+        return false;
+      }
+      if (*t1 == ValueType::TPV_INT) {
+        emit_int_op(em, ins.op, ins, step.pc);
+      } else {
+        emit_float_op(em, ins.op, ins, step.pc);
+      }
+      return true;
+    case Opcode::BITAND:
+    case Opcode::BITOR:
+    case Opcode::BITXOR:
+      if (t2 != ValueType::TPV_INT) {
+        return false;
+      }
+      [[fallthrough]];
+    case Opcode::BITNOT:
+    case Opcode::BITSHL:
+    case Opcode::BITSHRL:
+    case Opcode::BITSHRA:
+      if (t1 != ValueType::TPV_INT) {
+        return false;
+      }
+      emit_bitwise_op(em, ins.op, ins);
+      return true;
+    case Opcode::CVT_I_D:
+    case Opcode::CVT_D_I:
+    case Opcode::NEGATE:
+      if (!t1 || !is_number(*t1)) {
+        return false;
+      }
+      emit_unary_op(em, ins.op, ins, *t1);
+      return true;
+    default:
+      return false;
+  }
+}
+
+}  // namespace
+
+std::optional<std::vector<Trace_Step>> record_trace(VM& vm) {
+  auto& frame = vm.frames.back();
+  const auto& code = frame.function->code;
+  const auto header = frame.pc;
+  const auto errors = vm.errors.size();
+  std::vector<Trace_Step> trace;
+
+  while (trace.size() < JIT_MAX_TRACE) {
+    const auto pc = frame.pc;
+    auto ins = code[pc];
+    ins.op = base_op(ins.op);
+    if (!jit_supported(ins.op)) {
+      return std::nullopt;
+    }
+
+    Trace_Step step{.ins = ins,
+                    .pc = pc,
+                    .t1 = reg(vm, ins.r1).type(),
+                    .t2 = reg(vm, ins.r2).type(),
+                    .taken = false};
+    frame.pc = pc + 1;
+
+    if (ins.op == Opcode::JMP || ins.op == Opcode::JMP_IF) {
+      if (ins.op == Opcode::JMP_IF) {
+        const auto& cond = reg(vm, ins.r1);
+        if (!is_number(cond.type())) {
+          // the interpreter reports it
+          frame.pc = pc;
+          return std::nullopt;
+        }
+        step.taken = cond.type() == ValueType::TPV_INT ? as_int(cond) != 0
+                                                       : as_float(cond) != 0;
+      } else {
+        step.taken = true;
+      }
+
+      trace.push_back(step);
+      if (step.taken) {
+        frame.pc = static_cast<uint32_t>(ins.imm);
+        if (frame.pc == header) {
+          return trace;
+        }
+        if (frame.pc <= pc) {
+          // an inner loop, it gets its own trace
+          return std::nullopt;
+        }
+      }
+      continue;
+    }
+
+    run_op(vm, ins);
+    if (vm.errors.size() != errors) {
+      return std::nullopt;
+    }
+    trace.push_back(step);
+  }
+
+  return std::nullopt;
+}
+
+std::shared_ptr<Jit_Trace> compile_trace(const std::vector<Trace_Step>& trace,
+                                         uint32_t header) {
+  // types the loop is entered with: registers read before they are written
+  Types entry{};
+  std::array<bool, MAX_REGISTERS> written{};
+  for (const auto& step : trace) {
+    const auto& ins = step.ins;
+    if (reads_r1(ins.op) && !written[ins.r1] && !entry[ins.r1]) {
+      entry[ins.r1] = step.t1;
+    }
+    if (reads_r2(ins.op) && !written[ins.r2] && !entry[ins.r2]) {
+      entry[ins.r2] = step.t2;
+    }
+    if (writes_rd(ins.op)) {
+      written[ins.rd] = true;
+    }
+  }
+
+  Emitter em;
+
+  // label 0: check the entry types, a mismatch goes back to the header
+  em.bind_instr(0);
+  for (size_t r = 0; r < entry.size(); r++) {
+    if (entry[r]) {
+      em.cmp_mem_imm(tag_of(r), to_integral(*entry[r]));
+      em.jcc_exit(Cond::NE, header);
+    }
+  }
+
+  // label 1: the iteration itself. types is what each register holds now,
+  // tags what its tag in memory is known to be
+  em.bind_instr(1);
+  Types types = entry;
+  Types tags = entry;
+  for (const auto& step : trace) {
+    const auto& ins = step.ins;
+    if ((reads_r1(ins.op) && types[ins.r1] != step.t1) ||
+        (reads_r2(ins.op) && types[ins.r2] != step.t2) ||
+        !emit_step(em, step, types)) {
+      return nullptr;
+    }
+
+    if (writes_rd(ins.op)) {
+      const auto type = result_type(
+          ins.op, reads_r1(ins.op) ? *types[ins.r1] : ValueType::TPV_INT);
+      if (tags[ins.rd] != type) {
+        em.store_imm(tag_of(ins.rd), to_integral(type));
+        tags[ins.rd] = type;
+      }
+      types[ins.rd] = type;
+    }
+  }
+
+  // a loop that keeps its entry types skips the guards from now on
+  bool stable = true;
+  for (size_t r = 0; r < entry.size(); r++) {
+    stable = stable && (!entry[r] || types[r] == entry[r]);
+  }
+  em.jmp_instr(stable ? 1 : 0);
+
+  auto memory = Exec_Memory::map(em.finish());
+  if (!memory) {
+    return nullptr;
+  }
+
+  auto result = std::make_shared<Jit_Trace>(Jit_Trace{
+      .memory = std::move(*memory), .written = {}});
+  for (size_t r = 0; r < written.size(); r++) {
+    if (written[r]) {
+      result->written.push_back(static_cast<uint8_t>(r));
+    }
+  }
+  return result;
+}
+
+}  // namespace TPV
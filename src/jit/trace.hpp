@@ -0,0 +1,51 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <cstdint>
+#include <memory>
+#include <optional>
+#include <vector>
+
+#include "../instructions.hpp"
+#include "../value.hpp"
+#include "exec_memory.hpp"
+
+namespace TPV {
+
+class VM;
+
+// one instruction of a recorded loop iteration
+struct Trace_Step {
+  Instr ins;  // with the base op, superinstructions and quickening undone
+  uint32_t pc;
+  // types of r1 and r2 when it ran
+  ValueType t1;
+  ValueType t2;
+  // JMP_IF went to its target
+  bool taken;
+};
+
+// native code for one loop iteration, it loops on itself until a guard fails
+struct Jit_Trace {
+  Exec_Memory memory;
+  // registers the trace writes, copied back on exit
+  std::vector<uint8_t> written;
+};
+
+// run the loop at the frame's pc for one iteration in a recording
+// interpreter. Returns the steps once control is back at the header, or
+// std::nullopt if an op native code lacks, an error, another backward jump or
+// JIT_MAX_TRACE cut it short. Either way the frame is left at the instruction
+// to run next
+std::optional<std::vector<Trace_Step>> record_trace(VM& vm);
+
+// compile a recorded iteration of the loop at header. Registers read before
+// they are written get one type guard on entry, everything after that is
+// typed statically from the recording. Branches that went the other way and
+// zero divisors are side exits. nullptr if the code could not be mapped
+std::shared_ptr<Jit_Trace> compile_trace(const std::vector<Trace_Step>& trace,
+                                         uint32_t header);
+
+}  // namespace TPV
+
+#endif  // !TRACE_HPP
@@ -1,26 +1,71 @@
+#include <chrono>
 #include <iostream>
+#include <optional>
+#include <string_view>
+#include "optimizer/optimizer.hpp"
 #include "repl/repl.hpp"
 #include "scanner/scanner.hpp"
 #include "vm/vm.hpp"
+#include "vm/vm_pool.hpp"
 #include "parser/parser.hpp"
 
 using namespace std;
 
-void test2(const std::string& filename) {
+// -O0, -O1 or -O2
+std::optional<TPV::Opt_Level> parse_opt_level(std::string_view arg) {
+  if (arg == "-O0") {
+    return TPV::Opt_Level::O0;
+  }
+  if (arg == "-O1") {
+    return TPV::Opt_Level::O1;
+  }
+  if (arg == "-O2") {
+    return TPV::Opt_Level::O2;
+  }
+  return std::nullopt;
+}
+
+// run the optimizer and print how many instructions it left and how many
+// calls it made tail calls
+TPV::Optimizer_Result optimize_and_report(
+    const std::vector<uint8_t>& bytecodes,
+    TPV::Opt_Level level) {
+  auto result = TPV::optimize(bytecodes, level);
+  std::cout << "optimizer: " << result.instructions_before << " -> "
+            << result.instructions_after << " instructions";
+  if (result.tail_calls > 0) {
+    std::cout << ", " << result.tail_calls << " tail calls";
+  }
+  std::cout << "\n";
+  return result;
+}
+
+void test2(const std::string& filename,
+           TPV::Opt_Level level,
+           TPV::VM_Pool& pool) {
   auto tokens_opt = TPV::scan_file(filename);
   if (tokens_opt) {
     TPV::Parser parser{};
-    TPV::VM vm{};
+    auto handle = pool.acquire();
+    auto& vm = *handle;
 
     TPV::Test_Fn::print_tokens(*tokens_opt);
     parser.load_tokens(*tokens_opt);
     auto result = parser.parse();
     parser.print_bytecodes();
     if(result.err_msg.empty()){
-      vm.load_bytes(result.bytecodes);
+      auto optimized = optimize_and_report(result.bytecodes, level);
+      if (!vm.load_bytes(optimized.bytecodes)) {
+        for (auto&& err : vm.errors) {
+          std::cout << err.msg << "\n";
+        }
+        return;
+      }
       vm.eval_all();
       vm.print_regs();
       vm.print_str_table();
+      vm.print_gc_stats();
+      vm.print_inline_stats();
     }else {
       for (auto&& i : result.err_msg) {
         std::cout << i << "\n";
@@ -32,6 +77,45 @@ void test2(const std::string& filename) {
   }
 }
 
+// run a program interpreted and then with the JIT, timing eval_all
+void bench(const std::string& filename, TPV::Opt_Level level) {
+  auto tokens_opt = TPV::scan_file(filename);
+  if (!tokens_opt) {
+    std::cerr << "Failed to scan file" << std::endl;
+    return;
+  }
+
+  TPV::Parser parser{};
+  parser.load_tokens(*tokens_opt);
+  auto result = parser.parse();
+  if (!result.err_msg.empty()) {
+    for (auto&& i : result.err_msg) {
+      std::cout << i << "\n";
+    }
+    return;
+  }
+  auto optimized = optimize_and_report(result.bytecodes, level);
+
+  for (bool use_jit : {false, true}) {
+    TPV::VM vm{};
+    vm.use_jit = use_jit;
+    if (!vm.load_bytes(optimized.bytecodes)) {
+      for (auto&& err : vm.errors) {
+        std::cout << err.msg << "\n";
+      }
+      return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    vm.eval_all();
+    auto end = std::chrono::steady_clock::now();
+
+    std::cout << filename << (use_jit ? " jit: " : " interpreter: ")
+              << std::chrono::duration<double, std::milli>(end - start).count()
+              << " ms\n";
+  }
+}
+
 int main(int argc, char** argv) {
   // TPV::VM mv = TPV::VM();
   // // load $0, 131102
@@ -52,26 +136,45 @@ int main(int argc, char** argv) {
   // mv.print_regs();
 
   if (argc < 2) {
-        std::cerr << "Usage: " << argv[0] << " -repl | -c <filename1> [filename2] [...]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " -repl | -c | -bench [-O0|-O1|-O2] <filename1> [filename2] [...]" << std::endl;
         return 1;
     }
 
     std::string option = argv[1];
+    auto level = TPV::Opt_Level::O2;
 
     if (option == "-repl") {
         TPV::repl();
     } else if (option == "-c") {
         if (argc < 3) {
-            std::cerr << "Usage: " << argv[0] << " -c <filename1> [filename2] [...]" << std::endl;
+            std::cerr << "Usage: " << argv[0] << " -c [-O0|-O1|-O2] <filename1> [filename2] [...]" << std::endl;
             return 1;
         }
+        // every file runs on the same VM, reset in between
+        TPV::VM_Pool pool;
         for (int i = 2; i < argc; ++i) {
+            if (auto opt = parse_opt_level(argv[i])) {
+                level = *opt;
+                continue;
+            }
             const char* filename = argv[i];
-            test2(filename);
+            test2(filename, level, pool);
+        }
+    } else if (option == "-bench") {
+        if (argc < 3) {
+            std::cerr << "Usage: " << argv[0] << " -bench [-O0|-O1|-O2] <filename1> [filename2] [...]" << std::endl;
+            return 1;
+        }
+        for (int i = 2; i < argc; ++i) {
+            if (auto opt = parse_opt_level(argv[i])) {
+                level = *opt;
+                continue;
+            }
+            bench(argv[i], level);
         }
     } else {
         std::cerr << "Unknown option: " << option << std::endl;
-        std::cerr << "Usage: " << argv[0] << " -repl | -c <filename1> [filename2] [...]" << std::endl;
+        std::cerr << "Usage: " << argv[0] << " -repl | -c | -bench [-O0|-O1|-O2] <filename1> [filename2] [...]" << std::endl;
         return 1;
     }
 
@@ -0,0 +1,956 @@
+#include "optimizer.hpp"
+
+#include <array>
+#include <bit>
+#include <cstdint>
+#include <limits>
+#include <optional>
+#include <string>
+
+#include "../instructions.hpp"
+#include "../utils.hpp"
+#include "../value.hpp"
+#include "../vm/cfg.hpp"
+#include "../vm/decoder.hpp"
+#include "../vm/type_inference.hpp"
+#include "../vm/verifier.hpp"
+#include "../vm/vm.hpp"
+
+namespace TPV {
+
+namespace {
+
+// register operands are one byte
+constexpr size_t REGISTER_COUNT = 256;
+// simplify and drop dead writes until nothing changes, or this many times
+constexpr int MAX_ROUNDS = 8;
+
+// what is known about a register at some point of the program
+struct Info {
+  enum class Kind : uint8_t {
+    UNDEF,    // no path got here yet
+    CONST,    // always type and bits
+    TYPED,    // always type
+    VARYING,  // anything
+  };
+
+  Kind kind = Kind::UNDEF;
+  ValueType type = ValueType::TPV_INT;
+  int32_t bits = 0;
+
+  bool operator==(const Info&) const = default;
+};
+
+using State = std::array<Info, REGISTER_COUNT>;
+
+Info constant(ValueType type, int32_t bits) {
+  return {.kind = Info::Kind::CONST, .type = type, .bits = bits};
+}
+
+Info typed(ValueType type) {
+  return {.kind = Info::Kind::TYPED, .type = type, .bits = 0};
+}
+
+Info varying() {
+  return {.kind = Info::Kind::VARYING, .type = ValueType::TPV_INT, .bits = 0};
+}
+
+bool known(const Info& info) {
+  return info.kind == Info::Kind::CONST || info.kind == Info::Kind::TYPED;
+}
+
+Info join(const Info& a, const Info& b) {
+  if (a.kind == Info::Kind::UNDEF || a == b) {
+    return b;
+  }
+  if (b.kind == Info::Kind::UNDEF) {
+    return a;
+  }
+  if (known(a) && known(b) && a.type == b.type) {
+    return typed(a.type);
+  }
+  return varying();
+}
+
+float as_float(int32_t bits) {
+  return std::bit_cast<float>(bits);
+}
+
+int32_t float_bits(float value) {
+  return std::bit_cast<int32_t>(value);
+}
+
+// what running ins does to the register it writes
+struct Outcome {
+  bool writes = false;
+  uint8_t reg = 0;
+  // reg afterwards
+  Info value;
+  // reg is overwritten whatever happens
+  bool always = false;
+  // no side effect and cannot fail, so it may go if reg is dead
+  bool pure = false;
+};
+
+bool is_compare(Opcode op) {
+  switch (op) {
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::LT:
+    case Opcode::LTE:
+      return true;
+    default:
+      return false;
+  }
+}
+
+// the handlers' arithmetic on two constants of one type, std::nullopt where
+// the handler reports an error (or traps) instead. Int ops wrap like the
+// machine does
+std::optional<int32_t> fold_binary(Opcode op,
+                                   ValueType type,
+                                   int32_t a,
+                                   int32_t b) {
+  if (type == ValueType::TPV_INT) {
+    const auto ua = static_cast<uint32_t>(a);
+    const auto ub = static_cast<uint32_t>(b);
+    switch (op) {
+      case Opcode::ADD:
+        return static_cast<int32_t>(ua + ub);
+      case Opcode::SUB:
+        return static_cast<int32_t>(ua - ub);
+      case Opcode::MUL:
+        return static_cast<int32_t>(ua * ub);
+      case Opcode::DIV:
+        if (b == 0 || (a == std::numeric_limits<int32_t>::min() && b == -1)) {
+          return std::nullopt;
+        }
+        return a / b;
+      case Opcode::EQ:
+        return a == b;
+      case Opcode::NEQ:
+        return a != b;
+      case Opcode::GT:
+        return a > b;
+      case Opcode::GTE:
+        return a >= b;
+      case Opcode::LT:
+        return a < b;
+      case Opcode::LTE:
+        return a <= b;
+      case Opcode::BITAND:
+        return a & b;
+      case Opcode::BITOR:
+        return a | b;
+      case Opcode::BITXOR:
+        return a ^ b;
+      default:
+        return std::nullopt;
+    }
+  }
+
+  const auto fa = as_float(a);
+  const auto fb = as_float(b);
+  switch (op) {
+    case Opcode::ADD:
+      return float_bits(fa + fb);
+    case Opcode::SUB:
+      return float_bits(fa - fb);
+    case Opcode::MUL:
+      return float_bits(fa * fb);
+    case Opcode::DIV:
+      if (fb == 0.0f) {
+        return std::nullopt;
+      }
+      return float_bits(fa / fb);
+    case Opcode::EQ:
+      return fa == fb;
+    case Opcode::NEQ:
+      return fa != fb;
+    case Opcode::GT:
+      return fa > fb;
+    case Opcode::GTE:
+      return fa >= fb;
+    case Opcode::LT:
+      return fa < fb;
+    case Opcode::LTE:
+      return fa <= fb;
+    default:
+      return std::nullopt;
+  }
+}
+
+std::optional<int32_t> fold_unary(Opcode op,
+                                  ValueType type,
+                                  int32_t a,
+                                  int32_t imm) {
+  const bool is_int = type == ValueType::TPV_INT;
+  switch (op) {
+    case Opcode::BITNOT:
+      return ~a;
+    case Opcode::BITSHL:
+      return a << imm;
+    case Opcode::BITSHRL:
+      return static_cast<int32_t>(static_cast<uint32_t>(a) >> imm);
+    case Opcode::BITSHRA:
+      return a >> imm;
+    case Opcode::CVT_I_D:
+      return is_int ? float_bits(static_cast<float>(a)) : a;
+    case Opcode::CVT_D_I: {
+      if (is_int) {
+        return a;
+      }
+      // out of range and NaN are not defined in C++, leave them to the VM
+      const auto f = as_float(a);
+      if (!(f >= -2147483648.0f && f < 2147483648.0f)) {
+        return std::nullopt;
+      }
+      return static_cast<int32_t>(f);
+    }
+    case Opcode::NEGATE:
+      return is_int ? float_bits(static_cast<float>(static_cast<int32_t>(
+                          0u - static_cast<uint32_t>(a))))
+                    : float_bits(-as_float(a));
+    default:
+      return std::nullopt;
+  }
+}
+
+Outcome evaluate(const Instr& ins, const State& state) {
+  const auto& a = state[ins.r1];
+  const auto& b = state[ins.r2];
+
+  auto write = [](uint8_t reg, Info value, bool always, bool pure) {
+    return Outcome{.writes = true,
+                   .reg = reg,
+                   .value = value,
+                   .always = always,
+                   .pure = pure};
+  };
+  // a type error leaves rd as it was
+  const auto may_fail = write(ins.rd, varying(), false, false);
+
+  switch (ins.op) {
+    case Opcode::SETI:
+      return write(ins.rd, constant(ValueType::TPV_INT, ins.imm), true, true);
+    case Opcode::SETF:
+      return write(ins.rd, constant(ValueType::TPV_FLOAT, ins.imm), true,
+                   true);
+    case Opcode::SETNIL:
+      return write(ins.rd, typed(ValueType::TPV_UNIT), true, true);
+    case Opcode::SETS:
+    case Opcode::NEW_ARRAY:
+      return write(ins.rd, typed(ValueType::TPV_OBJ), true, false);
+    case Opcode::STORE: {
+      // an int or a float always fits its table, an OBJ may be an array
+      const bool fits =
+          known(a) && ((ins.imm == 0 && a.type == ValueType::TPV_INT) ||
+                       (ins.imm == 1 && a.type == ValueType::TPV_FLOAT));
+      if (fits) {
+        return write(ins.rd, typed(ValueType::TPV_INT), true, false);
+      }
+      return write(ins.rd, join(state[ins.rd], typed(ValueType::TPV_INT)),
+                   false, false);
+    }
+    case Opcode::LOAD: {
+      // the index may not be an int or not in the table
+      const auto type = ins.imm == 0   ? ValueType::TPV_INT
+                        : ins.imm == 1 ? ValueType::TPV_FLOAT
+                                       : ValueType::TPV_OBJ;
+      return write(ins.rd, join(state[ins.rd], typed(type)), false, false);
+    }
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL:
+    case Opcode::DIV:
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::LT:
+    case Opcode::LTE:
+    case Opcode::BITAND:
+    case Opcode::BITOR:
+    case Opcode::BITXOR: {
+      const bool bitwise = ins.op == Opcode::BITAND ||
+                           ins.op == Opcode::BITOR || ins.op == Opcode::BITXOR;
+      if (!known(a) || !known(b) || a.type != b.type ||
+          !(a.type == ValueType::TPV_INT ||
+            (!bitwise && a.type == ValueType::TPV_FLOAT))) {
+        return may_fail;
+      }
+
+      const auto type = is_compare(ins.op) ? ValueType::TPV_INT : a.type;
+      if (a.kind == Info::Kind::CONST && b.kind == Info::Kind::CONST) {
+        const auto bits = fold_binary(ins.op, a.type, a.bits, b.bits);
+        return bits ? write(ins.rd, constant(type, *bits), true, true)
+                    : may_fail;
+      }
+      if (ins.op == Opcode::DIV) {
+        // the divisor may be zero
+        return write(ins.rd, join(state[ins.rd], typed(type)), false, false);
+      }
+      return write(ins.rd, typed(type), true, true);
+    }
+    case Opcode::BITNOT:
+    case Opcode::BITSHL:
+    case Opcode::BITSHRL:
+    case Opcode::BITSHRA:
+    case Opcode::CVT_I_D:
+    case Opcode::CVT_D_I:
+    case Opcode::NEGATE: {
+      const bool int_only = ins.op != Opcode::CVT_I_D &&
+                            ins.op != Opcode::CVT_D_I &&
+                            ins.op != Opcode::NEGATE;
+      if (!known(a) || !(a.type == ValueType::TPV_INT ||
+                         (!int_only && a.type == ValueType::TPV_FLOAT))) {
+        return may_fail;
+      }
+
+      const auto type =
+          ins.op == Opcode::CVT_I_D || ins.op == Opcode::NEGATE
+              ? ValueType::TPV_FLOAT
+              : ValueType::TPV_INT;
+      if (a.kind == Info::Kind::CONST) {
+        const auto bits = fold_unary(ins.op, a.type, a.bits, ins.imm);
+        if (bits) {
+          return write(ins.rd, constant(type, *bits), true, true);
+        }
+      }
+      return write(ins.rd, typed(type), true, true);
+    }
+    case Opcode::POP:
+      // the stack may be empty
+      return may_fail;
+    case Opcode::VMCALL:
+      // input services write r1 unless reading fails
+      if (ins.imm >= 1 && ins.imm <= 3) {
+        return write(ins.r1, varying(), false, false);
+      }
+      return {};
+    default:
+      // anything else with an rd may change it
+      switch (operands_of(ins.op)) {
+        case Operands::RD:
+        case Operands::RD_R1:
+        case Operands::RD_R1_R2:
+        case Operands::RD_IMM:
+        case Operands::RD_STR:
+        case Operands::RD_R1_IMM:
+          return may_fail;
+        default:
+          return {};
+      }
+  }
+}
+
+// registers ins reads
+Registers reads_of(const Instr& ins) {
+  switch (ins.op) {
+    case Opcode::CALL:
+    case Opcode::TAILCALL:
+    case Opcode::SET_ARG:
+    case Opcode::GET_ARG:
+      // a call hands the whole register file to the callee
+      return Registers{}.set();
+    default:
+      return read(ins);
+  }
+}
+
+// operands a copy may stand in for: registers that are only read
+std::array<uint8_t*, 2> copy_operands(Instr& ins) {
+  switch (ins.op) {
+    case Opcode::CALL:
+    case Opcode::TAILCALL:
+    case Opcode::VMCALL:
+      // calls read every register, VMCALL input writes r1
+      return {nullptr, nullptr};
+    default:
+      break;
+  }
+
+  switch (operands_of(ins.op)) {
+    case Operands::R1:
+    case Operands::RD_R1:
+    case Operands::RD_R1_IMM:
+    case Operands::R1_IMM:
+      return {&ins.r1, nullptr};
+    case Operands::RD_R1_R2:
+    case Operands::R1_R2_IMM:
+      return {&ins.r1, &ins.r2};
+    default:
+      return {nullptr, nullptr};
+  }
+}
+
+// ins puts the Value of r1 into rd unchanged
+bool is_copy(const Instr& ins, const State& state) {
+  const auto& a = state[ins.r1];
+  return known(a) &&
+         ((ins.op == Opcode::CVT_I_D && a.type == ValueType::TPV_FLOAT) ||
+          (ins.op == Opcode::CVT_D_I && a.type == ValueType::TPV_INT));
+}
+
+// forward dataflow: Info of every register at the start of each block,
+// UNDEF everywhere for blocks no path reaches
+std::vector<State> propagate(const std::vector<Instr>& code,
+                             const Blocks& blocks) {
+  std::vector<State> in(blocks.starts.size());
+  std::vector<bool> queued(blocks.starts.size(), false);
+  std::vector<uint32_t> work;
+
+  // registers hold whatever an earlier load left in them
+  in[0].fill(varying());
+  work.push_back(0);
+  queued[0] = true;
+
+  while (!work.empty()) {
+    const auto block = work.back();
+    work.pop_back();
+    queued[block] = false;
+
+    auto state = in[block];
+    const auto end = blocks.end(block, code.size());
+    for (size_t idx = blocks.starts[block]; idx < end; idx++) {
+      const auto outcome = evaluate(code[idx], state);
+      if (outcome.writes) {
+        state[outcome.reg] = outcome.value;
+      }
+    }
+
+    for (const auto succ : successors(code, blocks, block)) {
+      bool changed = false;
+      for (size_t r = 0; r < REGISTER_COUNT; r++) {
+        const auto joined = join(in[succ][r], state[r]);
+        changed = changed || joined != in[succ][r];
+        in[succ][r] = joined;
+      }
+      if (changed && !queued[succ]) {
+        queued[succ] = true;
+        work.push_back(succ);
+      }
+    }
+  }
+
+  return in;
+}
+
+bool reached(const State& state) {
+  return state[0].kind != Info::Kind::UNDEF;
+}
+
+// drop the marked instructions and point jumps at what follows them
+void compact(std::vector<Instr>& code, std::vector<bool> dead) {
+  // a JMP to the instruction right after it does nothing
+  std::vector<uint32_t> next_kept(code.size() + 1);
+  bool dropped = true;
+  while (dropped) {
+    dropped = false;
+    next_kept[code.size()] = static_cast<uint32_t>(code.size());
+    for (size_t idx = code.size(); idx-- > 0;) {
+      next_kept[idx] = dead[idx] ? next_kept[idx + 1] : idx;
+    }
+    for (size_t idx = 0; idx < code.size(); idx++) {
+      if (!dead[idx] && code[idx].op == Opcode::JMP &&
+          next_kept[code[idx].imm] == next_kept[idx + 1]) {
+        dead[idx] = true;
+        dropped = true;
+      }
+    }
+  }
+
+  std::vector<int32_t> new_index(code.size());
+  int32_t kept = 0;
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    new_index[idx] = kept;
+    kept += dead[idx] ? 0 : 1;
+  }
+
+  std::vector<Instr> out;
+  out.reserve(kept);
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    if (dead[idx]) {
+      continue;
+    }
+    auto ins = code[idx];
+    if (ins.op == Opcode::JMP || ins.op == Opcode::JMP_IF) {
+      ins.imm = new_index[ins.imm];
+    }
+    out.push_back(ins);
+  }
+  code = std::move(out);
+}
+
+// folding, constant branches, redundant sets, copies and unreachable blocks.
+// Returns true if code changed
+bool simplify(std::vector<Instr>& code, bool is_body) {
+  const auto blocks = find_blocks(code, 0, is_body);
+  const auto in = propagate(code, blocks);
+  std::vector<bool> dead(code.size(), false);
+  bool changed = false;
+
+  for (size_t block = 0; block < blocks.starts.size(); block++) {
+    const auto end = blocks.end(block, code.size());
+    if (!reached(in[block])) {
+      for (size_t idx = blocks.starts[block]; idx < end; idx++) {
+        // the decoder puts END back anyway, keep it for the jumps to it
+        dead[idx] = code[idx].op != Opcode::END;
+        changed = changed || dead[idx];
+      }
+      continue;
+    }
+
+    auto state = in[block];
+    // copy_of[r]: r holds the same Value as that register, within this block
+    std::array<int16_t, REGISTER_COUNT> copy_of;
+    copy_of.fill(-1);
+
+    for (size_t idx = blocks.starts[block]; idx < end; idx++) {
+      auto& ins = code[idx];
+
+      for (auto* r : copy_operands(ins)) {
+        if (r && copy_of[*r] >= 0) {
+          *r = static_cast<uint8_t>(copy_of[*r]);
+          changed = true;
+        }
+      }
+
+      const auto outcome = evaluate(ins, state);
+      const bool copy = is_copy(ins, state);
+
+      if (ins.op == Opcode::JMP_IF &&
+          state[ins.r1].kind == Info::Kind::CONST) {
+        const auto& cond = state[ins.r1];
+        const bool taken = cond.type == ValueType::TPV_INT
+                               ? cond.bits != 0
+                               : as_float(cond.bits) != 0.0f;
+        if (taken) {
+          ins.op = Opcode::JMP;
+          ins.r1 = 0;
+        } else {
+          dead[idx] = true;
+        }
+        changed = true;
+      } else if (outcome.pure && outcome.value.kind == Info::Kind::CONST) {
+        if (state[outcome.reg] == outcome.value) {
+          dead[idx] = true;
+          changed = true;
+        } else if (ins.op != Opcode::SETI && ins.op != Opcode::SETF) {
+          ins = {.op = outcome.value.type == ValueType::TPV_INT
+                           ? Opcode::SETI
+                           : Opcode::SETF,
+                 .rd = ins.rd,
+                 .r1 = 0,
+                 .r2 = 0,
+                 .imm = outcome.value.bits};
+          changed = true;
+        }
+      } else if (copy && ins.rd == ins.r1) {
+        dead[idx] = true;
+        changed = true;
+      }
+
+      if (outcome.writes) {
+        copy_of[outcome.reg] = -1;
+        for (auto& source : copy_of) {
+          source = source == outcome.reg ? -1 : source;
+        }
+        state[outcome.reg] = outcome.value;
+      }
+      if (copy && !dead[idx] && ins.rd != ins.r1) {
+        copy_of[ins.rd] = ins.r1;
+      }
+    }
+  }
+
+  if (changed) {
+    compact(code, std::move(dead));
+  }
+  return changed;
+}
+
+// backward liveness, every register is live where the program stops and
+// none but the result where a body returns. Pure writes to a dead register
+// are dropped. Returns true if code changed
+bool drop_dead_writes(std::vector<Instr>& code, bool is_body) {
+  const auto blocks = find_blocks(code, 0, is_body);
+  const auto in = propagate(code, blocks);
+
+  std::vector<Outcome> outcomes(code.size());
+  for (size_t block = 0; block < blocks.starts.size(); block++) {
+    auto state = in[block];
+    for (size_t idx = blocks.starts[block];
+         idx < blocks.end(block, code.size()); idx++) {
+      outcomes[idx] = evaluate(code[idx], state);
+      if (outcomes[idx].writes) {
+        state[outcomes[idx].reg] = outcomes[idx].value;
+      }
+    }
+  }
+
+  std::vector<Registers> live_in(blocks.starts.size());
+  auto live_out = [&](size_t block) {
+    const auto succs = successors(code, blocks, block);
+    Registers live;
+    if (succs.empty() &&
+        code[blocks.end(block, code.size()) - 1].op != Opcode::RETURN) {
+      live.set();
+    }
+    for (const auto succ : succs) {
+      live |= live_in[succ];
+    }
+    return live;
+  };
+
+  // live after idx -> live before it, false if ins can go
+  auto step = [&](size_t idx, Registers& live) {
+    const auto& outcome = outcomes[idx];
+    if (outcome.writes && outcome.pure && !live.test(outcome.reg)) {
+      return false;
+    }
+    if (outcome.writes && outcome.always) {
+      live.reset(outcome.reg);
+    }
+    live |= reads_of(code[idx]);
+    return true;
+  };
+
+  bool changed = true;
+  while (changed) {
+    changed = false;
+    for (size_t block = blocks.starts.size(); block-- > 0;) {
+      auto live = live_out(block);
+      for (size_t idx = blocks.end(block, code.size());
+           idx-- > blocks.starts[block];) {
+        step(idx, live);
+      }
+      if (live != live_in[block]) {
+        live_in[block] = live;
+        changed = true;
+      }
+    }
+  }
+
+  std::vector<bool> dead(code.size(), false);
+  bool dropped = false;
+  for (size_t block = 0; block < blocks.starts.size(); block++) {
+    auto live = live_out(block);
+    for (size_t idx = blocks.end(block, code.size());
+         idx-- > blocks.starts[block];) {
+      dead[idx] = !step(idx, live);
+      dropped = dropped || dead[idx];
+    }
+  }
+
+  if (dropped) {
+    compact(code, std::move(dead));
+  }
+  return dropped;
+}
+
+// inverse of decode_function, jumps to END go to the end of the bytes
+std::vector<uint8_t> encode(const TPV_Function& func) {
+  const auto& code = func.code;
+
+  auto size_of = [&](const Instr& ins) -> size_t {
+    switch (operands_of(ins.op)) {
+      case Operands::NONE:
+        return 1;
+      case Operands::RD:
+      case Operands::R1:
+        return 2;
+      case Operands::RD_R1:
+        return 3;
+      case Operands::RD_R1_R2:
+        return 4;
+      case Operands::IMM:
+        return 5;
+      case Operands::RD_IMM:
+      case Operands::R1_IMM:
+        return 6;
+      case Operands::RD_R1_IMM:
+      case Operands::R1_R2_IMM:
+        return 7;
+      case Operands::RD_STR:
+        return 3 + func.str_literals[ins.imm].size();
+    }
+    return 1;
+  };
+
+  std::vector<size_t> offset_of(code.size());
+  size_t offset = 0;
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    offset_of[idx] = offset;
+    offset += code[idx].op == Opcode::END ? 0 : size_of(code[idx]);
+  }
+
+  std::vector<uint8_t> bytes;
+  bytes.reserve(offset);
+  auto put_word = [&](int32_t word) {
+    const auto encoded = int32_to_bytes(word);
+    bytes.insert(bytes.end(), encoded.begin(), encoded.end());
+  };
+
+  for (const auto& ins : code) {
+    if (ins.op == Opcode::END) {
+      continue;
+    }
+
+    bytes.push_back(static_cast<uint8_t>(ins.op));
+    const auto imm = ins.op == Opcode::JMP || ins.op == Opcode::JMP_IF
+                         ? static_cast<int32_t>(offset_of[ins.imm])
+                         : ins.imm;
+    switch (operands_of(ins.op)) {
+      case Operands::NONE:
+        break;
+      case Operands::RD:
+        bytes.push_back(ins.rd);
+        break;
+      case Operands::R1:
+        bytes.push_back(ins.r1);
+        break;
+      case Operands::RD_R1:
+        bytes.insert(bytes.end(), {ins.rd, ins.r1});
+        break;
+      case Operands::RD_R1_R2:
+        bytes.insert(bytes.end(), {ins.rd, ins.r1, ins.r2});
+        break;
+      case Operands::IMM:
+        put_word(imm);
+        break;
+      case Operands::RD_IMM:
+        bytes.push_back(ins.rd);
+        put_word(imm);
+        break;
+      case Operands::R1_IMM:
+        bytes.push_back(ins.r1);
+        put_word(imm);
+        break;
+      case Operands::RD_R1_IMM:
+        bytes.insert(bytes.end(), {ins.rd, ins.r1});
+        put_word(imm);
+        break;
+      case Operands::R1_R2_IMM:
+        bytes.insert(bytes.end(), {ins.r1, ins.r2});
+        put_word(imm);
+        break;
+      case Operands::RD_STR: {
+        const auto& str = func.str_literals[ins.imm];
+        bytes.push_back(ins.rd);
+        bytes.insert(bytes.end(), str.begin(), str.end());
+        bytes.push_back(0);
+        break;
+      }
+    }
+  }
+  return bytes;
+}
+
+// code the optimizer leaves alone: anything the VM rejects at load time, it
+// reports the error for the bytes as written
+bool can_optimize(const TPV_Function& func) {
+  auto scratch = func;
+  std::vector<Error> errors;
+  return verify_function(scratch, std::numeric_limits<size_t>::max(),
+                         MAX_REGISTERS, errors) &&
+         infer_types(scratch, 0, errors);
+}
+
+// a load split the way VM::load_bytes splits it: main is everything outside
+// FUNCDEF ... FUNCEND, a body is what is between them. A body's jumps are
+// relative to the body and main's do not count the bodies
+struct Split_Load {
+  struct Function {
+    // FUNCDEF and FUNCEND as written
+    std::vector<uint8_t> def;
+    std::vector<uint8_t> end;
+    std::vector<uint8_t> body;
+  };
+
+  std::vector<uint8_t> main;
+  std::vector<Function> functions;
+};
+
+// std::nullopt for bytes the VM would not split
+std::optional<Split_Load> split_load(const std::vector<uint8_t>& bytes) {
+  Split_Load load;
+  Split_Load::Function* func = nullptr;
+  size_t offset = 0;
+  while (offset < bytes.size()) {
+    const auto size = instruction_size(bytes, offset);
+    if (!size) {
+      return std::nullopt;
+    }
+    const auto op = static_cast<Opcode>(bytes[offset]);
+    const std::vector<uint8_t> ins(bytes.begin() + offset,
+                                   bytes.begin() + offset + *size);
+    offset += *size;
+
+    if (op == Opcode::FUNCDEF || op == Opcode::FUNCDEF_G) {
+      if (func) {
+        return std::nullopt;
+      }
+      func = &load.functions.emplace_back();
+      func->def = ins;
+    } else if (func && op == Opcode::FUNCEND) {
+      func->end = ins;
+      func = nullptr;
+    } else {
+      auto& to = func ? func->body : load.main;
+      to.insert(to.end(), ins.begin(), ins.end());
+    }
+  }
+  if (func) {
+    return std::nullopt;
+  }
+  return load;
+}
+
+// a function named name over bytes, for decode_function
+TPV_Function function_of(std::string name, std::vector<uint8_t> bytes) {
+  TPV_Function func{};
+  func.name = std::move(name);
+  func.arity = 0;
+  func.bytes = std::move(bytes);
+  return func;
+}
+
+// CALL rd, r1, imm right before RETURN rd becomes TAILCALL r1, imm. The
+// RETURN stays for jumps to it, and runs if the call fails so rd is returned
+// like before. Only for function bodies, main has no caller to return to.
+// Returns the number of calls rewritten
+size_t rewrite_tail_calls(std::vector<Instr>& code) {
+  size_t rewritten = 0;
+  for (size_t idx = 0; idx + 1 < code.size(); idx++) {
+    auto& ins = code[idx];
+    const auto& next = code[idx + 1];
+    if (ins.op == Opcode::CALL && next.op == Opcode::RETURN &&
+        next.rd == ins.rd) {
+      ins = {.op = Opcode::TAILCALL,
+             .rd = 0,
+             .r1 = ins.r1,
+             .r2 = 0,
+             .imm = ins.imm};
+      rewritten += 1;
+    }
+  }
+  return rewritten;
+}
+
+// simplify and drop dead writes until nothing changes. Returns true if
+// func.code changed
+bool run_rounds(TPV_Function& func, bool is_body, Opt_Level level) {
+  auto code = func.code;
+  bool changed = false;
+  for (int round = 0; round < MAX_ROUNDS; round++) {
+    bool round_changed = simplify(code, is_body);
+    if (level >= Opt_Level::O2) {
+      round_changed = drop_dead_writes(code, is_body) || round_changed;
+    }
+    if (!round_changed) {
+      break;
+    }
+    changed = true;
+  }
+  if (!changed) {
+    return false;
+  }
+
+  // folding can leave an instruction that fails on every path, e.g. a BITOR
+  // that now only ever sees a float. The VM would reject it at load time
+  // instead of running up to it, so keep the code as written
+  std::swap(func.code, code);
+  if (!can_optimize(func)) {
+    func.code = std::move(code);
+    return false;
+  }
+  return true;
+}
+
+// the bytes of main or of a body after the level's rounds, and tail calls in
+// a body. std::nullopt if nothing changed
+std::optional<std::vector<uint8_t>> optimize_function(
+    TPV_Function& func,
+    bool is_body,
+    Opt_Level level,
+    Optimizer_Result& result) {
+  result.instructions_before += func.code.size() - 1;
+  bool changed = false;
+  if (level != Opt_Level::O0 && can_optimize(func)) {
+    changed = run_rounds(func, is_body, level);
+    if (is_body) {
+      const auto count = rewrite_tail_calls(func.code);
+      result.tail_calls += count;
+      changed = changed || count > 0;
+    }
+  }
+  result.instructions_after += func.code.size() - 1;
+  if (!changed) {
+    return std::nullopt;
+  }
+  return encode(func);
+}
+
+}  // namespace
+
+Optimizer_Result optimize(const std::vector<uint8_t>& bytecodes,
+                          Opt_Level level) {
+  const Optimizer_Result unchanged{.bytecodes = bytecodes,
+                                   .instructions_before = 0,
+                                   .instructions_after = 0};
+  const auto load = split_load(bytecodes);
+  if (!load) {
+    return unchanged;
+  }
+
+  // the VM rejects the whole load if any part does not decode
+  std::vector<Error> errors;
+  auto main = function_of("main", load->main);
+  std::vector<TPV_Function> bodies;
+  for (const auto& func : load->functions) {
+    bodies.push_back(function_of("function", func.body));
+  }
+  if (!decode_function(main, errors)) {
+    return unchanged;
+  }
+  for (auto& body : bodies) {
+    if (!decode_function(body, errors)) {
+      return unchanged;
+    }
+  }
+
+  Optimizer_Result result{.bytecodes = {},
+                          .instructions_before = 0,
+                          .instructions_after = 0};
+  bool changed = false;
+  auto optimized = [&](TPV_Function& func, bool is_body) {
+    auto bytes = optimize_function(func, is_body, level, result);
+    changed = changed || bytes;
+    return bytes.value_or(func.bytes);
+  };
+
+  // main first, the VM joins its parts in order anyway and the bodies keep
+  // their order, so CALLs name the same functions
+  auto& bytes = result.bytecodes;
+  bytes = optimized(main, false);
+  for (size_t i = 0; i < bodies.size(); i++) {
+    const auto& func = load->functions[i];
+    const auto body = optimized(bodies[i], true);
+    bytes.insert(bytes.end(), func.def.begin(), func.def.end());
+    bytes.insert(bytes.end(), body.begin(), body.end());
+    bytes.insert(bytes.end(), func.end.begin(), func.end.end());
+    // FUNCDEF and FUNCEND
+    result.instructions_before += 2;
+    result.instructions_after += 2;
+  }
+
+  if (!changed) {
+    result.bytecodes = bytecodes;
+  }
+  return result;
+}
+
+}  // namespace TPV
@@ -0,0 +1,46 @@
+#ifndef OPTIMIZER_HPP
+#define OPTIMIZER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+namespace TPV {
+
+enum class Opt_Level : uint8_t {
+  O0,  // bytes are passed through untouched
+  O1,  // constant folding, copy propagation, unreachable blocks, tail calls
+  O2,  // O1 and dead register writes
+};
+
+struct Optimizer_Result {
+  std::vector<uint8_t> bytecodes;
+  // not counting the END the decoder appends
+  size_t instructions_before;
+  size_t instructions_after;
+  // CALLs followed by a RETURN of their result that became TAILCALL
+  size_t tail_calls = 0;
+};
+
+// rewrite the bytecode of one load, the stage between Parser::parse() and
+// VM::load_bytes(). Main and each function body are split into basic blocks
+// at jump targets and after jumps, then
+// - SETI/SETF constants are folded through arithmetic, compares, bitwise ops
+//   and conversions, and JMP_IF on a constant becomes JMP or goes away
+// - SETI/SETF of a value the register already holds is dropped
+// - reads of a CVT that only copies its operand are sent to the operand
+// - blocks no path reaches are deleted
+// - O2: writes that are overwritten on every path before a read are deleted
+// Every register is live at HLT and at the end, the next load sees them. In a
+// body only the result is live at a RETURN, which ends the frame.
+// Nothing that can fail or has a side effect is removed, so the program
+// reports the same errors. Code the VM would reject is returned unchanged.
+// In function bodies a CALL followed by a RETURN of its result becomes
+// TAILCALL. Main comes out ahead of the function definitions, which keep
+// their order
+Optimizer_Result optimize(const std::vector<uint8_t>& bytecodes,
+                          Opt_Level level);
+
+}  // namespace TPV
+
+#endif  // !OPTIMIZER_HPP
@@ -2,6 +2,7 @@
 #include <cstdint>
 #include <cstring>
 #include <iostream>
+#include <optional>
 #include <stdexcept>
 #include <string>
 #include <variant>
@@ -58,8 +59,17 @@ void Parser::emit_word(uint32_t word) {
 /// collects labels and their corresponding byte offsets. The byte offset is
 /// used to calculate the final bytecode size. The instructions are stored in
 /// the `instructions` vector, and labels are stored in the `labels` map.
+/// The VM splits every FUNCDEF ... FUNCEND body off main and jumps are
+/// relative to the code they are in, so a body counts its offsets from 0 and
+/// main goes on after it as if it was not there. A label right before a
+/// FUNCDEF names that function for CALL
 void Parser::first_pass() {
   uint32_t bytes_offset = 0;
+  // main's offset while in a body
+  std::optional<uint32_t> main_offset;
+  uint32_t function_count = 0;
+  // the label just before the current token, if any
+  std::optional<std::string> last_label;
   while (offset < tokens.tokens.size()) {
     auto token = next_token();
 
@@ -82,7 +92,8 @@ void Parser::first_pass() {
             bytes_offset += 4;
           } else if (std::holds_alternative<StringType>(value_token.value)) {
             instr.str_val = std::get<StringType>(value_token.value);
-            bytes_offset += instr.str_val->value.size();
+            // string bytes plus the null terminator
+            bytes_offset += instr.str_val->value.size() + 1;
           } else {
             err_msg.push_back("Type Error at position " +
                               std::to_string(token.begin));
@@ -153,6 +164,7 @@ void Parser::first_pass() {
           break;
         }
         case Opcode::HLT:
+          bytes_offset += 1;
           break;
         case Opcode::JMP: {
           bytes_offset += 1;
@@ -203,26 +215,112 @@ void Parser::first_pass() {
         }
         case Opcode::GET_ARRAY:
         case Opcode::SET_ARRAY:
-        case Opcode::RM_ARRAY:{
-            instr.rd = std::get<RegisterType>(next_token().value);
-            instr.r1 = std::get<RegisterType>(next_token().value);
-            instr.r2 = std::get<RegisterType>(next_token().value);
-            bytes_offset += 4;
-            break;
+        case Opcode::RM_ARRAY:
+        case Opcode::VADD:
+        case Opcode::VSUB:
+        case Opcode::VMUL:
+        case Opcode::VDIV:
+        case Opcode::VEQ:
+        case Opcode::VNEQ:
+        case Opcode::VGT:
+        case Opcode::VGTE:
+        case Opcode::VLT:
+        case Opcode::VLTE:
+        case Opcode::VDOT:
+        case Opcode::VSCALE: {
+          instr.rd = std::get<RegisterType>(next_token().value);
+          instr.r1 = std::get<RegisterType>(next_token().value);
+          instr.r2 = std::get<RegisterType>(next_token().value);
+          bytes_offset += 4;
+          break;
         }
-        case Opcode::GET_ARRAY_LEN: {
+        case Opcode::GET_ARRAY_LEN:
+        case Opcode::VSUM:
+        case Opcode::VMIN:
+        case Opcode::VMAX: {
           instr.rd = std::get<RegisterType>(next_token().value);
           instr.r1 = std::get<RegisterType>(next_token().value);
           bytes_offset += 3;
           break;
         }
-        case Opcode::NEW_ARRAY:
+        case Opcode::NEW_ARRAY: {
+          instr.rd = std::get<RegisterType>(next_token().value);
+          bytes_offset += 2;
+          break;
+        }
         case Opcode::PUSH:
         case Opcode::POP: {
           instr.r1 = std::get<RegisterType>(next_token().value);
           bytes_offset += 2;
           break;
         }
+        case Opcode::FUNCDEF:
+        case Opcode::FUNCDEF_G: {
+          instr.r1 = std::get<RegisterType>(next_token().value);
+          instr.int_val = std::get<Int32Type>(next_token().value);
+          if (main_offset) {
+            err_msg.push_back("Nested FUNCDEF at position " +
+                              std::to_string(token.line) + ":" +
+                              std::to_string(token.begin));
+            break;
+          }
+          if (last_label) {
+            functions[*last_label] = function_count;
+          }
+          function_count += 1;
+          main_offset = bytes_offset;
+          bytes_offset = 0;
+          break;
+        }
+        case Opcode::FUNCEND: {
+          if (!main_offset) {
+            err_msg.push_back("FUNCEND without FUNCDEF at position " +
+                              std::to_string(token.line) + ":" +
+                              std::to_string(token.begin));
+            break;
+          }
+          bytes_offset = *main_offset;
+          main_offset.reset();
+          break;
+        }
+        case Opcode::SET_ARG: {
+          instr.r1 = std::get<RegisterType>(next_token().value);
+          instr.int_val = std::get<Int32Type>(next_token().value);
+          bytes_offset += 6;
+          break;
+        }
+        case Opcode::GET_ARG: {
+          instr.rd = std::get<RegisterType>(next_token().value);
+          instr.int_val = std::get<Int32Type>(next_token().value);
+          bytes_offset += 6;
+          break;
+        }
+        case Opcode::CALL:
+        case Opcode::TAILCALL: {
+          // TAILCALL has no result register
+          if (instr.op_val.value == Opcode::CALL) {
+            instr.rd = std::get<RegisterType>(next_token().value);
+            bytes_offset += 1;
+          }
+          instr.r1 = std::get<RegisterType>(next_token().value);
+          auto value_token = next_token();
+          if (std::holds_alternative<Int32Type>(value_token.value)) {
+            instr.int_val = std::get<Int32Type>(value_token.value);
+          } else if (std::holds_alternative<LabelRefType>(value_token.value)) {
+            instr.label_ref = std::get<LabelRefType>(value_token.value);
+          } else {
+            err_msg.push_back("Type Error at position " +
+                              std::to_string(value_token.line) + ":" +
+                              std::to_string(value_token.begin));
+          }
+          bytes_offset += 6;
+          break;
+        }
+        case Opcode::RETURN: {
+          instr.rd = std::get<RegisterType>(next_token().value);
+          bytes_offset += 2;
+          break;
+        }
         default:
           err_msg.push_back("Unknown opcode at position " +
                             std::to_string(token.begin));
@@ -230,14 +328,19 @@ void Parser::first_pass() {
       }
 
       instructions.push_back(instr);
+      last_label.reset();
     } else if (token.type == TokenType::LABEL) {
       auto label = std::get<LabelType>(token.value).label;
       labels[label] = bytes_offset;
+      last_label = label;
     } else {
       err_msg.push_back("Unexpected token at position " +
                         std::to_string(token.begin));
     }
   }
+  if (main_offset) {
+    err_msg.push_back("FUNCDEF without FUNCEND");
+  }
 }
 
 /// The second pass generates the bytecode based on the instructions and labels
@@ -316,33 +419,12 @@ void Parser::second_pass() {
         // No additional operands
         break;
       case Opcode::JMP: {
-        if (instr.label_ref.has_value()) {
-          auto label_ref = instr.label_ref->label;
-          auto label_pos = labels.find(label_ref);
-          if (label_pos != labels.end()) {
-            emit_word(label_pos->second);
-          } else {
-            err_msg.push_back("Undefined label: " + label_ref);
-          }
-        } else {
-          emit_word(instr.int_val->value);
-        }
+        emit_label_ref(instr, labels);
         break;
       }
       case Opcode::JMP_IF: {
         emit_byte(instr.r1->value);
-
-        if (instr.label_ref.has_value()) {
-          auto label_ref = instr.label_ref->label;
-          auto label_pos = labels.find(label_ref);
-          if (label_pos != labels.end()) {
-            emit_word(label_pos->second);
-          } else {
-            err_msg.push_back("Undefined label: " + label_ref);
-          }
-        } else {
-          emit_word(instr.int_val->value);
-        }
+        emit_label_ref(instr, labels);
         break;
       }
       case Opcode::VMCALL: {
@@ -351,6 +433,59 @@ void Parser::second_pass() {
         emit_word(instr.int_val->value);
         break;
       }
+      case Opcode::NEW_ARRAY:
+        emit_byte(instr.rd->value);
+        break;
+      case Opcode::FUNCDEF:
+      case Opcode::FUNCDEF_G:
+      case Opcode::SET_ARG:
+        emit_byte(instr.r1->value);
+        emit_word(instr.int_val->value);
+        break;
+      case Opcode::FUNCEND:
+        break;
+      case Opcode::GET_ARG:
+        emit_byte(instr.rd->value);
+        emit_word(instr.int_val->value);
+        break;
+      case Opcode::CALL:
+        emit_byte(instr.rd->value);
+        emit_byte(instr.r1->value);
+        emit_label_ref(instr, functions);
+        break;
+      case Opcode::TAILCALL:
+        emit_byte(instr.r1->value);
+        emit_label_ref(instr, functions);
+        break;
+      case Opcode::RETURN:
+        emit_byte(instr.rd->value);
+        break;
+      case Opcode::GET_ARRAY:
+      case Opcode::SET_ARRAY:
+      case Opcode::RM_ARRAY:
+      case Opcode::VADD:
+      case Opcode::VSUB:
+      case Opcode::VMUL:
+      case Opcode::VDIV:
+      case Opcode::VEQ:
+      case Opcode::VNEQ:
+      case Opcode::VGT:
+      case Opcode::VGTE:
+      case Opcode::VLT:
+      case Opcode::VLTE:
+      case Opcode::VDOT:
+      case Opcode::VSCALE:
+        emit_byte(instr.rd->value);
+        emit_byte(instr.r1->value);
+        emit_byte(instr.r2->value);
+        break;
+      case Opcode::GET_ARRAY_LEN:
+      case Opcode::VSUM:
+      case Opcode::VMIN:
+      case Opcode::VMAX:
+        emit_byte(instr.rd->value);
+        emit_byte(instr.r1->value);
+        break;
       default:
         err_msg.push_back("Unknown opcode");
         break;
@@ -358,6 +493,23 @@ void Parser::second_pass() {
   }
 }
 
+// the immediate, or what refs has for its label
+void Parser::emit_label_ref(
+    const Instruction& instr,
+    const std::unordered_map<std::string, uint32_t>& refs) {
+  if (!instr.label_ref.has_value()) {
+    emit_word(instr.int_val->value);
+    return;
+  }
+  auto label_ref = instr.label_ref->label;
+  auto label_pos = refs.find(label_ref);
+  if (label_pos != refs.end()) {
+    emit_word(label_pos->second);
+  } else {
+    err_msg.push_back("Undefined label: " + label_ref);
+  }
+}
+
 void Parser::print_bytecodes() const {
   for (size_t i = 0; i < bytecodes.size(); ++i) {
     printf("%08b ", bytecodes[i]);
@@ -37,7 +37,10 @@ class Parser {
   uint32_t offset;
   std::vector<std::string> err_msg;
   std::vector<uint8_t> bytecodes;
+  // byte offsets, within the FUNCDEF body a label is in or within main
   std::unordered_map<std::string, uint32_t> labels;
+  // labels right before a FUNCDEF, to the function index CALL takes
+  std::unordered_map<std::string, uint32_t> functions;
   std::vector<Instruction> instructions;
 
   Token next_token();
@@ -45,6 +48,8 @@ class Parser {
   void second_pass();
   void emit_byte(uint8_t byte);
   void emit_word(uint32_t word);
+  void emit_label_ref(const Instruction& instr,
+                      const std::unordered_map<std::string, uint32_t>& refs);
 };
 
 }  // namespace TPV
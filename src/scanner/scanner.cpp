@@ -56,14 +56,35 @@ std::unordered_map<std::string, Opcode> opcode_map = {
     // {"GET_GLOBAL", Opcode::GET_GLOBAL},
     // {"SET_CONSTANT", Opcode::SET_CONSTANT},
     // {"GET_CONSTANT", Opcode::GET_CONSTANT},
+    {"FUNCDEF", Opcode::FUNCDEF},
+    {"FUNCDEF_G", Opcode::FUNCDEF_G},
+    {"FUNCEND", Opcode::FUNCEND},
     {"SET_ARG", Opcode::SET_ARG},
     {"GET_ARG", Opcode::GET_ARG},
     {"CALL", Opcode::CALL},
     {"RETURN", Opcode::RETURN},
+    {"TAILCALL", Opcode::TAILCALL},
     // {"CLOSURE", Opcode::CLOSURE},
     {"NEW_ARRAY", Opcode::NEW_ARRAY},
     {"SET_ARRAY", Opcode::SET_ARRAY},
     {"GET_ARRAY", Opcode::GET_ARRAY},
+    {"RM_ARRAY", Opcode::RM_ARRAY},
+    {"GET_ARRAY_LEN", Opcode::GET_ARRAY_LEN},
+    {"VADD", Opcode::VADD},
+    {"VSUB", Opcode::VSUB},
+    {"VMUL", Opcode::VMUL},
+    {"VDIV", Opcode::VDIV},
+    {"VEQ", Opcode::VEQ},
+    {"VNEQ", Opcode::VNEQ},
+    {"VGT", Opcode::VGT},
+    {"VGTE", Opcode::VGTE},
+    {"VLT", Opcode::VLT},
+    {"VLTE", Opcode::VLTE},
+    {"VDOT", Opcode::VDOT},
+    {"VSCALE", Opcode::VSCALE},
+    {"VSUM", Opcode::VSUM},
+    {"VMIN", Opcode::VMIN},
+    {"VMAX", Opcode::VMAX},
     {"IGL", Opcode::IGL},
     {"NOP", Opcode::NOP}};
 
@@ -12,7 +12,7 @@
 namespace TPV {
 
 template <typename T>
-auto to_integral(T e) {
+constexpr auto to_integral(T e) {
   return static_cast<std::underlying_type_t<T>>(e);
 }
 
@@ -45,6 +45,13 @@ inline int32_t bytes_to_int32(const std::vector<uint8_t>& bytes) {
   return value;
 }
 
+// read a big endian 32bit word in place, caller checks there are 4 bytes
+inline int32_t read_int32(const uint8_t* bytes) {
+  return static_cast<int32_t>((uint32_t(bytes[0]) << 24) |
+                              (uint32_t(bytes[1]) << 16) |
+                              (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]));
+}
+
 inline float_t bytes_to_float32(const std::vector<uint8_t>& bytes) {
   int32_t value = 0;
   for (size_t i = 0; i < bytes.size(); ++i) {
@@ -68,10 +75,6 @@ inline std::string bytes_to_string(const std::vector<uint8_t>& bytes) {
   return result;
 }
 
-inline std::int32_t hash_string(const std::string& str) {
-  return std::hash<std::string>{}(str);
-}
-
 }  // namespace TPV
 
 #endif  // !UTILS_HPP
\ No newline at end of file
@@ -2,4 +2,49 @@
 
 namespace TPV {
 
-}
\ No newline at end of file
+void TPV_ObjArray::erase(size_t idx) {
+  switch (kind) {
+    case Kind::INTS:
+      ints.erase(ints.begin() + idx);
+      break;
+    case Kind::FLOATS:
+      floats.erase(floats.begin() + idx);
+      break;
+    default:
+      values.erase(values.begin() + idx);
+      break;
+  }
+}
+
+void TPV_ObjArray::assign(std::vector<TPV_INT> elements) {
+  kind = Kind::INTS;
+  ints = std::move(elements);
+  floats = std::vector<TPV_FLOAT>();
+  values = std::vector<Value>();
+}
+
+void TPV_ObjArray::assign(std::vector<TPV_FLOAT> elements) {
+  kind = Kind::FLOATS;
+  floats = std::move(elements);
+  ints = std::vector<TPV_INT>();
+  values = std::vector<Value>();
+}
+
+void TPV_ObjArray::unpack() {
+  values.clear();
+  values.reserve(size() + 1);
+  if (kind == Kind::INTS) {
+    for (const auto element : ints) {
+      values.push_back(from_raw_value(element));
+    }
+  } else {
+    for (const auto element : floats) {
+      values.push_back(from_raw_value(element));
+    }
+  }
+  kind = Kind::VALUES;
+  ints = std::vector<TPV_INT>();
+  floats = std::vector<TPV_FLOAT>();
+}
+
+}  // namespace TPV
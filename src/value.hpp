@@ -2,13 +2,15 @@
 #define VALUE_HPP
 
 #include <array>
+#include <bit>
 #include <cstdint>
 #include <memory>
 #include <string>
 #include <unordered_map>
-#include <variant>
+#include <type_traits>
 #include <vector>
 #include "common.hpp"
+#include "instructions.hpp"
 
 namespace TPV {
 
@@ -16,44 +18,130 @@ struct Value;
 
 enum class ObjType { FUNCTION, MODULE, STRING, UPVALUE, FOREIGN, ARRAY, UNIT };
 
-struct TPV_Unit {};
+// native code and hotness counters of a function, see jit/jit.hpp
+struct Jit_Function;
+
+struct TPV_Function;
+
+// where a CALL goes, resolved once when VM::load_bytes links the caller.
+// arity and num_registers are the callee's, kept here so a call finds
+// everything it needs in one place
+struct Call_Target {
+  TPV_Function* function;
+  uint32_t arity;
+  uint32_t num_registers;
+};
 
 struct TPV_Function {
   std::string name;
+  // arguments a CALL must set, one past the highest GET_ARG reads
   size_t arity;
   std::vector<uint8_t> bytes;
+
+  // decoded from bytes by decode_function, this is what the VM runs
+  std::vector<Instr> code;
+  std::vector<std::string> str_literals;
+  // String_Table handle of every str_literals entry, interned by
+  // VM::load_bytes so SETS only looks one up
+  std::vector<uint32_t> str_constants;
+  // every function this one calls, CALL's imm indexes it once VM::load_bytes
+  // linked the code
+  std::vector<Call_Target> call_targets;
+  // highest register used + 1, set by verify_function
+  size_t num_registers = 0;
+  // NEW_ARRAY_SCRATCHs, each has its own array in a frame running this
+  // function. Set by allocate_scratch_arrays
+  uint32_t scratch_arrays = 0;
+
+  // created once a loop or call in this function runs, dropped when code is
+  // decoded again
+  std::shared_ptr<Jit_Function> jit;
+};
+
+// what a TPV_OBJ Value points at. Objects are made by VM::new_object and
+// owned by VM::heap, a Value only borrows them
+struct TPV_Object {
+  ObjType type;
+  // reached in the collection that is running, see vm/gc.hpp
+  bool marked = false;
+  // old object in VM::remembered, it may point into the nursery
+  bool remembered = false;
+  // one of VM::scratch, neither in the nursery nor in the heap
+  bool scratch = false;
+  // where a minor collection moved a young object to
+  TPV_Object* forward = nullptr;
+
+  explicit TPV_Object(ObjType type) : type(type) {}
+  virtual ~TPV_Object() = default;
 };
 
-struct TPV_ObjString {
+struct TPV_ObjString : TPV_Object {
   size_t hash;
   std::string value;
+
+  TPV_ObjString(size_t hash, std::string value)
+      : TPV_Object(ObjType::STRING), hash(hash), value(std::move(value)) {}
 };
 
-struct TPV_ObjFunction {
+struct TPV_ObjFunction : TPV_Object {
   TPV_Function* func;
-  std::unordered_map<std::string, std::shared_ptr<TPV_ObjString>> str_table;
-  std::unordered_map<std::string, std::shared_ptr<TPV_ObjFunction>> func_table;
+  std::unordered_map<std::string, TPV_ObjString*> str_table;
+  std::unordered_map<std::string, TPV_ObjFunction*> func_table;
   size_t upvalue_count;
   size_t stack_size;
   uint8_t* stack_frame;
+
+  TPV_ObjFunction() : TPV_Object(ObjType::FUNCTION) {}
+};
+
+struct TPV_ObjModule : TPV_Object {
+  TPV_ObjModule() : TPV_Object(ObjType::MODULE) {}
 };
 
-struct TPV_ObjModule {};
+struct TPV_ObjUpvalue : TPV_Object {
+  TPV_ObjUpvalue() : TPV_Object(ObjType::UPVALUE) {}
+};
 
-struct TPV_ObjUpvalue {};
+// elements of an array. While every element is an int, or every element is
+// a float, they are packed in ints or floats, 4 bytes each. Storing anything
+// else moves them all to values for good. An empty array takes the kind of
+// the next element stored
+struct TPV_ObjArray : TPV_Object {
+  enum class Kind : uint8_t { INTS, FLOATS, VALUES };
 
-struct TPV_ObjArray {
+  Kind kind = Kind::INTS;
+  std::vector<TPV_INT> ints;
+  std::vector<TPV_FLOAT> floats;
   std::vector<Value> values;
-};
 
-struct TPV_Obj {
-  ObjType type;
-  std::variant<std::shared_ptr<TPV_ObjString>,
-               std::shared_ptr<TPV_ObjArray>,
-               std::shared_ptr<TPV_ObjFunction>,
-               std::shared_ptr<TPV_ObjModule>,
-               std::shared_ptr<TPV_ObjUpvalue>>
-      obj;
+  TPV_ObjArray() : TPV_Object(ObjType::ARRAY) {}
+
+  size_t size() const;
+  // element idx as a Value, std::out_of_range past the end
+  Value get(size_t idx) const;
+  // idx == size() appends, it is the only way an array grows
+  void set(size_t idx, const Value& value);
+  void erase(size_t idx);
+  // no elements, the buffers are kept for the next ones
+  void clear() {
+    kind = Kind::INTS;
+    ints.clear();
+    floats.clear();
+    values.clear();
+  }
+  // replace every element, the array packs them
+  void assign(std::vector<TPV_INT> elements);
+  void assign(std::vector<TPV_FLOAT> elements);
+  // memory the element buffers hold
+  size_t capacity_bytes() const {
+    return ints.capacity() * sizeof(TPV_INT) +
+           floats.capacity() * sizeof(TPV_FLOAT) +
+           values.capacity() * sizeof(uint64_t);
+  }
+
+ private:
+  // the packed elements as Values, kind becomes VALUES
+  void unpack();
 };
 
 /*
@@ -71,68 +159,141 @@ inline const char* get_value_type_name(ValueType type) {
   return value_type_names[static_cast<std::underlying_type_t<ValueType>>(type)];
 }
 
+static_assert(sizeof(TPV_FLOAT) == sizeof(uint32_t),
+              "Value keeps a float in 32 bits");
+
+// a register, stack slot or array element in one 64bit word, copied like an
+// integer. The ValueType is in the top 16 bits and the payload below it: the
+// int or float bits, or the object pointer, user space pointers on x86-64 and
+// arm64 fit in 48 bits. TPV_FLOAT is 32bit, so unlike a NaN box there is no
+// double the tag has to hide in. All zero bits are the int 0, what a register
+// holds before anything is written to it
 struct Value {
-  ValueType type;
-  bool is_const;
+  static constexpr int TAG_SHIFT = 48;
+  static constexpr uint64_t PAYLOAD_MASK = (uint64_t{1} << TAG_SHIFT) - 1;
 
-  using ValueObject = std::variant<TPV_INT, TPV_FLOAT, TPV_Obj, TPV_Unit>;
-  ValueObject value;
+  uint64_t bits = 0;
+
+  ValueType type() const { return static_cast<ValueType>(bits >> TAG_SHIFT); }
 };
 
+static_assert(sizeof(Value) == 8);
+
+inline Value make_value(ValueType type, uint64_t payload) {
+  return {.bits = static_cast<uint64_t>(type) << Value::TAG_SHIFT | payload};
+}
+
 inline Value from_raw_value(TPV_INT val) {
-  return {
-      .type = ValueType::TPV_INT,
-      .is_const = false,
-      .value = val,
-  };
+  return make_value(ValueType::TPV_INT, static_cast<uint32_t>(val));
 }
 
 inline Value from_raw_value(TPV_FLOAT val) {
-  return {
-      .type = ValueType::TPV_FLOAT,
-      .is_const = false,
-      .value = val,
-  };
+  return make_value(ValueType::TPV_FLOAT, std::bit_cast<uint32_t>(val));
+}
+
+inline Value from_obj_value(TPV_Object* obj) {
+  return make_value(ValueType::TPV_OBJ, reinterpret_cast<uintptr_t>(obj));
+}
+
+inline Value unit_value() {
+  return make_value(ValueType::TPV_UNIT, 0);
+}
+
+// payload of a value whose type was checked, nothing is checked here
+inline TPV_INT as_int(Value val) {
+  return static_cast<TPV_INT>(static_cast<uint32_t>(val.bits));
+}
+
+inline TPV_FLOAT as_float(Value val) {
+  return std::bit_cast<TPV_FLOAT>(static_cast<uint32_t>(val.bits));
+}
+
+inline TPV_Object* as_object(Value val) {
+  return reinterpret_cast<TPV_Object*>(val.bits & Value::PAYLOAD_MASK);
+}
+
+// the object of a value if it is an object of that kind, nullptr otherwise
+inline TPV_ObjString* as_string(Value val) {
+  if (val.type() != ValueType::TPV_OBJ) {
+    return nullptr;
+  }
+  auto* obj = as_object(val);
+  return obj->type == ObjType::STRING ? static_cast<TPV_ObjString*>(obj)
+                                      : nullptr;
 }
 
-inline Value from_obj_value(std::shared_ptr<TPV_ObjString> val) {
-  return {
-      .type = ValueType::TPV_OBJ,
-      .is_const = false,
-      .value = (TPV_Obj){.type = ObjType::STRING, .obj = val},
-  };
+inline TPV_ObjArray* as_array(Value val) {
+  if (val.type() != ValueType::TPV_OBJ) {
+    return nullptr;
+  }
+  auto* obj = as_object(val);
+  return obj->type == ObjType::ARRAY ? static_cast<TPV_ObjArray*>(obj)
+                                     : nullptr;
 }
 
-template <typename T, typename... Ts>
-inline T& get_or_crash(std::variant<Ts...>& v, const char* error_msg) {
-  if (auto* ptr = std::get_if<T>(&v)) {
-    return *ptr;
+// ValueType of TPV_INT or TPV_FLOAT, and as_int or as_float by that type
+template <typename T>
+constexpr ValueType value_type_of = std::is_same_v<T, TPV_INT>
+                                        ? ValueType::TPV_INT
+                                        : ValueType::TPV_FLOAT;
+
+template <typename T>
+inline T as_number(Value val) {
+  if constexpr (std::is_same_v<T, TPV_INT>) {
+    return as_int(val);
   } else {
-    std::print(stderr, "Fatal Error: {}\n", error_msg);
-    std::print(stderr, "Expected type: {}\n", typeid(T).name());
-    std::print(stderr, "Actual type: {}\n", v.index());
-    std::abort();
+    return as_float(val);
   }
 }
 
-inline TPV_INT get_int32(Value val) {
-  return get_or_crash<TPV_INT>(val.value, "Expected int32 value");
+inline size_t TPV_ObjArray::size() const {
+  switch (kind) {
+    case Kind::INTS:
+      return ints.size();
+    case Kind::FLOATS:
+      return floats.size();
+    default:
+      return values.size();
+  }
 }
 
-inline TPV_FLOAT get_float32(Value val) {
-  return get_or_crash<TPV_FLOAT>(val.value, "Expected float value");
+inline Value TPV_ObjArray::get(size_t idx) const {
+  switch (kind) {
+    case Kind::INTS:
+      return from_raw_value(ints.at(idx));
+    case Kind::FLOATS:
+      return from_raw_value(floats.at(idx));
+    default:
+      return values.at(idx);
+  }
 }
 
-inline auto get_str(Value val) {
-  auto& obj = get_or_crash<TPV_Obj>(val.value, "Expected Object value");
-  return *get_or_crash<std::shared_ptr<TPV_ObjString>>(
-      obj.obj, "Expected Object value to be a string");
+template <typename T>
+inline void put_element(std::vector<T>& elements, size_t idx, T element) {
+  if (idx == elements.size()) {
+    elements.push_back(element);
+  } else {
+    elements.at(idx) = element;
+  }
 }
 
-inline auto get_str_ptr(Value val) {
-  auto& obj = get_or_crash<TPV_Obj>(val.value, "Expected Object value");
-  return get_or_crash<std::shared_ptr<TPV_ObjString>>(
-      obj.obj, "Expected Object value to be a string");
+inline void TPV_ObjArray::set(size_t idx, const Value& value) {
+  if (size() == 0) {
+    kind = value.type() == ValueType::TPV_INT     ? Kind::INTS
+           : value.type() == ValueType::TPV_FLOAT ? Kind::FLOATS
+                                                  : Kind::VALUES;
+  }
+
+  if (kind == Kind::INTS && value.type() == ValueType::TPV_INT) {
+    put_element(ints, idx, as_int(value));
+  } else if (kind == Kind::FLOATS && value.type() == ValueType::TPV_FLOAT) {
+    put_element(floats, idx, as_float(value));
+  } else {
+    if (kind != Kind::VALUES) {
+      unpack();
+    }
+    put_element(values, idx, value);
+  }
 }
 
 }  // namespace TPV
@@ -0,0 +1,146 @@
+#include "cfg.hpp"
+
+namespace TPV {
+
+bool always_writes(Opcode op) {
+  switch (base_op(op)) {
+    case Opcode::SETI:
+    case Opcode::SETF:
+    case Opcode::SETS:
+    case Opcode::SETNIL:
+    case Opcode::NEW_ARRAY:
+    case Opcode::GET_ARG:
+    case Opcode::MOV:
+      return true;
+    default:
+      return false;
+  }
+}
+
+std::optional<uint8_t> written(const Instr& ins) {
+  const auto op = base_op(ins.op);
+  switch (op) {
+    case Opcode::SET_ARRAY:
+    case Opcode::RM_ARRAY:
+    case Opcode::RETURN:
+      return std::nullopt;
+    case Opcode::VMCALL:
+      // input services write r1
+      return ins.r1;
+    default:
+      break;
+  }
+
+  switch (operands_of(op)) {
+    case Operands::RD:
+    case Operands::RD_R1:
+    case Operands::RD_R1_R2:
+    case Operands::RD_IMM:
+    case Operands::RD_STR:
+    case Operands::RD_R1_IMM:
+      return ins.rd;
+    default:
+      return std::nullopt;
+  }
+}
+
+Registers read(const Instr& ins) {
+  const auto op = base_op(ins.op);
+  Registers regs;
+  switch (operands_of(op)) {
+    case Operands::RD:
+      if (op == Opcode::RETURN) {
+        regs.set(ins.rd);
+      }
+      break;
+    case Operands::R1:
+    case Operands::R1_IMM:
+    case Operands::RD_R1:
+    case Operands::RD_R1_IMM:
+      regs.set(ins.r1);
+      break;
+    case Operands::RD_R1_R2:
+      regs.set(ins.r1);
+      regs.set(ins.r2);
+      if (op == Opcode::SET_ARRAY) {
+        regs.set(ins.rd);
+      }
+      break;
+    case Operands::R1_R2_IMM:
+      regs.set(ins.r1);
+      regs.set(ins.r2);
+      break;
+    default:
+      break;
+  }
+  return regs;
+}
+
+std::vector<size_t> successors(const std::vector<Instr>& code,
+                               size_t idx,
+                               bool is_body) {
+  const auto& ins = code[idx];
+  switch (base_op(ins.op)) {
+    case Opcode::JMP:
+      return {static_cast<size_t>(ins.imm)};
+    case Opcode::JMP_IF:
+      return {static_cast<size_t>(ins.imm), idx + 1};
+    case Opcode::HLT:
+    case Opcode::END:
+      return {};
+    case Opcode::RETURN:
+      if (is_body) {
+        return {};
+      }
+      return {idx + 1};
+    default:
+      return {idx + 1};
+  }
+}
+
+Blocks find_blocks(const std::vector<Instr>& code,
+                   uint32_t resume_pc,
+                   bool is_body) {
+  std::vector<bool> leader(code.size(), false);
+  leader[0] = true;
+  if (resume_pc < code.size()) {
+    leader[resume_pc] = true;
+  }
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    const auto op = base_op(code[idx].op);
+    const auto succs = successors(code, idx, is_body);
+    if (op != Opcode::JMP && succs == std::vector<size_t>{idx + 1}) {
+      continue;
+    }
+    for (const auto succ : succs) {
+      leader[succ] = true;
+    }
+    if (idx + 1 < code.size()) {
+      leader[idx + 1] = true;
+    }
+  }
+
+  Blocks blocks;
+  blocks.is_body = is_body;
+  blocks.block_of.resize(code.size());
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    if (leader[idx]) {
+      blocks.starts.push_back(static_cast<uint32_t>(idx));
+    }
+    blocks.block_of[idx] = static_cast<uint32_t>(blocks.starts.size() - 1);
+  }
+  return blocks;
+}
+
+std::vector<uint32_t> successors(const std::vector<Instr>& code,
+                                 const Blocks& blocks,
+                                 size_t block) {
+  const auto last = blocks.end(block, code.size()) - 1;
+  std::vector<uint32_t> succs;
+  for (const auto idx : successors(code, last, blocks.is_body)) {
+    succs.push_back(blocks.block_of[idx]);
+  }
+  return succs;
+}
+
+}  // namespace TPV
@@ -0,0 +1,65 @@
+#ifndef CFG_HPP
+#define CFG_HPP
+
+#include <bitset>
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "../instructions.hpp"
+#include "vm.hpp"
+
+namespace TPV {
+
+// control flow and def-use of decoded code, for the passes that run over it
+// at load time (type inference, inlining, escape analysis) and the optimizer.
+// Fused and quickened ops count as their base op
+
+// one bit per register of a frame
+using Registers = std::bitset<MAX_REGISTERS>;
+
+// ins writes its rd whatever the operands are, other writes may fail and
+// leave it as it was
+bool always_writes(Opcode op);
+
+// the register ins may write. SET_ARRAY and RM_ARRAY only read rd
+std::optional<uint8_t> written(const Instr& ins);
+
+// registers ins reads. The arguments a CALL takes were read by SET_ARG
+Registers read(const Instr& ins);
+
+// instructions control may go to after code[idx]. RETURN pops the frame of a
+// body, in main it fails and control goes on, is_body says which
+std::vector<size_t> successors(const std::vector<Instr>& code,
+                               size_t idx,
+                               bool is_body);
+
+struct Blocks {
+  std::vector<uint32_t> starts;
+  // block of each instruction
+  std::vector<uint32_t> block_of;
+  bool is_body = false;
+
+  size_t end(size_t block, size_t code_size) const {
+    return block + 1 < starts.size() ? starts[block + 1] : code_size;
+  }
+  // more than the instruction before can go to idx
+  bool starts_at(size_t idx) const { return starts[block_of[idx]] == idx; }
+};
+
+// basic blocks start at 0, at resume_pc (main carries on there after an
+// earlier load, pass 0 otherwise), at jump targets and after every jump and
+// every instruction that does not always go on to the next one
+Blocks find_blocks(const std::vector<Instr>& code,
+                   uint32_t resume_pc,
+                   bool is_body);
+
+// blocks control may go to after block
+std::vector<uint32_t> successors(const std::vector<Instr>& code,
+                                 const Blocks& blocks,
+                                 size_t block);
+
+}  // namespace TPV
+
+#endif  // !CFG_HPP
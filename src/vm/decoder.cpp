@@ -0,0 +1,168 @@
+#include "decoder.hpp"
+
+#include <algorithm>
+#include <format>
+#include <string>
+
+#include "../utils.hpp"
+
+namespace TPV {
+
+std::optional<size_t> instruction_size(const std::vector<uint8_t>& bytes,
+                                       size_t offset) {
+  if (offset >= bytes.size() || bytes[offset] >= OPCODE_COUNT) {
+    return std::nullopt;
+  }
+
+  size_t size = 1;
+  switch (operands_of(static_cast<Opcode>(bytes[offset]))) {
+    case Operands::NONE:
+      break;
+    case Operands::RD:
+    case Operands::R1:
+      size += 1;
+      break;
+    case Operands::RD_R1:
+      size += 2;
+      break;
+    case Operands::RD_R1_R2:
+      size += 3;
+      break;
+    case Operands::IMM:
+      size += 4;
+      break;
+    case Operands::RD_IMM:
+    case Operands::R1_IMM:
+      size += 5;
+      break;
+    case Operands::RD_R1_IMM:
+    case Operands::R1_R2_IMM:
+      size += 6;
+      break;
+    case Operands::RD_STR: {
+      // rd, then everything up to and including the null terminator
+      if (offset + 2 > bytes.size()) {
+        return std::nullopt;
+      }
+      auto begin = bytes.begin() + offset + 2;
+      auto nul = std::find(begin, bytes.end(), 0);
+      if (nul == bytes.end()) {
+        return std::nullopt;
+      }
+      size += 1 + (nul - begin) + 1;
+      break;
+    }
+  }
+
+  if (offset + size > bytes.size()) {
+    return std::nullopt;
+  }
+  return size;
+}
+
+bool decode_function(TPV_Function& func, std::vector<Error>& errors) {
+  const auto& bytes = func.bytes;
+  std::vector<Instr> code;
+  std::vector<std::string> str_literals;
+
+  // byte offset -> instruction index, -1 for offsets inside an instruction
+  std::vector<int32_t> index_of(bytes.size(), -1);
+
+  size_t offset = 0;
+  while (offset < bytes.size()) {
+    auto size = instruction_size(bytes, offset);
+    if (!size) {
+      errors.push_back(
+          {.msg = std::format("Decode Error: {} at byte {} in function '{}'",
+                              bytes[offset] >= OPCODE_COUNT
+                                  ? "unknown opcode"
+                                  : "incomplete operands",
+                              offset, func.name)});
+      return false;
+    }
+
+    const auto* p = bytes.data() + offset;
+    Instr instr{.op = static_cast<Opcode>(p[0]), .rd = 0, .r1 = 0, .r2 = 0,
+                .imm = 0};
+
+    switch (operands_of(instr.op)) {
+      case Operands::NONE:
+        break;
+      case Operands::RD:
+        instr.rd = p[1];
+        break;
+      case Operands::R1:
+        instr.r1 = p[1];
+        break;
+      case Operands::RD_R1:
+        instr.rd = p[1];
+        instr.r1 = p[2];
+        break;
+      case Operands::RD_R1_R2:
+        instr.rd = p[1];
+        instr.r1 = p[2];
+        instr.r2 = p[3];
+        break;
+      case Operands::RD_IMM:
+        instr.rd = p[1];
+        instr.imm = read_int32(p + 2);
+        break;
+      case Operands::RD_STR:
+        instr.rd = p[1];
+        instr.imm = static_cast<int32_t>(str_literals.size());
+        str_literals.emplace_back(reinterpret_cast<const char*>(p + 2));
+        break;
+      case Operands::RD_R1_IMM:
+        instr.rd = p[1];
+        instr.r1 = p[2];
+        instr.imm = read_int32(p + 3);
+        break;
+      case Operands::R1_IMM:
+        instr.r1 = p[1];
+        instr.imm = read_int32(p + 2);
+        break;
+      case Operands::R1_R2_IMM:
+        instr.r1 = p[1];
+        instr.r2 = p[2];
+        instr.imm = read_int32(p + 3);
+        break;
+      case Operands::IMM:
+        instr.imm = read_int32(p + 1);
+        break;
+    }
+
+    index_of[offset] = static_cast<int32_t>(code.size());
+    code.push_back(instr);
+    offset += *size;
+  }
+
+  // byte offsets -> instruction indices
+  const auto end = static_cast<int32_t>(code.size());
+  for (auto& instr : code) {
+    if (instr.op != Opcode::JMP && instr.op != Opcode::JMP_IF) {
+      continue;
+    }
+
+    // pc is unsigned, so a negative target runs off the end as well
+    auto target = static_cast<uint32_t>(instr.imm);
+    if (target >= bytes.size()) {
+      instr.imm = end;
+    } else if (index_of[target] < 0) {
+      errors.push_back(
+          {.msg = std::format("Decode Error: jump to byte {} is not on an "
+                              "instruction boundary in function '{}'",
+                              target, func.name)});
+      return false;
+    } else {
+      instr.imm = index_of[target];
+    }
+  }
+
+  code.push_back({.op = Opcode::END, .rd = 0, .r1 = 0, .r2 = 0, .imm = 0});
+
+  func.code = std::move(code);
+  func.str_literals = std::move(str_literals);
+  return true;
+}
+
+}  // namespace TPV
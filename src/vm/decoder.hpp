@@ -0,0 +1,28 @@
+#ifndef DECODER_HPP
+#define DECODER_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "../error_code.hpp"
+#include "../instructions.hpp"
+#include "../value.hpp"
+
+namespace TPV {
+
+// size in bytes of the instruction starting at bytes[offset], including the
+// opcode. std::nullopt if the opcode is unknown or its operands are cut off
+std::optional<size_t> instruction_size(const std::vector<uint8_t>& bytes,
+                                       size_t offset);
+
+// decode func.bytes into func.code and func.str_literals, code is terminated
+// by END. Jump targets are turned from byte offsets into instruction indices,
+// a target at or past the end of the bytes lands on END like running off the
+// end does. Returns false and appends to errors if the bytes are malformed.
+bool decode_function(TPV_Function& func, std::vector<Error>& errors);
+
+}  // namespace TPV
+
+#endif  // !DECODER_HPP
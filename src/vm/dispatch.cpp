@@ -0,0 +1,152 @@
+#include "dispatch.hpp"
+
+#include <array>
+
+#include "../utils.hpp"
+#include "handlers.hpp"
+#include "vm.hpp"
+
+#if defined(__GNUC__)
+#define TPV_HAS_COMPUTED_GOTO 1
+#endif
+
+#if __has_cpp_attribute(clang::musttail)
+#define TPV_HAS_TAIL_CALL 1
+#endif
+
+namespace TPV {
+
+#define TPV_COUNT_OPCODE(name) +1
+static_assert(0 TPV_DISPATCH_OPCODES(TPV_COUNT_OPCODE) + 2 == HANDLER_COUNT,
+              "every opcode needs a handler in TPV_DISPATCH_OPCODES");
+#undef TPV_COUNT_OPCODE
+
+VM_Result dispatch_switch(VM& vm) {
+  while (true) {
+    auto& frame = vm.frames.back();
+    const auto ins = frame.function->code[frame.pc];
+    frame.pc += 1;
+
+    switch (ins.op) {
+#define TPV_SWITCH_CASE(name) \
+  case Opcode::name:          \
+    op_##name(vm, ins);       \
+    break;
+      TPV_DISPATCH_OPCODES(TPV_SWITCH_CASE)
+#undef TPV_SWITCH_CASE
+      case Opcode::HLT:
+        op_HLT(vm, ins);
+        return VM_Result::OK;
+      case Opcode::END:
+        if (op_END(vm, ins)) {
+          return VM_Result::OK;
+        }
+        break;
+    }
+  }
+}
+
+VM_Result dispatch_computed_goto(VM& vm) {
+#if defined(TPV_HAS_COMPUTED_GOTO)
+  void* labels[HANDLER_COUNT];
+#define TPV_GOTO_LABEL(name) labels[to_integral(Opcode::name)] = &&do_##name;
+  TPV_DISPATCH_OPCODES(TPV_GOTO_LABEL)
+#undef TPV_GOTO_LABEL
+  labels[to_integral(Opcode::HLT)] = &&do_HLT;
+  labels[to_integral(Opcode::END)] = &&do_END;
+
+  // every handler ends in its own indirect jump
+  Instr ins;
+#define TPV_NEXT()                                  \
+  do {                                              \
+    auto& frame = vm.frames.back();                 \
+    ins = frame.function->code[frame.pc];           \
+    frame.pc += 1;                                  \
+    goto* labels[to_integral(ins.op)];              \
+  } while (0)
+
+  TPV_NEXT();
+
+#define TPV_GOTO_HANDLER(name) \
+  do_##name:                   \
+  op_##name(vm, ins);          \
+  TPV_NEXT();
+  TPV_DISPATCH_OPCODES(TPV_GOTO_HANDLER)
+#undef TPV_GOTO_HANDLER
+
+do_HLT:
+  op_HLT(vm, ins);
+  return VM_Result::OK;
+do_END:
+  if (op_END(vm, ins)) {
+    return VM_Result::OK;
+  }
+  TPV_NEXT();
+#undef TPV_NEXT
+#else
+  return dispatch_switch(vm);
+#endif
+}
+
+#if defined(TPV_HAS_TAIL_CALL)
+namespace {
+
+// every handler is its own function and jumps straight into the next one
+using Tail_Handler = VM_Result (*)(VM& vm, Instr ins);
+extern const std::array<Tail_Handler, HANDLER_COUNT> tail_handlers;
+
+template <void (*Handler)(VM&, const Instr&)>
+VM_Result tail_op(VM& vm, Instr ins) {
+  Handler(vm, ins);
+
+  auto& frame = vm.frames.back();
+  const auto next = frame.function->code[frame.pc];
+  frame.pc += 1;
+  [[clang::musttail]] return tail_handlers[to_integral(next.op)](vm, next);
+}
+
+VM_Result tail_hlt(VM& vm, Instr ins) {
+  op_HLT(vm, ins);
+  return VM_Result::OK;
+}
+
+VM_Result tail_end(VM& vm, Instr ins) {
+  if (op_END(vm, ins)) {
+    return VM_Result::OK;
+  }
+
+  auto& frame = vm.frames.back();
+  const auto next = frame.function->code[frame.pc];
+  frame.pc += 1;
+  [[clang::musttail]] return tail_handlers[to_integral(next.op)](vm, next);
+}
+
+constexpr std::array<Tail_Handler, HANDLER_COUNT> make_tail_handlers() {
+  std::array<Tail_Handler, HANDLER_COUNT> handlers{};
+#define TPV_TAIL_HANDLER(name) \
+  handlers[to_integral(Opcode::name)] = &tail_op<op_##name>;
+  TPV_DISPATCH_OPCODES(TPV_TAIL_HANDLER)
+#undef TPV_TAIL_HANDLER
+  handlers[to_integral(Opcode::HLT)] = &tail_hlt;
+  handlers[to_integral(Opcode::END)] = &tail_end;
+  return handlers;
+}
+
+const std::array<Tail_Handler, HANDLER_COUNT> tail_handlers =
+    make_tail_handlers();
+
+}  // namespace
+#endif
+
+VM_Result dispatch_tail_call(VM& vm) {
+#if defined(TPV_HAS_TAIL_CALL)
+  auto& frame = vm.frames.back();
+  const auto ins = frame.function->code[frame.pc];
+  frame.pc += 1;
+  return tail_handlers[to_integral(ins.op)](vm, ins);
+#else
+  return dispatch_computed_goto(vm);
+#endif
+}
+
+}  // namespace TPV
@@ -0,0 +1,21 @@
+#ifndef DISPATCH_HPP
+#define DISPATCH_HPP
+
+#include "../error_code.hpp"
+
+namespace TPV {
+
+class VM;
+
+// run until HLT or until main reaches END, the END of a called function
+// returns from it
+// all of them share the handlers in handlers.hpp and behave the same, a
+// backend that is not available with the current compiler falls back to the
+// next simpler one
+VM_Result dispatch_switch(VM& vm);
+VM_Result dispatch_computed_goto(VM& vm);
+VM_Result dispatch_tail_call(VM& vm);
+
+}  // namespace TPV
+
+#endif  // !DISPATCH_HPP
@@ -0,0 +1,140 @@
+#include "escape.hpp"
+
+#include <cstdint>
+#include <optional>
+#include <vector>
+
+#include "../instructions.hpp"
+#include "cfg.hpp"
+#include "vm.hpp"
+
+namespace TPV {
+
+namespace {
+
+// NEW_ARRAYs whose array each register may hold, bit i for the ith one
+using Holds = std::vector<uint64_t>;
+
+// the register whose value ins keeps beyond the frame's registers
+std::optional<uint8_t> escapes(const Instr& ins) {
+  switch (base_op(ins.op)) {
+    case Opcode::SET_ARRAY:
+    case Opcode::RETURN:
+      return ins.rd;
+    case Opcode::SET_ARG:
+    case Opcode::PUSH:
+    case Opcode::STORE:
+      return ins.r1;
+    default:
+      return std::nullopt;
+  }
+}
+
+}  // namespace
+
+size_t allocate_scratch_arrays(TPV_Function& func) {
+  auto& code = func.code;
+  func.scratch_arrays = 0;
+
+  // NEW_ARRAY index -> its bit, the ones past MAX_SCRATCH_ARRAYS get none
+  std::vector<uint64_t> bit_of(code.size(), 0);
+  std::vector<size_t> sites;
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    if (base_op(code[idx].op) == Opcode::NEW_ARRAY &&
+        sites.size() < MAX_SCRATCH_ARRAYS) {
+      bit_of[idx] = uint64_t{1} << sites.size();
+      sites.push_back(idx);
+    }
+  }
+  if (sites.empty()) {
+    return 0;
+  }
+
+  // which arrays each register may hold before every instruction
+  auto transfer = [&](size_t idx, Holds& holds) {
+    const auto& ins = code[idx];
+    const auto op = base_op(ins.op);
+    if (op == Opcode::NEW_ARRAY) {
+      holds[ins.rd] = bit_of[idx];
+    } else if (op == Opcode::MOV) {
+      holds[ins.rd] = holds[ins.r1];
+    } else if (always_writes(op)) {
+      holds[ins.rd] = 0;
+    }
+  };
+  std::vector<std::optional<Holds>> in(code.size());
+  in[0] = Holds(func.num_registers, 0);
+  std::vector<size_t> work{0};
+  while (!work.empty()) {
+    const auto idx = work.back();
+    work.pop_back();
+
+    auto out = *in[idx];
+    transfer(idx, out);
+    for (const auto succ : successors(code, idx, true)) {
+      auto& holds = in[succ];
+      if (!holds) {
+        holds = out;
+        work.push_back(succ);
+        continue;
+      }
+      bool changed = false;
+      for (size_t r = 0; r < out.size(); r++) {
+        changed = changed || (out[r] & ~(*holds)[r]) != 0;
+        (*holds)[r] |= out[r];
+      }
+      if (changed) {
+        work.push_back(succ);
+      }
+    }
+  }
+
+  uint64_t escaped = 0;
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    if (const auto reg = escapes(code[idx]); reg && in[idx]) {
+      escaped |= (*in[idx])[*reg];
+    }
+  }
+
+  // registers read again before they are surely written
+  std::vector<Registers> live(code.size());
+  for (bool changed = true; changed;) {
+    changed = false;
+    for (auto idx = code.size(); idx-- > 0;) {
+      Registers out;
+      for (const auto succ : successors(code, idx, true)) {
+        out |= live[succ];
+      }
+      const auto& ins = code[idx];
+      if (always_writes(ins.op)) {
+        out.reset(ins.rd);
+      }
+      out |= read(ins);
+      if (out != live[idx]) {
+        live[idx] = out;
+        changed = true;
+      }
+    }
+  }
+
+  for (const auto idx : sites) {
+    if (!in[idx] || (escaped & bit_of[idx])) {
+      continue;
+    }
+    // the array this NEW_ARRAY made last time is still needed
+    bool reused = false;
+    for (size_t r = 0; r < func.num_registers; r++) {
+      reused = reused || (live[idx].test(r) && ((*in[idx])[r] & bit_of[idx]));
+    }
+    if (reused) {
+      continue;
+    }
+
+    code[idx].op = Opcode::NEW_ARRAY_SCRATCH;
+    code[idx].imm = static_cast<int32_t>(func.scratch_arrays);
+    func.scratch_arrays += 1;
+  }
+  return func.scratch_arrays;
+}
+
+}  // namespace TPV
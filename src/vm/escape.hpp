@@ -0,0 +1,28 @@
+#ifndef ESCAPE_HPP
+#define ESCAPE_HPP
+
+#include <cstddef>
+
+#include "../value.hpp"
+
+namespace TPV {
+
+// at most this many NEW_ARRAYs of a function get a scratch array
+constexpr size_t MAX_SCRATCH_ARRAYS = 64;
+
+// escape analysis over a function body: a NEW_ARRAY whose array never leaves
+// the frame becomes NEW_ARRAY_SCRATCH, which takes the function's scratch
+// array imm instead of a new object (VM::scratch_array). An array leaves the
+// frame if a register that may hold it is stored into an array (SET_ARRAY
+// rd), returned, passed on (SET_ARG), PUSHed or STOREd. MOV copies count as
+// the same array. Each NEW_ARRAY has one scratch array that is emptied every
+// time it runs, so it must also not be in a live register by then, the
+// array from the last run would change under it.
+//
+// Only for function bodies, main's frame never pops. Runs on verified code
+// before fusion. Sets func.scratch_arrays and returns it
+size_t allocate_scratch_arrays(TPV_Function& func);
+
+}  // namespace TPV
+
+#endif  // !ESCAPE_HPP
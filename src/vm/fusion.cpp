@@ -0,0 +1,110 @@
+#include "fusion.hpp"
+
+#include <optional>
+
+namespace TPV {
+
+// type inference ran before, so a compare or the ADD/SUB after a SETI may be
+// proven already and gets the pair that keeps it proven
+static constexpr std::optional<Opcode> fused_op(Opcode first, Opcode second) {
+  if (second == Opcode::JMP_IF) {
+    switch (first) {
+      case Opcode::EQ:
+        return Opcode::EQ_JMP_IF;
+      case Opcode::EQ_INT_PROVEN:
+        return Opcode::EQ_INT_PROVEN_JMP_IF;
+      case Opcode::EQ_FLOAT_PROVEN:
+        return Opcode::EQ_FLOAT_PROVEN_JMP_IF;
+      case Opcode::NEQ:
+        return Opcode::NEQ_JMP_IF;
+      case Opcode::NEQ_INT_PROVEN:
+        return Opcode::NEQ_INT_PROVEN_JMP_IF;
+      case Opcode::NEQ_FLOAT_PROVEN:
+        return Opcode::NEQ_FLOAT_PROVEN_JMP_IF;
+      case Opcode::GT:
+        return Opcode::GT_JMP_IF;
+      case Opcode::GT_INT_PROVEN:
+        return Opcode::GT_INT_PROVEN_JMP_IF;
+      case Opcode::GT_FLOAT_PROVEN:
+        return Opcode::GT_FLOAT_PROVEN_JMP_IF;
+      case Opcode::GTE:
+        return Opcode::GTE_JMP_IF;
+      case Opcode::GTE_INT_PROVEN:
+        return Opcode::GTE_INT_PROVEN_JMP_IF;
+      case Opcode::GTE_FLOAT_PROVEN:
+        return Opcode::GTE_FLOAT_PROVEN_JMP_IF;
+      case Opcode::LT:
+        return Opcode::LT_JMP_IF;
+      case Opcode::LT_INT_PROVEN:
+        return Opcode::LT_INT_PROVEN_JMP_IF;
+      case Opcode::LT_FLOAT_PROVEN:
+        return Opcode::LT_FLOAT_PROVEN_JMP_IF;
+      case Opcode::LTE:
+        return Opcode::LTE_JMP_IF;
+      case Opcode::LTE_INT_PROVEN:
+        return Opcode::LTE_INT_PROVEN_JMP_IF;
+      case Opcode::LTE_FLOAT_PROVEN:
+        return Opcode::LTE_FLOAT_PROVEN_JMP_IF;
+      default:
+        return std::nullopt;
+    }
+  }
+
+  if (first == Opcode::SETI) {
+    switch (second) {
+      case Opcode::ADD:
+        return Opcode::SETI_ADD;
+      case Opcode::SUB:
+        return Opcode::SETI_SUB;
+      case Opcode::ADD_INT_PROVEN:
+        return Opcode::SETI_ADD_INT_PROVEN;
+      case Opcode::SUB_INT_PROVEN:
+        return Opcode::SETI_SUB_INT_PROVEN;
+      default:
+        return std::nullopt;
+    }
+  }
+
+  // the element GET_ARRAY reads has no known type, so an op after it that is
+  // proven does not use it and the two stay apart
+  if (first == Opcode::GET_ARRAY) {
+    switch (second) {
+      case Opcode::ADD:
+        return Opcode::GET_ARRAY_ADD;
+      case Opcode::SUB:
+        return Opcode::GET_ARRAY_SUB;
+      case Opcode::MUL:
+        return Opcode::GET_ARRAY_MUL;
+      case Opcode::DIV:
+        return Opcode::GET_ARRAY_DIV;
+      default:
+        return std::nullopt;
+    }
+  }
+
+  return std::nullopt;
+}
+
+// the loop test of an int loop fuses and stays proven
+static_assert(fused_op(Opcode::LT_INT_PROVEN, Opcode::JMP_IF) ==
+              Opcode::LT_INT_PROVEN_JMP_IF);
+static_assert(first_op(Opcode::LT_INT_PROVEN_JMP_IF) == Opcode::LT_INT_PROVEN);
+static_assert(base_op(Opcode::LT_INT_PROVEN_JMP_IF) == Opcode::LT);
+
+size_t fuse_superinstructions(TPV_Function& func) {
+  auto& code = func.code;
+  size_t fused = 0;
+
+  // the second op of a pair is never the first op of another one, so pairs
+  // cannot overlap
+  for (size_t i = 0; i + 1 < code.size(); i++) {
+    if (auto op = fused_op(code[i].op, code[i + 1].op)) {
+      code[i].op = *op;
+      fused += 1;
+    }
+  }
+
+  return fused;
+}
+
+}  // namespace TPV
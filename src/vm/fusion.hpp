@@ -0,0 +1,20 @@
+#ifndef FUSION_HPP
+#define FUSION_HPP
+
+#include <cstddef>
+
+#include "../value.hpp"
+
+namespace TPV {
+
+// rewrite common pairs in func.code into superinstructions:
+// EQ/NEQ/GT/GTE/LT/LTE + JMP_IF
+// SETI + ADD/SUB
+// GET_ARRAY + ADD/SUB/MUL/DIV
+// only the first slot of a pair changes, so instruction indices and jump
+// targets stay valid. Returns the number of pairs fused
+size_t fuse_superinstructions(TPV_Function& func);
+
+}  // namespace TPV
+
+#endif  // !FUSION_HPP
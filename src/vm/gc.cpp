@@ -0,0 +1,504 @@
+#include "gc.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <limits>
+#include <vector>
+
+#include "vm.hpp"
+
+namespace TPV {
+
+namespace {
+
+// what the nursery keeps for an object of this type, new_object<T> takes
+// sizeof(T)
+size_t object_size(ObjType type) {
+  switch (type) {
+    case ObjType::STRING:
+      return sizeof(TPV_ObjString);
+    case ObjType::ARRAY:
+      return sizeof(TPV_ObjArray);
+    case ObjType::FUNCTION:
+      return sizeof(TPV_ObjFunction);
+    case ObjType::MODULE:
+      return sizeof(TPV_ObjModule);
+    case ObjType::UPVALUE:
+      return sizeof(TPV_ObjUpvalue);
+    default:
+      return sizeof(TPV_Object);
+  }
+}
+
+size_t slot_size(size_t size) {
+  constexpr auto align = alignof(std::max_align_t);
+  return (size + align - 1) / align * align;
+}
+
+// every reference obj holds, fn gets a Value& or a pointer to an object by
+// reference so a minor collection can redirect it
+template <typename Fn>
+void visit_children(TPV_Object& obj, Fn&& fn) {
+  if (obj.type == ObjType::ARRAY) {
+    // packed ints and floats hold no objects
+    for (auto& value : static_cast<TPV_ObjArray&>(obj).values) {
+      fn(value);
+    }
+  } else if (obj.type == ObjType::FUNCTION) {
+    auto& func = static_cast<TPV_ObjFunction&>(obj);
+    for (auto& [_, str] : func.str_table) {
+      fn(str);
+    }
+    for (auto& [_, callee] : func.func_table) {
+      fn(callee);
+    }
+  }
+}
+
+template <typename Fn>
+void visit_roots(VM& vm, Fn&& fn) {
+  for (auto& frame : vm.frames) {
+    // its arguments, its registers and what SET_ARG left for the next call
+    auto* values = frame.registers - frame.function->arity;
+    const auto count =
+        frame.function->arity + frame.num_registers + frame.arg_count;
+    for (size_t i = 0; i < count; ++i) {
+      fn(values[i]);
+    }
+    for (auto& value : frame.stack) {
+      fn(value);
+    }
+    // its scratch arrays, they are not in the nursery or the heap and live
+    // as long as the frame
+    const auto first = size_t{frame.scratch_base};
+    const auto last =
+        std::min(vm.scratch.size(), first + frame.function->scratch_arrays);
+    for (auto idx = first; idx < last; ++idx) {
+      visit_children(*vm.scratch[idx], fn);
+    }
+  }
+  for (auto& str : vm.str_table) {
+    fn(str);
+  }
+}
+
+// a copy of a young object in the old space, its buffers are moved along
+std::unique_ptr<TPV_Object> promote(TPV_Object& obj) {
+  switch (obj.type) {
+    case ObjType::STRING:
+      return std::make_unique<TPV_ObjString>(
+          std::move(static_cast<TPV_ObjString&>(obj)));
+    case ObjType::ARRAY:
+      return std::make_unique<TPV_ObjArray>(
+          std::move(static_cast<TPV_ObjArray&>(obj)));
+    case ObjType::FUNCTION:
+      return std::make_unique<TPV_ObjFunction>(
+          std::move(static_cast<TPV_ObjFunction&>(obj)));
+    case ObjType::MODULE:
+      return std::make_unique<TPV_ObjModule>(
+          std::move(static_cast<TPV_ObjModule&>(obj)));
+    default:
+      return std::make_unique<TPV_ObjUpvalue>(
+          std::move(static_cast<TPV_ObjUpvalue&>(obj)));
+  }
+}
+
+// moves what a minor collection reaches out of the nursery. Promoted
+// objects wait in a worklist until their own references are forwarded
+class Evacuator {
+ public:
+  explicit Evacuator(VM& vm) : vm(vm) {}
+
+  void operator()(Value& value) {
+    if (value.type() == ValueType::TPV_OBJ) {
+      value = from_obj_value(forward(as_object(value)));
+    }
+  }
+
+  template <typename T>
+  void operator()(T*& obj) {
+    obj = static_cast<T*>(forward(obj));
+  }
+
+  void drain() {
+    while (!promoted.empty()) {
+      auto* obj = promoted.back();
+      promoted.pop_back();
+      visit_children(*obj, *this);
+    }
+  }
+
+ private:
+  TPV_Object* forward(TPV_Object* obj) {
+    // a scratch array stays where it is, visit_roots forwards its elements
+    if (!obj || obj->scratch || !vm.nursery.contains(obj)) {
+      return obj;
+    }
+    if (!obj->forward) {
+      auto old = promote(*obj);
+      const auto bytes = object_bytes(*old);
+      vm.gc_stats.objects_promoted += 1;
+      vm.gc_stats.bytes_promoted += bytes;
+      vm.gc_stats.allocated += bytes;
+      obj->forward = old.get();
+      // a marked object may point at it already
+      if (vm.major_gc.phase == Gc_Phase::MARK) {
+        old->marked = true;
+        vm.major_gc.gray.push_back(old.get());
+      }
+      promoted.push_back(old.get());
+      vm.heap.push_back(std::move(old));
+    }
+    return obj->forward;
+  }
+
+  VM& vm;
+  std::vector<TPV_Object*> promoted;
+};
+
+double elapsed_ms(std::chrono::steady_clock::time_point start) {
+  return std::chrono::duration<double, std::milli>(
+             std::chrono::steady_clock::now() - start)
+      .count();
+}
+
+// how much one slice may still do, see Gc_Config. Default constructed it
+// never runs out
+class Slice_Budget {
+ public:
+  Slice_Budget() = default;
+  explicit Slice_Budget(const Gc_Config& config)
+      : max_work(config.slice_work), max_ms(config.slice_ms) {}
+
+  void spend(size_t units) { work += units; }
+
+  bool exhausted() {
+    if (work >= max_work) {
+      return true;
+    }
+    // the clock costs more than marking a few objects
+    if (max_ms > 0 && work >= next_check) {
+      next_check = work + CHECK_EVERY;
+      timed_out = elapsed_ms(start) >= max_ms;
+    }
+    return timed_out;
+  }
+
+ private:
+  static constexpr size_t CHECK_EVERY = 256;
+
+  size_t max_work = std::numeric_limits<size_t>::max();
+  double max_ms = 0;
+  size_t work = 0;
+  size_t next_check = 0;
+  bool timed_out = false;
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+};
+
+// marks old objects into Major_Gc::gray. A worklist instead of recursion, an
+// array nested a million deep would overflow the stack. Young objects are
+// left to the minor collection that moves them. Scratch arrays are never
+// marked: the sweep only clears the marks of heap objects, and their elements
+// are roots while their frame runs (visit_roots)
+class Marker {
+ public:
+  explicit Marker(VM& vm) : vm(vm), gray(vm.major_gc.gray) {}
+
+  void operator()(Value value) {
+    if (value.type() == ValueType::TPV_OBJ) {
+      (*this)(as_object(value));
+    }
+  }
+
+  void operator()(TPV_Object* obj) {
+    visited += 1;
+    if (obj && !obj->marked && !obj->scratch && !vm.nursery.contains(obj)) {
+      obj->marked = true;
+      gray.push_back(obj);
+    }
+  }
+
+  // scan gray objects until there are none left, then true, or the budget ran
+  // out
+  bool drain(Slice_Budget& budget) {
+    auto& major = vm.major_gc;
+    while (major.partial || !gray.empty()) {
+      if (budget.exhausted()) {
+        return false;
+      }
+      if (major.partial) {
+        mark_chunk(budget);
+        continue;
+      }
+      auto* obj = gray.back();
+      gray.pop_back();
+      if (obj->type == ObjType::ARRAY) {
+        major.partial = static_cast<TPV_ObjArray*>(obj);
+        major.partial_left = major.partial->values.size();
+        continue;
+      }
+      visited = 0;
+      visit_children(*obj, *this);
+      budget.spend(1 + visited);
+    }
+    return true;
+  }
+
+ private:
+  // elements marked in one go, a large array takes several
+  static constexpr size_t CHUNK = 1024;
+
+  void mark_chunk(Slice_Budget& budget) {
+    auto& major = vm.major_gc;
+    auto& values = major.partial->values;
+    const auto end = std::min(major.partial_left, values.size());
+    const auto begin = end - std::min(end, CHUNK);
+    for (auto i = begin; i < end; ++i) {
+      (*this)(values[i]);
+    }
+    budget.spend(1 + end - begin);
+    major.partial_left = begin;
+    if (begin == 0) {
+      major.partial = nullptr;
+    }
+  }
+
+  VM& vm;
+  std::vector<TPV_Object*>& gray;
+  size_t visited = 0;
+};
+
+// free unmarked objects in heap[0, sweep_end) and clear the marks of the
+// rest, true once all are swept
+bool sweep(VM& vm, Slice_Budget& budget) {
+  auto& major = vm.major_gc;
+  auto& stats = vm.gc_stats;
+  while (major.sweep_read < major.sweep_end) {
+    if (budget.exhausted()) {
+      return false;
+    }
+    auto& obj = vm.heap[major.sweep_read++];
+    budget.spend(1);
+    const auto bytes = object_bytes(*obj);
+    if (obj->marked) {
+      obj->marked = false;
+      major.live_objects += 1;
+      major.live_bytes += bytes;
+      if (&vm.heap[major.sweep_write] != &obj) {
+        vm.heap[major.sweep_write] = std::move(obj);
+      }
+      major.sweep_write += 1;
+    } else {
+      stats.objects_freed += 1;
+      stats.bytes_freed += bytes;
+      obj.reset();
+    }
+  }
+  return true;
+}
+
+// continue the major collection, or start one, until it is done or the
+// budget runs out
+void major_slice(VM& vm, Slice_Budget& budget) {
+  auto& major = vm.major_gc;
+  auto& stats = vm.gc_stats;
+  Marker marker(vm);
+
+  if (major.phase == Gc_Phase::IDLE) {
+    major.phase = Gc_Phase::MARK;
+    stats.allocated = 0;
+    visit_roots(vm, marker);
+  }
+
+  if (major.phase == Gc_Phase::MARK) {
+    if (!marker.drain(budget)) {
+      return;
+    }
+    // registers, stacks and young objects have no barrier, what they point
+    // at now is marked in this pause
+    collect_young(vm);
+    visit_roots(vm, marker);
+    Slice_Budget rest;
+    marker.drain(rest);
+
+    major.phase = Gc_Phase::SWEEP;
+    major.sweep_read = 0;
+    major.sweep_write = 0;
+    major.sweep_end = vm.heap.size();
+    major.live_objects = 0;
+    major.live_bytes = 0;
+  }
+
+  if (!sweep(vm, budget)) {
+    return;
+  }
+  vm.heap.erase(vm.heap.begin() + static_cast<ptrdiff_t>(major.sweep_write),
+                vm.heap.begin() + static_cast<ptrdiff_t>(major.sweep_end));
+  major.phase = Gc_Phase::IDLE;
+  stats.collections += 1;
+  stats.live_objects = major.live_objects;
+  stats.live_bytes = major.live_bytes;
+  stats.threshold = std::max(GC_MIN_THRESHOLD, major.live_bytes);
+}
+
+// one pause of major collection work, the minor collection it may include
+// counts towards it
+void timed_major_slice(VM& vm, Slice_Budget budget) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto total_ms = vm.gc_stats.total_ms;
+
+  major_slice(vm, budget);
+
+  const auto ms = elapsed_ms(start);
+  vm.gc_stats.slices += 1;
+  vm.gc_stats.major_pauses.record(ms);
+  vm.gc_stats.total_ms = total_ms + ms;
+  vm.major_gc.debt = 0;
+}
+
+}  // namespace
+
+size_t object_bytes(const TPV_Object& obj) {
+  switch (obj.type) {
+    case ObjType::STRING:
+      return sizeof(TPV_ObjString) +
+             static_cast<const TPV_ObjString&>(obj).value.capacity();
+    case ObjType::ARRAY:
+      return sizeof(TPV_ObjArray) +
+             static_cast<const TPV_ObjArray&>(obj).capacity_bytes();
+    default:
+      return object_size(obj.type);
+  }
+}
+
+Nursery::Nursery(size_t capacity) : capacity(capacity) {}
+
+Nursery::~Nursery() {
+  reset();
+}
+
+void* Nursery::allocate(size_t size) {
+  const auto slot = slot_size(size);
+  if (capacity - top < slot) {
+    return nullptr;
+  }
+  // a program that makes no objects never pays for the nursery
+  if (!memory) {
+    memory = std::make_unique_for_overwrite<std::byte[]>(capacity);
+  }
+  auto* ptr = memory.get() + top;
+  top += slot;
+  return ptr;
+}
+
+void Nursery::reset() {
+  size_t offset = 0;
+  while (offset < top) {
+    auto* obj = reinterpret_cast<TPV_Object*>(memory.get() + offset);
+    offset += slot_size(object_size(obj->type));
+    obj->~TPV_Object();
+  }
+  top = 0;
+  young_bytes = 0;
+}
+
+void collect_young(VM& vm) {
+  const auto start = std::chrono::steady_clock::now();
+
+  Evacuator evacuator(vm);
+  visit_roots(vm, evacuator);
+  for (auto* obj : vm.remembered) {
+    obj->remembered = false;
+    visit_children(*obj, evacuator);
+  }
+  vm.remembered.clear();
+  evacuator.drain();
+  vm.nursery.reset();
+
+  const auto ms = elapsed_ms(start);
+  vm.gc_stats.minor_collections += 1;
+  vm.gc_stats.minor_pauses.record(ms);
+  vm.gc_stats.total_ms += ms;
+}
+
+void collect(VM& vm) {
+  collect_young(vm);
+  advance_major(vm, 0);
+}
+
+void collect_garbage(VM& vm) {
+  const auto start = std::chrono::steady_clock::now();
+  const auto total_ms = vm.gc_stats.total_ms;
+
+  Slice_Budget unlimited;
+  if (vm.major_gc.phase != Gc_Phase::IDLE) {
+    major_slice(vm, unlimited);
+  }
+  major_slice(vm, unlimited);
+
+  const auto ms = elapsed_ms(start);
+  vm.gc_stats.major_pauses.record(ms);
+  vm.gc_stats.total_ms = total_ms + ms;
+  vm.major_gc.debt = 0;
+}
+
+void advance_major(VM& vm, size_t bytes) {
+  auto& major = vm.major_gc;
+  const auto& config = vm.gc_config;
+  const auto& stats = vm.gc_stats;
+
+  if (major.phase == Gc_Phase::IDLE) {
+    if (stats.allocated < stats.threshold) {
+      return;
+    }
+    if (!config.incremental) {
+      collect_garbage(vm);
+      return;
+    }
+    timed_major_slice(vm, Slice_Budget(config));
+    return;
+  }
+
+  // the program outgrew the slices, or incremental collection was turned off
+  if (stats.allocated >= stats.threshold || !config.incremental) {
+    timed_major_slice(vm, Slice_Budget());
+    return;
+  }
+  major.debt += bytes;
+  if (major.debt >= config.slice_bytes) {
+    timed_major_slice(vm, Slice_Budget(config));
+  }
+}
+
+void Pause_Histogram::record(double ms) {
+  const auto us = ms * 1000;
+  size_t bucket = 0;
+  while (bucket + 1 < BUCKETS &&
+         us >= static_cast<double>(size_t{1} << bucket)) {
+    bucket += 1;
+  }
+  counts[bucket] += 1;
+  pauses += 1;
+  max_ms = std::max(max_ms, ms);
+}
+
+double Pause_Histogram::percentile_ms(double p) const {
+  if (pauses == 0) {
+    return 0;
+  }
+  const auto rank = static_cast<size_t>(
+      std::ceil(p / 100 * static_cast<double>(pauses)));
+  size_t seen = 0;
+  for (size_t bucket = 0; bucket + 1 < BUCKETS; ++bucket) {
+    seen += counts[bucket];
+    if (seen >= rank) {
+      const auto bound = static_cast<double>(size_t{1} << bucket) / 1000;
+      return std::min(bound, max_ms);
+    }
+  }
+  return max_ms;
+}
+
+}  // namespace TPV
@@ -0,0 +1,166 @@
+#ifndef GC_HPP
+#define GC_HPP
+
+#include <array>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+#include <vector>
+
+#include "../value.hpp"
+
+namespace TPV {
+
+class VM;
+
+// bytes allocated in the old space before the first major collection. Later
+// ones start once as many bytes were promoted or grown as survived the last
+// one, or this many if that is less, so the old space stays within about
+// twice its live data
+constexpr size_t GC_MIN_THRESHOLD = size_t{1} << 20;
+// object headers the nursery holds before a minor collection
+constexpr size_t GC_NURSERY_SIZE = size_t{256} << 10;
+// headers and element or character buffers of young objects before a minor
+// collection, a few large arrays fill it long before their headers do
+constexpr size_t GC_NURSERY_LIMIT = size_t{8} << 20;
+
+// how much of a major collection one pause may do. A slice ends at whichever
+// budget runs out first
+struct Gc_Config {
+  // off: a major collection runs to the end in one pause once it starts
+  bool incremental = true;
+  // objects and references marked, or objects swept, per slice
+  size_t slice_work = 8192;
+  // 0 for no time budget
+  double slice_ms = 0.5;
+  // young bytes allocated or old bytes grown between two slices
+  size_t slice_bytes = size_t{64} << 10;
+};
+
+// pause lengths in power of two buckets: bucket 0 counts pauses under 1us,
+// bucket i those under 2^i us, the last one everything longer
+struct Pause_Histogram {
+  static constexpr size_t BUCKETS = 24;
+
+  std::array<size_t, BUCKETS> counts{};
+  size_t pauses = 0;
+  double max_ms = 0;
+
+  void record(double ms);
+  // upper bound in ms of the bucket holding the p-th percentile pause, p in
+  // (0, 100]
+  double percentile_ms(double p) const;
+};
+
+struct Gc_Stats {
+  size_t minor_collections = 0;
+  size_t objects_promoted = 0;
+  size_t bytes_promoted = 0;
+  size_t collections = 0;
+  size_t slices = 0;
+  size_t objects_freed = 0;
+  size_t bytes_freed = 0;
+  // what survived the last major collection
+  size_t live_objects = 0;
+  size_t live_bytes = 0;
+  // bytes promoted or grown in the old space since the last major collection
+  // started, the next one starts at threshold
+  size_t allocated = 0;
+  size_t threshold = GC_MIN_THRESHOLD;
+  // time spent collecting, minor and major
+  double total_ms = 0;
+  Pause_Histogram minor_pauses;
+  // every slice of a major collection, or the whole of one if it is not
+  // incremental
+  Pause_Histogram major_pauses;
+};
+
+enum class Gc_Phase : uint8_t {
+  IDLE,   // no major collection running
+  MARK,   // marking the old space a slice at a time
+  SWEEP,  // freeing what was not marked a slice at a time
+};
+
+// a major collection between two slices
+struct Major_Gc {
+  Gc_Phase phase = Gc_Phase::IDLE;
+  // marked old objects whose references are not marked yet
+  std::vector<TPV_Object*> gray;
+  // a gray array being marked a chunk at a time, values[0, partial_left) are
+  // left. Going down from the end, erasing an element cannot move one that is
+  // left past the ones already done
+  TPV_ObjArray* partial = nullptr;
+  size_t partial_left = 0;
+  // heap[0, sweep_end) is swept up to sweep_read, survivors are moved down to
+  // sweep_write. Objects promoted while sweeping go after sweep_end
+  size_t sweep_read = 0;
+  size_t sweep_write = 0;
+  size_t sweep_end = 0;
+  size_t live_objects = 0;
+  size_t live_bytes = 0;
+  // bytes allocated since the last slice
+  size_t debt = 0;
+};
+
+// bytes an object holds: itself and its element or character buffer
+size_t object_bytes(const TPV_Object& obj);
+
+// young objects, bump allocated one after another. A minor collection moves
+// the reachable ones to VM::heap and destroys the rest in one pass. The
+// memory is taken on the first allocation and kept until the nursery goes
+class Nursery {
+ public:
+  explicit Nursery(size_t capacity);
+  ~Nursery();
+  Nursery(const Nursery&) = delete;
+  Nursery& operator=(const Nursery&) = delete;
+
+  // size bytes for a new object, nullptr once the nursery is full
+  void* allocate(size_t size);
+  bool contains(const TPV_Object* obj) const {
+    const auto addr = reinterpret_cast<uintptr_t>(obj);
+    const auto begin = reinterpret_cast<uintptr_t>(memory.get());
+    return addr >= begin && addr < begin + top;
+  }
+  // destroy every object, moved out or not, and start over
+  void reset();
+
+  // headers and buffers of the objects in it, see GC_NURSERY_LIMIT
+  size_t young_bytes = 0;
+
+ private:
+  std::unique_ptr<std::byte[]> memory;
+  size_t capacity;
+  size_t top = 0;
+};
+
+// minor collection: young objects reachable from the registers and stacks of
+// every frame, the string table or a remembered old object are moved to
+// VM::heap and every reference to them is updated, the rest die with the
+// nursery. Objects moved while marking are marked. Only runs where every
+// object a handler still needs is reachable, see VM::new_object
+void collect_young(VM& vm);
+
+// major collection in one pause: finishes the running one, then a minor
+// collection and mark-sweep over VM::heap from the same roots
+void collect_garbage(VM& vm);
+
+// a minor collection, then a major one starts if the promoted objects filled
+// the old space
+void collect(VM& vm);
+
+// the program allocated bytes. Starts a major collection once the old space
+// reached gc_stats.threshold and, while one runs, does a slice of it every
+// Gc_Config::slice_bytes.
+//
+// Incremental marking keeps no marked object pointing at an unmarked old one:
+// VM::write_barrier marks old objects stored into arrays, objects promoted
+// while marking are marked, and the last slice marks from the registers,
+// stacks and string table again, so stores to those need no barrier. If the
+// old space grows by another threshold before a collection is done, it is
+// finished in one pause
+void advance_major(VM& vm, size_t bytes);
+
+}  // namespace TPV
+
+#endif  // !GC_HPP
@@ -0,0 +1,1847 @@
+#ifndef HANDLERS_HPP
+#define HANDLERS_HPP
+
+#include <bit>
+#include <cstdint>
+#include <cstdio>
+#include <format>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <optional>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
+#include <variant>
+#include <vector>
+#include "../error_code.hpp"
+#include "../instructions.hpp"
+#include "../jit/jit.hpp"
+#include "../utils.hpp"
+#include "common.hpp"
+#include "simd.hpp"
+#include "value.hpp"
+#include "vm.hpp"
+
+#define INT_TABLE 0
+#define FLOAT_TABLE 1
+#define STR_TABLE 2
+#define TABLE_TABLE 3
+
+namespace TPV {
+
+// one handler per opcode, shared by every dispatch loop in dispatch.cpp
+// pc already points past ins when a handler runs, jumps overwrite it and the
+// loops fetch the next instruction from vm.frames.back() afterwards
+
+// register of the running frame. Code is verified at load time so the index
+// is always in range, only checked builds (TPV_VM_CHECKED) keep the bounds check
+inline Value& reg(VM& vm, uint8_t idx) {
+#ifdef TPV_VM_CHECKED
+  auto& frame = vm.frames.back();
+  if (idx >= frame.num_registers) {
+    throw std::out_of_range(
+        std::format("register {} past a window of {}", idx,
+                    frame.num_registers));
+  }
+  return frame.registers[idx];
+#else
+  return vm.frames.back().registers[idx];
+#endif
+}
+
+// typed form of a generic arithmetic or compare op
+constexpr Opcode quickened(Opcode generic, ValueType type) {
+  const bool is_int = type == ValueType::TPV_INT;
+  switch (generic) {
+    case Opcode::ADD:
+      return is_int ? Opcode::ADD_INT : Opcode::ADD_FLOAT;
+    case Opcode::SUB:
+      return is_int ? Opcode::SUB_INT : Opcode::SUB_FLOAT;
+    case Opcode::MUL:
+      return is_int ? Opcode::MUL_INT : Opcode::MUL_FLOAT;
+    case Opcode::DIV:
+      return is_int ? Opcode::DIV_INT : Opcode::DIV_FLOAT;
+    case Opcode::EQ:
+      return is_int ? Opcode::EQ_INT : Opcode::EQ_FLOAT;
+    case Opcode::NEQ:
+      return is_int ? Opcode::NEQ_INT : Opcode::NEQ_FLOAT;
+    case Opcode::GT:
+      return is_int ? Opcode::GT_INT : Opcode::GT_FLOAT;
+    case Opcode::GTE:
+      return is_int ? Opcode::GTE_INT : Opcode::GTE_FLOAT;
+    case Opcode::LT:
+      return is_int ? Opcode::LT_INT : Opcode::LT_FLOAT;
+    case Opcode::LTE:
+      return is_int ? Opcode::LTE_INT : Opcode::LTE_FLOAT;
+    default:
+      return generic;
+  }
+}
+
+// form of a generic arithmetic or compare op for operands proven to be of
+// type, see type_inference.hpp
+constexpr Opcode proven(Opcode generic, ValueType type) {
+  const bool is_int = type == ValueType::TPV_INT;
+  switch (generic) {
+    case Opcode::ADD:
+      return is_int ? Opcode::ADD_INT_PROVEN : Opcode::ADD_FLOAT_PROVEN;
+    case Opcode::SUB:
+      return is_int ? Opcode::SUB_INT_PROVEN : Opcode::SUB_FLOAT_PROVEN;
+    case Opcode::MUL:
+      return is_int ? Opcode::MUL_INT_PROVEN : Opcode::MUL_FLOAT_PROVEN;
+    case Opcode::DIV:
+      return is_int ? Opcode::DIV_INT_PROVEN : Opcode::DIV_FLOAT_PROVEN;
+    case Opcode::EQ:
+      return is_int ? Opcode::EQ_INT_PROVEN : Opcode::EQ_FLOAT_PROVEN;
+    case Opcode::NEQ:
+      return is_int ? Opcode::NEQ_INT_PROVEN : Opcode::NEQ_FLOAT_PROVEN;
+    case Opcode::GT:
+      return is_int ? Opcode::GT_INT_PROVEN : Opcode::GT_FLOAT_PROVEN;
+    case Opcode::GTE:
+      return is_int ? Opcode::GTE_INT_PROVEN : Opcode::GTE_FLOAT_PROVEN;
+    case Opcode::LT:
+      return is_int ? Opcode::LT_INT_PROVEN : Opcode::LT_FLOAT_PROVEN;
+    case Opcode::LTE:
+      return is_int ? Opcode::LTE_INT_PROVEN : Opcode::LTE_FLOAT_PROVEN;
+    default:
+      return generic;
+  }
+}
+
+// swap the op in the slot that is running, but only while it still holds
+// `from`: the first half of a superinstruction runs from the fused slot, which
+// must keep its op
+inline void rewrite_slot(VM& vm, Opcode from, Opcode to) {
+  auto& frame = vm.frames.back();
+  auto& slot = frame.function->code[frame.pc - 1];
+  if (slot.op == from) {
+    slot.op = to;
+  }
+}
+
+// after a generic op ran, rewrite it into the typed form for its operands
+inline void quicken(VM& vm, Opcode generic, const Value& r1, const Value& r2) {
+  if (r1.type() == r2.type() && (r1.type() == ValueType::TPV_INT ||
+                                 r1.type() == ValueType::TPV_FLOAT)) {
+    rewrite_slot(vm, generic, quickened(generic, r1.type()));
+  }
+}
+
+inline void op_SETI(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+
+  reg(vm, rd) = from_raw_value(ins.imm);
+}
+
+inline void op_SETF(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+
+  reg(vm, rd) = from_raw_value(std::bit_cast<TPV_FLOAT>(ins.imm));
+}
+
+inline void op_SETS(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto handle = vm.frames.back().function->str_constants[ins.imm];
+
+  reg(vm, rd) = from_obj_value(vm.str_table[handle]);
+}
+
+inline void op_SETNIL(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+
+  reg(vm, rd) = unit_value();
+}
+
+inline void op_STORE(VM& vm, const Instr& ins) {
+  // return ref idx
+  auto& rd = reg(vm, ins.rd);
+  // store item
+  auto r1 = reg(vm, ins.r1);
+  // type of table
+  auto imm = ins.imm;
+
+  // an item that does not fit the table
+  auto type_error = [&] {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: STORE operation on {} for table {}",
+                            get_value_type_name(r1.type()), imm)});
+  };
+
+  switch (imm) {
+    case INT_TABLE: {
+      if (r1.type() != ValueType::TPV_INT) {
+        type_error();
+        break;
+      }
+      rd = from_raw_value((int32_t)vm.int32_table.size());
+      vm.int32_table.push_back(as_int(r1));
+      break;
+    }
+    case FLOAT_TABLE: {
+      if (r1.type() != ValueType::TPV_FLOAT) {
+        type_error();
+        break;
+      }
+      rd = from_raw_value((int32_t)vm.float32_table.size());
+      vm.float32_table.push_back(as_float(r1));
+      break;
+    }
+    case STR_TABLE: {
+      const auto* str = as_string(r1);
+      if (!str) {
+        type_error();
+        break;
+      }
+
+      // a new entry even if the string is there, its handle is the index
+      // LOAD takes
+      auto* obj = vm.new_object<TPV_ObjString>(str->hash, str->value);
+      rd = from_raw_value(static_cast<TPV_INT>(vm.str_table.add(obj)));
+
+      break;
+    }
+    default: {
+      vm.errors.push_back(
+          {.msg = std::format(
+               "Type Error: STORE operation on non-exist table type {}",
+               imm)});
+      break;
+    }
+  }
+}
+
+inline void op_LOAD(VM& vm, const Instr& ins) {
+  // return ref
+  auto& rd = reg(vm, ins.rd);
+  // access idx
+  auto r1 = reg(vm, ins.r1);
+  // type of table
+  auto imm = ins.imm;
+  if (r1.type() != ValueType::TPV_INT) {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: LOAD operation on {}",
+                            get_value_type_name(r1.type()))});
+    return;
+  }
+  auto idx = as_int(r1);
+
+  switch (imm) {
+    case INT_TABLE: {
+      rd = from_raw_value(vm.int32_table.at(idx));
+      break;
+    }
+    case FLOAT_TABLE: {
+      rd = from_raw_value(vm.float32_table.at(idx));
+      break;
+    }
+    case STR_TABLE: {
+      rd = from_obj_value(vm.str_table.at(idx));
+      break;
+    }
+    default: {
+      vm.errors.push_back(
+          {.msg = std::format(
+               "Type Error: LOAD operation on non-exist table type {}",
+               imm)});
+      break;
+    }
+  }
+}
+
+inline void op_ADD(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) + as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) + as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: ADD operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::ADD, r1, r2);
+}
+
+inline void op_SUB(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) - as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) - as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: SUB operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::SUB, r1, r2);
+}
+
+inline void op_MUL(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) * as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) * as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: MUL operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::MUL, r1, r2);
+}
+
+inline void op_DIV(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      if (as_int(r2) == 0) {
+        vm.errors.push_back({});
+      } else {
+        ref = from_raw_value(as_int(r1) / as_int(r2));
+      }
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      if (as_float(r2) == 0.0) {
+        vm.errors.push_back({});
+      } else {
+        ref = from_raw_value(as_float(r1) / as_float(r2));
+      }
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: DIV operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::DIV, r1, r2);
+}
+
+inline void op_CVT_I_D(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == ValueType::TPV_INT) {
+    ref = from_raw_value(static_cast<TPV_FLOAT>(as_int(r1)));
+  } else if (r1.type() == ValueType::TPV_FLOAT) {
+    ref = r1;
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: CVT_I_D operation on {}",
+                            get_value_type_name(r1.type()))});
+  }
+}
+
+inline void op_CVT_D_I(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == ValueType::TPV_INT) {
+    ref = r1;
+  } else if (r1.type() == ValueType::TPV_FLOAT) {
+    reg(vm, rd) = from_raw_value(static_cast<TPV_INT>(as_float(r1)));
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: CVT_D_I operation on {}",
+                            get_value_type_name(r1.type()))});
+  }
+}
+
+inline void op_NEGATE(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == ValueType::TPV_INT) {
+    reg(vm, rd) = from_raw_value(static_cast<TPV_FLOAT>(-as_int(r1)));
+  } else if (r1.type() == ValueType::TPV_FLOAT) {
+    reg(vm, rd) = from_raw_value(static_cast<TPV_FLOAT>(-as_float(r1)));
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: NEGATE operation on {}",
+                            get_value_type_name(r1.type()))});
+  }
+}
+
+inline void op_HLT(VM& vm, const Instr& ins) {
+  vm.is_running = false;
+}
+
+// every jump goes through here so the JIT sees loop back edges
+inline void jump(VM& vm, int32_t target) {
+  auto& frame = vm.frames.back();
+  if (vm.use_jit && static_cast<uint32_t>(target) < frame.pc) {
+    jit_back_edge(vm, target);
+  } else {
+    frame.pc = target;
+  }
+}
+
+inline void op_JMP(VM& vm, const Instr& ins) {
+  const auto new_pc = ins.imm;
+  jump(vm, new_pc);
+}
+
+inline void op_JMP_IF(VM& vm, const Instr& ins) {
+  const auto r1 = reg(vm, ins.r1);
+  const auto new_pc = ins.imm;
+
+  if (r1.type() == ValueType::TPV_INT) {
+    auto val = as_int(r1);
+    if (val)
+      jump(vm, new_pc);
+  } else if (r1.type() == ValueType::TPV_FLOAT) {
+    auto val = as_float(r1);
+    if (val)
+      jump(vm, new_pc);
+  } else {
+    vm.errors.push_back({});
+  }
+}
+
+inline void op_EQ(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) == as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) == as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: EQ operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::EQ, r1, r2);
+}
+
+inline void op_NEQ(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) != as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) != as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: NEQ operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::NEQ, r1, r2);
+}
+
+inline void op_GT(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) > as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) > as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: GT operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::GT, r1, r2);
+}
+
+inline void op_GTE(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) >= as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) >= as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: GTE operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::GTE, r1, r2);
+}
+
+inline void op_LT(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) < as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) < as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: LT operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::LT, r1, r2);
+}
+
+inline void op_LTE(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) <= as_int(r2));
+    } else if (r1.type() == ValueType::TPV_FLOAT) {
+      ref = from_raw_value(as_float(r1) <= as_float(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: LTE operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+
+  quicken(vm, Opcode::LTE, r1, r2);
+}
+
+inline void op_BITAND(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) & as_int(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: BITAND operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: BITAND operation on {} and {}",
+                            get_value_type_name(r1.type()),
+                            get_value_type_name(r2.type()))});
+  }
+}
+
+inline void op_BITOR(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) | as_int(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: BITOR operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: BITOR operation on {} and {}",
+                            get_value_type_name(r1.type()),
+                            get_value_type_name(r2.type()))});
+  }
+}
+
+inline void op_BITXOR(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == r2.type()) {
+    if (r1.type() == ValueType::TPV_INT) {
+      ref = from_raw_value(as_int(r1) ^ as_int(r2));
+    } else {
+      vm.errors.push_back(
+          {.msg = std::format("Type Error: BITXOR operation on {} and {}",
+                              get_value_type_name(r1.type()),
+                              get_value_type_name(r2.type()))});
+    }
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: BITXOR operation on {} and {}",
+                            get_value_type_name(r1.type()),
+                            get_value_type_name(r2.type()))});
+  }
+}
+
+inline void op_BITNOT(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == ValueType::TPV_INT) {
+    ref = from_raw_value(~as_int(r1));
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: BITNOT operation on {}",
+                            get_value_type_name(r1.type()))});
+  }
+}
+
+inline void op_BITSHL(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto imm = ins.imm;
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == ValueType::TPV_INT) {
+    ref = from_raw_value(as_int(r1) << imm);
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: BITSHL operation on {}",
+                            get_value_type_name(r1.type()))});
+  }
+}
+
+inline void op_BITSHRL(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto imm = ins.imm;
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == ValueType::TPV_INT) {
+    auto val = as_int(r1);
+
+    if (val < 0) {
+      auto result =
+          static_cast<std::make_unsigned_t<TPV_INT>>(val) >> imm;
+      ref = from_raw_value(static_cast<TPV_INT>(result));
+    } else {
+      ref = from_raw_value(val >> imm);
+    }
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: BITSHRL operation on {}",
+                            get_value_type_name(r1.type()))});
+  }
+}
+
+inline void op_BITSHRA(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto imm = ins.imm;
+
+  auto& ref = reg(vm, rd);
+
+  if (r1.type() == ValueType::TPV_INT) {
+    ref = from_raw_value(as_int(r1) >> imm);
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: BITSHRA operation on {}",
+                            get_value_type_name(r1.type()))});
+  }
+}
+
+inline void op_PUSH(VM& vm, const Instr& ins) {
+  const auto r1 = reg(vm, ins.r1);
+  vm.frames.back().stack.push_back(r1);
+}
+
+inline void op_POP(VM& vm, const Instr& ins) {
+  auto& stack = vm.frames.back().stack;
+  if (stack.empty()) {
+    vm.errors.push_back({.msg = "Stack Error: POP on an empty stack"});
+    return;
+  }
+  reg(vm, ins.rd) = stack.back();
+  stack.pop_back();
+}
+
+inline void op_VMCALL(VM& vm, const Instr& ins) {
+  const auto r1_idx = ins.r1;
+  const auto r2_idx = ins.r2;
+  const auto imm = ins.imm;
+
+  switch (imm) {
+    case 0: {
+      const auto& r1 = reg(vm, r1_idx);
+      if (r1.type() == ValueType::TPV_INT) {
+        const auto num = as_int(r1);
+        std::printf("%d", num);
+      } else if (r1.type() == ValueType::TPV_FLOAT) {
+        const auto num = as_float(r1);
+        std::printf("%f", num);
+      } else if (const auto* obj = as_string(r1)) {
+        std::printf("%s", obj->value.c_str());
+      } else {
+        vm.errors.push_back({"Nothing in the register"});
+      }
+
+      const auto& r2 = reg(vm, r2_idx);
+      if (r2.type() == ValueType::TPV_INT) {
+        const auto flag = as_int(r2);
+        if (flag == 1) {
+          std::printf("\n");
+        }
+      } else {
+        vm.errors.push_back({});
+      }
+      break;
+    }
+    case 1: {
+      char buffer[256];
+      if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
+        char* endptr;
+        long int input = strtol(buffer, &endptr, 10);
+        if (*endptr == '\n' || *endptr == '\0') {
+          reg(vm, r1_idx) = from_raw_value(static_cast<TPV_INT>(input));
+        } else {
+          vm.errors.push_back({"Invalid integer input"});
+        }
+      } else {
+        vm.errors.push_back({"Failed to read input"});
+      }
+      break;
+    }
+    case 2: {
+      char buffer[256];
+      if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
+        char* endptr;
+        float input = strtof(buffer, &endptr);
+        if (*endptr == '\n' || *endptr == '\0') {
+          reg(vm, r1_idx) = from_raw_value(static_cast<TPV_FLOAT>(input));
+        } else {
+          vm.errors.push_back({"Invalid integer input"});
+        }
+      } else {
+        vm.errors.push_back({"Failed to read input"});
+      }
+      break;
+    }
+    case 3: {
+      std::string input;
+      std::getline(std::cin, input);
+      size_t input_size = input.size();
+
+      if (input_size != -1) {
+        if (input[input_size - 1] == '\n') {
+          input[input_size - 1] = '\0';
+        }
+
+        reg(vm, r1_idx) = from_obj_value(vm.str_table[vm.intern(input)]);
+      } else {
+        vm.errors.push_back({"Failed to read input"});
+      }
+
+      break;
+    }
+    default:
+      vm.errors.push_back({"Invalid flag"});
+      break;
+  }
+}
+
+// FUNCDEF bodies are split off by load_bytes
+inline void op_FUNCDEF(VM& vm, const Instr& ins) {}
+
+inline void op_FUNCDEF_G(VM& vm, const Instr& ins) {}
+
+inline void op_FUNCEND(VM& vm, const Instr& ins) {}
+
+inline void op_SET_ARG(VM& vm, const Instr& ins) {
+  vm.set_arg(static_cast<uint32_t>(ins.imm), reg(vm, ins.r1));
+}
+
+// arguments sit right before the window, the verifier keeps imm below arity
+inline void op_GET_ARG(VM& vm, const Instr& ins) {
+  const auto& frame = vm.frames.back();
+  const auto* args = frame.registers - frame.function->arity;
+
+  reg(vm, ins.rd) = args[ins.imm];
+}
+
+inline void op_CALL(VM& vm, const Instr& ins) {
+  const auto r1 = reg(vm, ins.r1);
+  const auto imm1 = ins.imm;
+  // the arguments set so far are this call's, even if it fails
+  auto& caller = vm.frames.back();
+  const auto args = caller.arg_count;
+  caller.arg_count = 0;
+
+  // r1 picks the module, 0 is the current one
+  if (r1.type() == ValueType::TPV_INT && as_int(r1) == 0) {
+    // linked by VM::load_bytes, so no lookup by function index
+    const auto& target = caller.function->call_targets[imm1];
+    if (args != target.arity) {
+      vm.errors.push_back(
+          {.msg = std::format(
+               "Arity Error: CALL to {} with {} arguments, it takes {}",
+               target.function->name, args, target.arity)});
+      return;
+    }
+    if (vm.frames.size() >= MAX_FRAME) {
+      vm.errors.push_back(
+          {.msg = std::format("Stack Error: CALL to {} past {} frames",
+                              target.function->name, MAX_FRAME)});
+      return;
+    }
+    vm.push_frame(target, ins.rd);
+    if (vm.use_jit) {
+      jit_call(vm);
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+}
+
+// the callee returns straight to this frame's caller, so tail recursion runs
+// in a constant number of frames. A failed TAILCALL goes on with the next
+// instruction like a failed CALL
+inline void op_TAILCALL(VM& vm, const Instr& ins) {
+  const auto r1 = reg(vm, ins.r1);
+  auto& frame = vm.frames.back();
+  const auto args = frame.arg_count;
+  frame.arg_count = 0;
+
+  if (vm.frames.size() == 1) {
+    vm.errors.push_back({.msg = "Stack Error: TAILCALL from main"});
+    return;
+  }
+  if (r1.type() == ValueType::TPV_INT && as_int(r1) == 0) {
+    const auto& target = frame.function->call_targets[ins.imm];
+    if (args != target.arity) {
+      vm.errors.push_back(
+          {.msg = std::format(
+               "Arity Error: TAILCALL to {} with {} arguments, it takes {}",
+               target.function->name, args, target.arity)});
+      return;
+    }
+    vm.replace_frame(target);
+    if (vm.use_jit) {
+      jit_call(vm);
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+}
+
+inline void op_RETURN(VM& vm, const Instr& ins) {
+  if (vm.frames.size() == 1) {
+    vm.errors.push_back({.msg = "Stack Error: RETURN from main"});
+    return;
+  }
+  vm.pop_frame(reg(vm, ins.rd));
+}
+
+inline void op_NEW_ARRAY(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+
+  reg(vm, rd) = from_obj_value(vm.new_object<TPV_ObjArray>());
+}
+
+// no new object, the array never leaves the frame
+inline void op_NEW_ARRAY_SCRATCH(VM& vm, const Instr& ins) {
+  reg(vm, ins.rd) = from_obj_value(vm.scratch_array(ins.imm));
+}
+
+inline void op_SET_ARRAY(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+  auto* list_ptr = as_array(r1);
+  if (list_ptr && r2.type() == ValueType::TPV_INT) {
+    const auto before = list_ptr->capacity_bytes();
+    list_ptr->set(static_cast<size_t>(as_int(r2)), ref);
+    vm.write_barrier(list_ptr, ref);
+    // appending can grow the buffer, the collector counts that too
+    const auto after = list_ptr->capacity_bytes();
+    if (after > before) {
+      vm.track_growth(list_ptr, after - before);
+    }
+  } else {
+    vm.errors.push_back({});
+  }
+}
+
+inline void op_GET_ARRAY(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+  auto* list_ptr = as_array(r1);
+  if (list_ptr && r2.type() == ValueType::TPV_INT) {
+    ref = list_ptr->get(as_int(r2));
+  } else {
+    vm.errors.push_back({});
+  }
+}
+
+inline void op_RM_ARRAY(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  auto& ref = reg(vm, rd);
+  auto* list_ptr = as_array(r1);
+  if (list_ptr && r2.type() == ValueType::TPV_INT) {
+    list_ptr->erase(as_int(r2));
+  } else {
+    vm.errors.push_back({});
+  }
+}
+
+inline void op_GET_ARRAY_LEN(VM& vm, const Instr& ins) {
+  auto rd = ins.rd;
+  const auto r1 = reg(vm, ins.r1);
+
+  auto& ref = reg(vm, rd);
+  if (auto* list_ptr = as_array(r1)) {
+    ref = from_raw_value((TPV_INT)list_ptr->size());
+  } else {
+    vm.errors.push_back({});
+  }
+}
+
+// element type of a numeric array, from its kind or, once it holds Values,
+// from its first element. TPV_INT for an empty array
+inline ValueType element_type(const TPV_ObjArray& array) {
+  if (array.size() == 0 || array.kind == TPV_ObjArray::Kind::INTS) {
+    return ValueType::TPV_INT;
+  } else if (array.kind == TPV_ObjArray::Kind::FLOATS) {
+    return ValueType::TPV_FLOAT;
+  }
+  return array.values.front().type();
+}
+
+template <typename T>
+constexpr auto packed_kind = std::is_same_v<T, TPV_INT>
+                                 ? TPV_ObjArray::Kind::INTS
+                                 : TPV_ObjArray::Kind::FLOATS;
+
+template <typename T>
+inline std::vector<T>& packed(TPV_ObjArray& array) {
+  if constexpr (std::is_same_v<T, TPV_INT>) {
+    return array.ints;
+  } else {
+    return array.floats;
+  }
+}
+
+// the elements as a flat T buffer the kernels run over, nothing if one of
+// them is not a T. That is the packed buffer, only an array that went to
+// Values is copied into scratch
+template <typename T>
+inline std::optional<std::span<const T>> elements_of(TPV_ObjArray& array,
+                                                     std::vector<T>& scratch) {
+  if (array.size() == 0 || array.kind == packed_kind<T>) {
+    return packed<T>(array);
+  } else if (array.kind != TPV_ObjArray::Kind::VALUES) {
+    return std::nullopt;
+  }
+
+  scratch.resize(array.values.size());
+  for (size_t i = 0; i < scratch.size(); i++) {
+    const auto element = array.values[i];
+    if (element.type() != value_type_of<T>) {
+      return std::nullopt;
+    }
+    scratch[i] = as_number<T>(element);
+  }
+  return scratch;
+}
+
+// rd = a new array of the n Ts fill writes, fill returns false if it wrote
+// nothing. The array rd held may be in other registers or arrays, so it is
+// never written over
+template <typename T, typename Fill>
+inline void store_elements(VM& vm, uint8_t rd, size_t n, Fill fill) {
+  std::vector<T> elements(n);
+  if (!fill(elements.data())) {
+    return;
+  }
+
+  auto* array = vm.new_object<TPV_ObjArray>();
+  array->assign(std::move(elements));
+  reg(vm, rd) = from_obj_value(array);
+  vm.track_growth(array, array->capacity_bytes());
+}
+
+inline void mixed_elements_error(VM& vm, const char* name) {
+  vm.errors.push_back(
+      {.msg = std::format(
+           "Type Error: {} operation on an array of mixed or non-number "
+           "elements",
+           name)});
+}
+
+// the array in value if its first element is a number, or nullptr after
+// reporting why it is not one
+inline TPV_ObjArray* vector_operand(VM& vm,
+                                    const char* name,
+                                    const Value& value) {
+  auto* array = as_array(value);
+  if (!array) {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: {} operation on {}", name,
+                            get_value_type_name(value.type()))});
+    return nullptr;
+  }
+
+  const auto type = element_type(*array);
+  if (type != ValueType::TPV_INT && type != ValueType::TPV_FLOAT) {
+    mixed_elements_error(vm, name);
+    return nullptr;
+  }
+  return array;
+}
+
+// elements of two arrays of the same length and element type
+template <typename T>
+struct Vector_Pair {
+  std::span<const T> lhs;
+  std::span<const T> rhs;
+};
+
+template <typename T, typename Run>
+inline void run_pair(VM& vm,
+                     const char* name,
+                     TPV_ObjArray& lhs,
+                     TPV_ObjArray& rhs,
+                     Run run) {
+  std::vector<T> lhs_scratch;
+  std::vector<T> rhs_scratch;
+  auto a = elements_of<T>(lhs, lhs_scratch);
+  auto b = a ? elements_of<T>(rhs, rhs_scratch) : std::nullopt;
+  if (!b) {
+    mixed_elements_error(vm, name);
+    return;
+  }
+  run(Vector_Pair<T>{.lhs = *a, .rhs = *b});
+}
+
+// operands of an elementwise op or VDOT: two numeric arrays of the same
+// length and element type, run gets their Vector_Pair<TPV_INT> or
+// Vector_Pair<TPV_FLOAT>
+template <typename Run>
+inline void vector_pair(VM& vm,
+                        const char* name,
+                        const Value& r1,
+                        const Value& r2,
+                        Run run) {
+  auto* lhs = vector_operand(vm, name, r1);
+  auto* rhs = lhs ? vector_operand(vm, name, r2) : nullptr;
+  if (!rhs) {
+    return;
+  }
+
+  const auto lhs_size = lhs->size();
+  const auto rhs_size = rhs->size();
+  const auto type = element_type(*lhs);
+  if (lhs_size != rhs_size) {
+    vm.errors.push_back(
+        {.msg = std::format(
+             "Length Error: {} operation on arrays of {} and {} elements",
+             name, lhs_size, rhs_size)});
+  } else if (element_type(*rhs) != type) {
+    vm.errors.push_back(
+        {.msg = std::format("Type Error: {} operation on arrays of {} and {}",
+                            name, get_value_type_name(type),
+                            get_value_type_name(element_type(*rhs)))});
+  } else if (type == ValueType::TPV_INT) {
+    run_pair<TPV_INT>(vm, name, *lhs, *rhs, run);
+  } else {
+    run_pair<TPV_FLOAT>(vm, name, *lhs, *rhs, run);
+  }
+}
+
+// elementwise op over two arrays, rd gets a new array. The operands are read
+// before rd is written, so VADD r1, r1, r2 works
+template <Vector_Op Op>
+inline void op_vector(VM& vm, const Instr& ins, const char* name) {
+  const auto& r1 = reg(vm, ins.r1);
+  const auto& r2 = reg(vm, ins.r2);
+
+  vector_pair(vm, name, r1, r2, [&]<typename T>(const Vector_Pair<T>& pair) {
+    const auto n = pair.lhs.size();
+    if constexpr (Op >= Vector_Op::EQ) {
+      store_elements<TPV_INT>(vm, ins.rd, n, [&](TPV_INT* out) {
+        vector_compare(Op, pair.lhs.data(), pair.rhs.data(), out, n);
+        return true;
+      });
+    } else {
+      store_elements<T>(vm, ins.rd, n, [&](T* out) {
+        if (vector_arith(Op, pair.lhs.data(), pair.rhs.data(), out, n)) {
+          return true;
+        }
+        vm.errors.push_back(
+            {.msg = std::format("Math Error: {} operation with a zero divisor",
+                                name)});
+        return false;
+      });
+    }
+  });
+}
+
+inline void op_VADD(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::ADD>(vm, ins, "VADD");
+}
+
+inline void op_VSUB(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::SUB>(vm, ins, "VSUB");
+}
+
+inline void op_VMUL(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::MUL>(vm, ins, "VMUL");
+}
+
+inline void op_VDIV(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::DIV>(vm, ins, "VDIV");
+}
+
+inline void op_VEQ(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::EQ>(vm, ins, "VEQ");
+}
+
+inline void op_VNEQ(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::NEQ>(vm, ins, "VNEQ");
+}
+
+inline void op_VGT(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::GT>(vm, ins, "VGT");
+}
+
+inline void op_VGTE(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::GTE>(vm, ins, "VGTE");
+}
+
+inline void op_VLT(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::LT>(vm, ins, "VLT");
+}
+
+inline void op_VLTE(VM& vm, const Instr& ins) {
+  op_vector<Vector_Op::LTE>(vm, ins, "VLTE");
+}
+
+inline void op_VDOT(VM& vm, const Instr& ins) {
+  const auto& r1 = reg(vm, ins.r1);
+  const auto& r2 = reg(vm, ins.r2);
+
+  vector_pair(vm, "VDOT", r1, r2, [&](const auto& pair) {
+    reg(vm, ins.rd) = from_raw_value(
+        vector_dot(pair.lhs.data(), pair.rhs.data(), pair.lhs.size()));
+  });
+}
+
+inline void op_VSCALE(VM& vm, const Instr& ins) {
+  const auto& r1 = reg(vm, ins.r1);
+  const auto& r2 = reg(vm, ins.r2);
+
+  auto* array = vector_operand(vm, "VSCALE", r1);
+  if (!array) {
+    return;
+  }
+
+  auto scale = [&]<typename T>(T factor) {
+    std::vector<T> scratch;
+    if (const auto elements = elements_of<T>(*array, scratch)) {
+      store_elements<T>(vm, ins.rd, elements->size(), [&](T* out) {
+        vector_scale(elements->data(), factor, out, elements->size());
+        return true;
+      });
+    } else {
+      mixed_elements_error(vm, "VSCALE");
+    }
+  };
+
+  const auto type = array->size() == 0 ? r2.type() : element_type(*array);
+  if (type == ValueType::TPV_INT && r2.type() == type) {
+    scale(as_int(r2));
+  } else if (type == ValueType::TPV_FLOAT && r2.type() == type) {
+    scale(as_float(r2));
+  } else {
+    vm.errors.push_back(
+        {.msg = std::format(
+             "Type Error: VSCALE operation on array of {} and {}",
+             get_value_type_name(type), get_value_type_name(r2.type()))});
+  }
+}
+
+// reduction of one array to an int or a float
+template <TPV_INT (*Int_Reduce)(const TPV_INT*, size_t),
+          TPV_FLOAT (*Float_Reduce)(const TPV_FLOAT*, size_t)>
+inline void op_reduce(VM& vm,
+                      const Instr& ins,
+                      const char* name,
+                      bool allow_empty) {
+  const auto& r1 = reg(vm, ins.r1);
+
+  auto* array = vector_operand(vm, name, r1);
+  if (!array) {
+    return;
+  }
+
+  auto reduce = [&]<typename T>(T (*fn)(const T*, size_t)) {
+    std::vector<T> scratch;
+    if (const auto elements = elements_of<T>(*array, scratch)) {
+      reg(vm, ins.rd) = from_raw_value(fn(elements->data(), elements->size()));
+    } else {
+      mixed_elements_error(vm, name);
+    }
+  };
+
+  if (!allow_empty && array->size() == 0) {
+    vm.errors.push_back(
+        {.msg = std::format("Length Error: {} operation on an empty array",
+                            name)});
+  } else if (element_type(*array) == ValueType::TPV_INT) {
+    reduce(Int_Reduce);
+  } else {
+    reduce(Float_Reduce);
+  }
+}
+
+inline void op_VSUM(VM& vm, const Instr& ins) {
+  op_reduce<vector_sum, vector_sum>(vm, ins, "VSUM", true);
+}
+
+inline void op_VMIN(VM& vm, const Instr& ins) {
+  op_reduce<vector_min, vector_min>(vm, ins, "VMIN", false);
+}
+
+inline void op_VMAX(VM& vm, const Instr& ins) {
+  op_reduce<vector_max, vector_max>(vm, ins, "VMAX", false);
+}
+
+inline void op_IGL(VM& vm, const Instr& ins) {}
+
+inline void op_NOP(VM& vm, const Instr& ins) {}
+
+inline void op_MOV(VM& vm, const Instr& ins) {
+  reg(vm, ins.rd) = reg(vm, ins.r1);
+}
+
+// leave pc on END, so code appended by a later load_bytes carries on from here
+// the end of a function returns nil to its caller. The end of main stops
+// dispatch, returns true, and stays where it is for the next load
+inline bool op_END(VM& vm, const Instr& ins) {
+  if (vm.frames.size() > 1) {
+    vm.pop_frame(unit_value());
+    return false;
+  }
+  vm.frames.back().pc -= 1;
+  return true;
+}
+
+// superinstruction: run ins and then the instruction after it without going
+// back through dispatch, pc skips the second one unless it jumps
+template <void (*First)(VM&, const Instr&), void (*Second)(VM&, const Instr&)>
+inline void op_fused(VM& vm, const Instr& ins) {
+  First(vm, ins);
+
+  auto& frame = vm.frames.back();
+  const auto next = frame.function->code[frame.pc];
+  frame.pc += 1;
+  Second(vm, next);
+}
+
+inline void op_EQ_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_EQ, op_JMP_IF>(vm, ins);
+}
+
+inline void op_NEQ_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_NEQ, op_JMP_IF>(vm, ins);
+}
+
+inline void op_GT_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_GT, op_JMP_IF>(vm, ins);
+}
+
+inline void op_GTE_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_GTE, op_JMP_IF>(vm, ins);
+}
+
+inline void op_LT_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_LT, op_JMP_IF>(vm, ins);
+}
+
+inline void op_LTE_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_LTE, op_JMP_IF>(vm, ins);
+}
+
+inline void op_SETI_ADD(VM& vm, const Instr& ins) {
+  op_fused<op_SETI, op_ADD>(vm, ins);
+}
+
+inline void op_SETI_SUB(VM& vm, const Instr& ins) {
+  op_fused<op_SETI, op_SUB>(vm, ins);
+}
+
+inline void op_GET_ARRAY_ADD(VM& vm, const Instr& ins) {
+  op_fused<op_GET_ARRAY, op_ADD>(vm, ins);
+}
+
+inline void op_GET_ARRAY_SUB(VM& vm, const Instr& ins) {
+  op_fused<op_GET_ARRAY, op_SUB>(vm, ins);
+}
+
+inline void op_GET_ARRAY_MUL(VM& vm, const Instr& ins) {
+  op_fused<op_GET_ARRAY, op_MUL>(vm, ins);
+}
+
+inline void op_GET_ARRAY_DIV(VM& vm, const Instr& ins) {
+  op_fused<op_GET_ARRAY, op_DIV>(vm, ins);
+}
+
+// quickened form: only checks that both operands still have type T, otherwise
+// it puts the generic op back into the slot and runs the generic handler
+template <typename T,
+          Opcode Typed,
+          Opcode Generic,
+          void (*Fallback)(VM&, const Instr&),
+          typename Fn>
+inline void op_typed(VM& vm, const Instr& ins, Fn fn) {
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+
+  if (r1.type() == value_type_of<T> && r2.type() == value_type_of<T>) {
+    const auto a = as_number<T>(r1);
+    const auto b = as_number<T>(r2);
+    // compares produce an int like the generic handlers do
+    reg(vm, ins.rd) = from_raw_value(
+        static_cast<std::conditional_t<
+            std::is_same_v<decltype(fn(a, b)), bool>, TPV_INT, T>>(fn(a, b)));
+  } else {
+    rewrite_slot(vm, Typed, Generic);
+    Fallback(vm, ins);
+  }
+}
+
+// division leaves the error for a zero divisor to the generic handler but
+// stays quickened, the types still matched
+template <typename T, Opcode Typed>
+inline void op_typed_div(VM& vm, const Instr& ins) {
+  const auto r1 = reg(vm, ins.r1);
+  const auto r2 = reg(vm, ins.r2);
+  const bool typed =
+      r1.type() == value_type_of<T> && r2.type() == value_type_of<T>;
+
+  if (typed && as_number<T>(r2) != 0) {
+    reg(vm, ins.rd) =
+        from_raw_value(static_cast<T>(as_number<T>(r1) / as_number<T>(r2)));
+    return;
+  }
+
+  if (!typed) {
+    rewrite_slot(vm, Typed, Opcode::DIV);
+  }
+  op_DIV(vm, ins);
+}
+
+inline void op_ADD_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::ADD_INT, Opcode::ADD, op_ADD>(vm, ins,
+                                                          std::plus<>{});
+}
+
+inline void op_ADD_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::ADD_FLOAT, Opcode::ADD, op_ADD>(vm, ins,
+                                                              std::plus<>{});
+}
+
+inline void op_SUB_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::SUB_INT, Opcode::SUB, op_SUB>(vm, ins,
+                                                          std::minus<>{});
+}
+
+inline void op_SUB_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::SUB_FLOAT, Opcode::SUB, op_SUB>(vm, ins,
+                                                              std::minus<>{});
+}
+
+inline void op_MUL_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::MUL_INT, Opcode::MUL, op_MUL>(
+      vm, ins, std::multiplies<>{});
+}
+
+inline void op_MUL_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::MUL_FLOAT, Opcode::MUL, op_MUL>(
+      vm, ins, std::multiplies<>{});
+}
+
+inline void op_DIV_INT(VM& vm, const Instr& ins) {
+  op_typed_div<TPV_INT, Opcode::DIV_INT>(vm, ins);
+}
+
+inline void op_DIV_FLOAT(VM& vm, const Instr& ins) {
+  op_typed_div<TPV_FLOAT, Opcode::DIV_FLOAT>(vm, ins);
+}
+
+inline void op_EQ_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::EQ_INT, Opcode::EQ, op_EQ>(vm, ins,
+                                                       std::equal_to<>{});
+}
+
+inline void op_EQ_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::EQ_FLOAT, Opcode::EQ, op_EQ>(vm, ins,
+                                                           std::equal_to<>{});
+}
+
+inline void op_NEQ_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::NEQ_INT, Opcode::NEQ, op_NEQ>(
+      vm, ins, std::not_equal_to<>{});
+}
+
+inline void op_NEQ_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::NEQ_FLOAT, Opcode::NEQ, op_NEQ>(
+      vm, ins, std::not_equal_to<>{});
+}
+
+inline void op_GT_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::GT_INT, Opcode::GT, op_GT>(vm, ins,
+                                                       std::greater<>{});
+}
+
+inline void op_GT_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::GT_FLOAT, Opcode::GT, op_GT>(vm, ins,
+                                                           std::greater<>{});
+}
+
+inline void op_GTE_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::GTE_INT, Opcode::GTE, op_GTE>(
+      vm, ins, std::greater_equal<>{});
+}
+
+inline void op_GTE_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::GTE_FLOAT, Opcode::GTE, op_GTE>(
+      vm, ins, std::greater_equal<>{});
+}
+
+inline void op_LT_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::LT_INT, Opcode::LT, op_LT>(vm, ins, std::less<>{});
+}
+
+inline void op_LT_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::LT_FLOAT, Opcode::LT, op_LT>(vm, ins,
+                                                           std::less<>{});
+}
+
+inline void op_LTE_INT(VM& vm, const Instr& ins) {
+  op_typed<TPV_INT, Opcode::LTE_INT, Opcode::LTE, op_LTE>(
+      vm, ins, std::less_equal<>{});
+}
+
+inline void op_LTE_FLOAT(VM& vm, const Instr& ins) {
+  op_typed<TPV_FLOAT, Opcode::LTE_FLOAT, Opcode::LTE, op_LTE>(
+      vm, ins, std::less_equal<>{});
+}
+
+// proven forms: the operands have type T whenever this instruction runs, so
+// the value is read without looking at the tag. Checked builds still do
+template <typename T>
+inline T proven_value(const Value& value) {
+#ifdef TPV_VM_CHECKED
+  if (value.type() != value_type_of<T>) {
+    std::print(stderr, "Fatal Error: proven {} operand holds {}\n",
+               get_value_type_name(value_type_of<T>),
+               get_value_type_name(value.type()));
+    std::abort();
+  }
+#endif
+  return as_number<T>(value);
+}
+
+template <typename T, typename Fn>
+inline void op_proven(VM& vm, const Instr& ins, Fn fn) {
+  const auto a = proven_value<T>(reg(vm, ins.r1));
+  const auto b = proven_value<T>(reg(vm, ins.r2));
+
+  // compares produce an int like the generic handlers do
+  reg(vm, ins.rd) = from_raw_value(
+      static_cast<std::conditional_t<
+          std::is_same_v<decltype(fn(a, b)), bool>, TPV_INT, T>>(fn(a, b)));
+}
+
+// a zero divisor is not a type, the generic handler reports it
+template <typename T>
+inline void op_proven_div(VM& vm, const Instr& ins) {
+  const auto a = proven_value<T>(reg(vm, ins.r1));
+  const auto b = proven_value<T>(reg(vm, ins.r2));
+
+  if (b != 0) {
+    reg(vm, ins.rd) = from_raw_value(static_cast<T>(a / b));
+  } else {
+    op_DIV(vm, ins);
+  }
+}
+
+inline void op_ADD_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::plus<>{});
+}
+
+inline void op_ADD_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::plus<>{});
+}
+
+inline void op_SUB_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::minus<>{});
+}
+
+inline void op_SUB_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::minus<>{});
+}
+
+inline void op_MUL_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::multiplies<>{});
+}
+
+inline void op_MUL_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::multiplies<>{});
+}
+
+inline void op_DIV_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven_div<TPV_INT>(vm, ins);
+}
+
+inline void op_DIV_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven_div<TPV_FLOAT>(vm, ins);
+}
+
+inline void op_EQ_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::equal_to<>{});
+}
+
+inline void op_EQ_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::equal_to<>{});
+}
+
+inline void op_NEQ_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::not_equal_to<>{});
+}
+
+inline void op_NEQ_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::not_equal_to<>{});
+}
+
+inline void op_GT_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::greater<>{});
+}
+
+inline void op_GT_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::greater<>{});
+}
+
+inline void op_GTE_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::greater_equal<>{});
+}
+
+inline void op_GTE_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::greater_equal<>{});
+}
+
+inline void op_LT_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::less<>{});
+}
+
+inline void op_LT_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::less<>{});
+}
+
+inline void op_LTE_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_INT>(vm, ins, std::less_equal<>{});
+}
+
+inline void op_LTE_FLOAT_PROVEN(VM& vm, const Instr& ins) {
+  op_proven<TPV_FLOAT>(vm, ins, std::less_equal<>{});
+}
+
+// superinstructions whose typed half was proven, see fusion.hpp
+
+inline void op_EQ_INT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_EQ_INT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_EQ_FLOAT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_EQ_FLOAT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_NEQ_INT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_NEQ_INT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_NEQ_FLOAT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_NEQ_FLOAT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_GT_INT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_GT_INT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_GT_FLOAT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_GT_FLOAT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_GTE_INT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_GTE_INT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_GTE_FLOAT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_GTE_FLOAT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_LT_INT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_LT_INT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_LT_FLOAT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_LT_FLOAT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_LTE_INT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_LTE_INT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_LTE_FLOAT_PROVEN_JMP_IF(VM& vm, const Instr& ins) {
+  op_fused<op_LTE_FLOAT_PROVEN, op_JMP_IF>(vm, ins);
+}
+
+inline void op_SETI_ADD_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_fused<op_SETI, op_ADD_INT_PROVEN>(vm, ins);
+}
+
+inline void op_SETI_SUB_INT_PROVEN(VM& vm, const Instr& ins) {
+  op_fused<op_SETI, op_SUB_INT_PROVEN>(vm, ins);
+}
+
+// every opcode that hands control on to the next instruction
+// HLT and END stop dispatch and are handled by each loop itself
+#define TPV_DISPATCH_OPCODES(X) \
+  X(SETI)                       \
+  X(SETF)                       \
+  X(SETS)                       \
+  X(SETNIL)                     \
+  X(STORE)                      \
+  X(LOAD)                       \
+  X(ADD)                        \
+  X(SUB)                        \
+  X(MUL)                        \
+  X(DIV)                        \
+  X(CVT_I_D)                    \
+  X(CVT_D_I)                    \
+  X(NEGATE)                     \
+  X(JMP)                        \
+  X(JMP_IF)                     \
+  X(EQ)                         \
+  X(NEQ)                        \
+  X(GT)                         \
+  X(GTE)                        \
+  X(LT)                         \
+  X(LTE)                        \
+  X(BITAND)                     \
+  X(BITOR)                      \
+  X(BITXOR)                     \
+  X(BITNOT)                     \
+  X(BITSHL)                     \
+  X(BITSHRL)                    \
+  X(BITSHRA)                    \
+  X(VMCALL)                     \
+  X(PUSH)                       \
+  X(POP)                        \
+  X(FUNCDEF)                    \
+  X(FUNCDEF_G)                  \
+  X(FUNCEND)                    \
+  X(SET_ARG)                    \
+  X(GET_ARG)                    \
+  X(CALL)                       \
+  X(RETURN)                     \
+  X(TAILCALL)                   \
+  X(NEW_ARRAY)                  \
+  X(SET_ARRAY)                  \
+  X(GET_ARRAY)                  \
+  X(RM_ARRAY)                   \
+  X(GET_ARRAY_LEN)              \
+  X(VADD)                       \
+  X(VSUB)                       \
+  X(VMUL)                       \
+  X(VDIV)                       \
+  X(VEQ)                        \
+  X(VNEQ)                       \
+  X(VGT)                        \
+  X(VGTE)                       \
+  X(VLT)                        \
+  X(VLTE)                       \
+  X(VDOT)                       \
+  X(VSCALE)                     \
+  X(VSUM)                       \
+  X(VMIN)                       \
+  X(VMAX)                       \
+  X(IGL)                        \
+  X(NOP)                        \
+  X(MOV)                        \
+  X(NEW_ARRAY_SCRATCH)          \
+  X(EQ_JMP_IF)                  \
+  X(NEQ_JMP_IF)                 \
+  X(GT_JMP_IF)                  \
+  X(GTE_JMP_IF)                 \
+  X(LT_JMP_IF)                  \
+  X(LTE_JMP_IF)                 \
+  X(SETI_ADD)                   \
+  X(SETI_SUB)                   \
+  X(GET_ARRAY_ADD)              \
+  X(GET_ARRAY_SUB)              \
+  X(GET_ARRAY_MUL)              \
+  X(GET_ARRAY_DIV)              \
+  X(EQ_INT_PROVEN_JMP_IF)       \
+  X(EQ_FLOAT_PROVEN_JMP_IF)     \
+  X(NEQ_INT_PROVEN_JMP_IF)      \
+  X(NEQ_FLOAT_PROVEN_JMP_IF)    \
+  X(GT_INT_PROVEN_JMP_IF)       \
+  X(GT_FLOAT_PROVEN_JMP_IF)     \
+  X(GTE_INT_PROVEN_JMP_IF)      \
+  X(GTE_FLOAT_PROVEN_JMP_IF)    \
+  X(LT_INT_PROVEN_JMP_IF)       \
+  X(LT_FLOAT_PROVEN_JMP_IF)     \
+  X(LTE_INT_PROVEN_JMP_IF)      \
+  X(LTE_FLOAT_PROVEN_JMP_IF)    \
+  X(SETI_ADD_INT_PROVEN)        \
+  X(SETI_SUB_INT_PROVEN)        \
+  X(ADD_INT)                    \
+  X(ADD_FLOAT)                  \
+  X(SUB_INT)                    \
+  X(SUB_FLOAT)                  \
+  X(MUL_INT)                    \
+  X(MUL_FLOAT)                  \
+  X(DIV_INT)                    \
+  X(DIV_FLOAT)                  \
+  X(EQ_INT)                     \
+  X(EQ_FLOAT)                   \
+  X(NEQ_INT)                    \
+  X(NEQ_FLOAT)                  \
+  X(GT_INT)                     \
+  X(GT_FLOAT)                   \
+  X(GTE_INT)                    \
+  X(GTE_FLOAT)                  \
+  X(LT_INT)                     \
+  X(LT_FLOAT)                   \
+  X(LTE_INT)                    \
+  X(LTE_FLOAT)                  \
+  X(ADD_INT_PROVEN)             \
+  X(ADD_FLOAT_PROVEN)           \
+  X(SUB_INT_PROVEN)             \
+  X(SUB_FLOAT_PROVEN)           \
+  X(MUL_INT_PROVEN)             \
+  X(MUL_FLOAT_PROVEN)           \
+  X(DIV_INT_PROVEN)             \
+  X(DIV_FLOAT_PROVEN)           \
+  X(EQ_INT_PROVEN)              \
+  X(EQ_FLOAT_PROVEN)            \
+  X(NEQ_INT_PROVEN)             \
+  X(NEQ_FLOAT_PROVEN)           \
+  X(GT_INT_PROVEN)              \
+  X(GT_FLOAT_PROVEN)            \
+  X(GTE_INT_PROVEN)             \
+  X(GTE_FLOAT_PROVEN)           \
+  X(LT_INT_PROVEN)              \
+  X(LT_FLOAT_PROVEN)            \
+  X(LTE_INT_PROVEN)             \
+  X(LTE_FLOAT_PROVEN)
+
+}  // namespace TPV
+
+#endif  // !HANDLERS_HPP
@@ -0,0 +1,425 @@
+#include "inliner.hpp"
+
+#include <algorithm>
+#include <optional>
+#include <unordered_map>
+
+#include "../instructions.hpp"
+#include "cfg.hpp"
+#include "type_inference.hpp"
+#include "vm.hpp"
+
+namespace TPV {
+
+namespace {
+
+bool is_call(Opcode op) {
+  return op == Opcode::CALL || op == Opcode::TAILCALL;
+}
+
+// what inlining a callee needs to know, the same for every call to it
+struct Callee {
+  bool inlinable = false;
+  // registers it may read before it surely wrote them, they start as int 0
+  Registers init;
+  // its END can be reached, that returns NIL
+  bool returns_nil = false;
+};
+
+Callee analyze_callee(const TPV_Function& func, const Inline_Config& config) {
+  const auto& code = func.code;
+  // without the END
+  const auto size = code.size() - 1;
+  Callee callee;
+  if (size > config.max_callee_size) {
+    return callee;
+  }
+  for (size_t idx = 0; idx < size; idx++) {
+    switch (base_op(code[idx].op)) {
+      case Opcode::CALL:
+      case Opcode::TAILCALL:
+      case Opcode::SET_ARG:
+      case Opcode::HLT:
+      case Opcode::PUSH:
+      case Opcode::POP:
+        return callee;
+      default:
+        break;
+    }
+  }
+
+  // registers written on every path to each instruction
+  std::vector<Registers> surely(code.size());
+  std::vector<bool> reached(code.size(), false);
+  std::vector<size_t> work{0};
+  reached[0] = true;
+  while (!work.empty()) {
+    const auto idx = work.back();
+    work.pop_back();
+
+    auto out = surely[idx];
+    const auto& ins = code[idx];
+    if (always_writes(ins.op)) {
+      out.set(ins.rd);
+    }
+    for (const auto succ : successors(code, idx, true)) {
+      if (!reached[succ]) {
+        reached[succ] = true;
+        surely[succ] = out;
+        work.push_back(succ);
+      } else if ((surely[succ] & out) != surely[succ]) {
+        surely[succ] &= out;
+        work.push_back(succ);
+      }
+    }
+  }
+
+  for (size_t idx = 0; idx < size; idx++) {
+    if (reached[idx]) {
+      callee.init |= read(code[idx]) & ~surely[idx];
+    }
+  }
+  callee.returns_nil = reached[size];
+  callee.inlinable = true;
+  return callee;
+}
+
+// what holds on every path to an instruction of the caller
+struct Facts {
+  // registers holding int 0
+  Registers zero;
+  // no argument is set for the next call
+  bool clean = true;
+};
+
+// Facts before every instruction, std::nullopt where no path goes
+std::vector<std::optional<Facts>> analyze_caller(
+    const std::vector<Instr>& code) {
+  std::vector<std::optional<Facts>> facts(code.size());
+  // a new frame's registers are all int 0
+  facts[0] = Facts{.zero = Registers{}.set(), .clean = true};
+  std::vector<size_t> work{0};
+  while (!work.empty()) {
+    const auto idx = work.back();
+    work.pop_back();
+
+    auto out = *facts[idx];
+    const auto& ins = code[idx];
+    const auto op = base_op(ins.op);
+    if (op == Opcode::SETI) {
+      out.zero.set(ins.rd, ins.imm == 0);
+    } else if (const auto reg = written(ins)) {
+      out.zero.reset(*reg);
+    }
+    if (is_call(op)) {
+      // even a failed call takes the arguments
+      out.clean = true;
+    } else if (op == Opcode::SET_ARG) {
+      out.clean = false;
+    }
+
+    for (const auto succ : successors(code, idx, true)) {
+      auto& in = facts[succ];
+      if (!in) {
+        in = out;
+        work.push_back(succ);
+      } else if ((in->zero & out.zero) != in->zero ||
+                 (in->clean && !out.clean)) {
+        in->zero &= out.zero;
+        in->clean = in->clean && out.clean;
+        work.push_back(succ);
+      }
+    }
+  }
+  return facts;
+}
+
+// a CALL that gets inlined
+struct Site {
+  const TPV_Function* callee;
+  const Callee* info;
+  // callee register r is caller register base + r
+  uint32_t base;
+  // caller register GET_ARG k reads
+  std::vector<uint8_t> args;
+};
+
+}  // namespace
+
+size_t inline_calls(TPV_Function& caller,
+                    const std::vector<TPV_Function*>& functions,
+                    const Inline_Config& config,
+                    Inline_Stats& stats) {
+  const auto& code = caller.code;
+  const auto calls = std::count_if(code.begin(), code.end(), [](auto& ins) {
+    return ins.op == Opcode::CALL;
+  });
+  stats.call_sites += calls;
+  if (!config.enabled || calls == 0) {
+    return 0;
+  }
+
+  const auto blocks = find_blocks(code, 0, true);
+
+  const auto facts = analyze_caller(code);
+  std::unordered_map<const TPV_Function*, Callee> callees;
+  std::unordered_map<size_t, Site> sites;
+  // SET_ARGs of inlined calls, and the register some of them copy to
+  std::unordered_map<size_t, std::optional<uint8_t>> set_args;
+  const auto first_free = static_cast<uint32_t>(caller.num_registers);
+  auto num_registers = caller.num_registers;
+
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    const auto& ins = code[idx];
+    if (ins.op != Opcode::CALL || !facts[idx] ||
+        !facts[idx]->zero.test(ins.r1)) {
+      continue;
+    }
+
+    const auto* callee = functions[ins.imm];
+    auto found = callees.find(callee);
+    if (found == callees.end()) {
+      found = callees.emplace(callee, analyze_callee(*callee, config)).first;
+    }
+    const auto& info = found->second;
+    if (!info.inlinable) {
+      continue;
+    }
+
+    // the arguments are the SET_ARGs since the block or the last call began
+    auto first = idx;
+    while (!blocks.starts_at(first) && !is_call(base_op(code[first - 1].op))) {
+      first -= 1;
+    }
+    if (!facts[first]->clean) {
+      continue;
+    }
+    // last SET_ARG of each argument
+    std::vector<std::optional<size_t>> last(callee->arity);
+    bool matches = true;
+    for (auto at = first; at < idx; at++) {
+      if (code[at].op != Opcode::SET_ARG) {
+        continue;
+      }
+      const auto arg = static_cast<size_t>(code[at].imm);
+      if (arg >= last.size()) {
+        matches = false;
+        break;
+      }
+      last[arg] = at;
+    }
+    matches = matches && std::all_of(last.begin(), last.end(),
+                                     [](auto& at) { return at.has_value(); });
+    if (!matches) {
+      continue;
+    }
+
+    // an argument whose register is written before the CALL is copied
+    Site site{.callee = callee, .info = &info, .base = first_free, .args = {}};
+    const auto copies_from = first_free + callee->num_registers;
+    auto copies = copies_from;
+    std::unordered_map<size_t, std::optional<uint8_t>> site_args;
+    for (auto& at : last) {
+      const auto src = code[*at].r1;
+      bool changed = false;
+      for (auto later = *at + 1; later < idx; later++) {
+        changed = changed || written(code[later]) == src;
+      }
+      if (changed) {
+        site_args[*at] = static_cast<uint8_t>(copies);
+        site.args.push_back(static_cast<uint8_t>(copies));
+        copies += 1;
+      } else {
+        site.args.push_back(src);
+      }
+    }
+    if (copies > MAX_REGISTERS) {
+      continue;
+    }
+
+    for (auto at = first; at < idx; at++) {
+      if (code[at].op == Opcode::SET_ARG) {
+        set_args[at] = site_args.contains(at) ? site_args[at] : std::nullopt;
+      }
+    }
+    num_registers = std::max<size_t>(num_registers, copies);
+    sites.emplace(idx, std::move(site));
+  }
+
+  if (sites.empty()) {
+    return 0;
+  }
+
+  std::vector<Instr> out;
+  out.reserve(code.size() * 2);
+  auto literals = caller.str_literals;
+  std::unordered_map<const TPV_Function*, int32_t> literals_at;
+  // caller instruction -> where it went, and the caller's jumps in out
+  std::vector<uint32_t> moved(code.size());
+  std::vector<size_t> caller_jumps;
+
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    moved[idx] = static_cast<uint32_t>(out.size());
+    const auto& ins = code[idx];
+
+    if (auto arg = set_args.find(idx); arg != set_args.end()) {
+      // the body reads the argument from the register itself or a copy
+      if (arg->second) {
+        out.push_back({.op = Opcode::MOV,
+                       .rd = *arg->second,
+                       .r1 = ins.r1,
+                       .r2 = 0,
+                       .imm = 0});
+      }
+      continue;
+    }
+
+    const auto site = sites.find(idx);
+    if (site == sites.end()) {
+      const auto op = base_op(ins.op);
+      if (op == Opcode::JMP || op == Opcode::JMP_IF) {
+        caller_jumps.push_back(out.size());
+      }
+      out.push_back(ins);
+      continue;
+    }
+
+    const auto& callee = *site->second.callee;
+    const auto& info = *site->second.info;
+    const auto base = site->second.base;
+    const auto& args = site->second.args;
+    auto literal = literals_at.find(&callee);
+    if (literal == literals_at.end()) {
+      literal = literals_at
+                    .emplace(&callee, static_cast<int32_t>(literals.size()))
+                    .first;
+      literals.insert(literals.end(), callee.str_literals.begin(),
+                      callee.str_literals.end());
+    }
+
+    for (size_t r = 0; r < MAX_REGISTERS; r++) {
+      if (info.init.test(r)) {
+        out.push_back({.op = Opcode::SETI,
+                       .rd = static_cast<uint8_t>(base + r),
+                       .r1 = 0,
+                       .r2 = 0,
+                       .imm = 0});
+      }
+    }
+
+    const auto size = callee.code.size() - 1;
+    // callee instruction -> where it went, its END is where NIL is returned
+    std::vector<uint32_t> at(size + 1);
+    // jumps past the body, and jumps inside it still holding callee indices
+    std::vector<size_t> exits;
+    std::vector<size_t> jumps;
+    for (size_t j = 0; j < size; j++) {
+      at[j] = static_cast<uint32_t>(out.size());
+      auto body = callee.code[j];
+      body.op = base_op(body.op);
+      auto rename = [&](uint8_t& reg) {
+        reg = static_cast<uint8_t>(base + reg);
+      };
+
+      switch (body.op) {
+        case Opcode::GET_ARG:
+          out.push_back({.op = Opcode::MOV,
+                         .rd = static_cast<uint8_t>(base + body.rd),
+                         .r1 = args[body.imm],
+                         .r2 = 0,
+                         .imm = 0});
+          continue;
+        case Opcode::RETURN:
+          out.push_back({.op = Opcode::MOV,
+                         .rd = ins.rd,
+                         .r1 = static_cast<uint8_t>(base + body.rd),
+                         .r2 = 0,
+                         .imm = 0});
+          // the last RETURN falls through unless NIL comes after it
+          if (j + 1 < size || info.returns_nil) {
+            exits.push_back(out.size());
+            out.push_back(
+                {.op = Opcode::JMP, .rd = 0, .r1 = 0, .r2 = 0, .imm = 0});
+          }
+          continue;
+        case Opcode::SETS:
+          body.imm += literal->second;
+          break;
+        case Opcode::JMP:
+        case Opcode::JMP_IF:
+          jumps.push_back(out.size());
+          break;
+        default:
+          break;
+      }
+
+      switch (operands_of(body.op)) {
+        case Operands::RD:
+        case Operands::RD_IMM:
+        case Operands::RD_STR:
+          rename(body.rd);
+          break;
+        case Operands::R1:
+        case Operands::R1_IMM:
+          rename(body.r1);
+          break;
+        case Operands::RD_R1:
+        case Operands::RD_R1_IMM:
+          rename(body.rd);
+          rename(body.r1);
+          break;
+        case Operands::RD_R1_R2:
+          rename(body.rd);
+          rename(body.r1);
+          rename(body.r2);
+          break;
+        case Operands::R1_R2_IMM:
+          rename(body.r1);
+          rename(body.r2);
+          break;
+        case Operands::NONE:
+        case Operands::IMM:
+          break;
+      }
+      out.push_back(body);
+    }
+
+    at[size] = static_cast<uint32_t>(out.size());
+    if (info.returns_nil) {
+      out.push_back(
+          {.op = Opcode::SETNIL, .rd = ins.rd, .r1 = 0, .r2 = 0, .imm = 0});
+    }
+    for (const auto jump : jumps) {
+      out[jump].imm = static_cast<int32_t>(at[out[jump].imm]);
+    }
+    for (const auto exit : exits) {
+      out[exit].imm = static_cast<int32_t>(out.size());
+    }
+  }
+
+  for (const auto jump : caller_jumps) {
+    out[jump].imm = static_cast<int32_t>(moved[out[jump].imm]);
+  }
+
+  // proven forms only hold for the code they were proven in, the callee's
+  // were dropped and the caller's are proven again with the arguments known
+  TPV_Function inlined;
+  inlined.name = caller.name;
+  inlined.arity = caller.arity;
+  inlined.code = std::move(out);
+  inlined.str_literals = std::move(literals);
+  inlined.num_registers = num_registers;
+  std::vector<Error> errors;
+  if (!infer_types(inlined, 0, errors)) {
+    return 0;
+  }
+
+  stats.inlined += sites.size();
+  stats.instructions_added += inlined.code.size() - caller.code.size();
+  caller.code = std::move(inlined.code);
+  caller.str_literals = std::move(inlined.str_literals);
+  caller.num_registers = inlined.num_registers;
+  return sites.size();
+}
+
+}  // namespace TPV
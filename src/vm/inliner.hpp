@@ -0,0 +1,50 @@
+#ifndef INLINER_HPP
+#define INLINER_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "../value.hpp"
+
+namespace TPV {
+
+struct Inline_Config {
+  // off: every CALL stays a call
+  bool enabled = true;
+  // longest callee inlined, in instructions without the END
+  size_t max_callee_size = 16;
+};
+
+struct Inline_Stats {
+  // CALLs in the functions the pass went over
+  size_t call_sites = 0;
+  size_t inlined = 0;
+  // instructions the callers grew by
+  size_t instructions_added = 0;
+};
+
+// splice the callees of caller's CALLs into it where the callee is a leaf
+// (no CALL, TAILCALL, SET_ARG, HLT, PUSH or POP) of at most
+// config.max_callee_size instructions. functions[i] is function i in FUNCDEF
+// order. A call is only inlined where nothing can tell the difference:
+// - its module register holds int 0 on every path
+// - no arguments are left from before, and the SET_ARGs in its block since
+//   the last call set exactly the callee's arity
+// - the callee's registers fit past the caller's window
+// The callee's registers are renamed past the caller's window and start as
+// int 0 like a fresh frame. GET_ARG reads the register the SET_ARG named,
+// or a copy of it if the caller writes that register before the CALL.
+// RETURN copies its value to the CALL's rd and jumps past the body, running
+// off the end writes NIL. An inlined call cannot run out of frames.
+//
+// Runs on verified functions before fusion, the result goes through
+// infer_types again. If that rejects it the caller is left as it was.
+// Returns the number of calls inlined, stats counts them too
+size_t inline_calls(TPV_Function& caller,
+                    const std::vector<TPV_Function*>& functions,
+                    const Inline_Config& config,
+                    Inline_Stats& stats);
+
+}  // namespace TPV
+
+#endif  // !INLINER_HPP
@@ -0,0 +1,523 @@
+#include "simd.hpp"
+
+#include <array>
+#include <cstring>
+#include <type_traits>
+
+namespace TPV {
+
+namespace {
+
+// lanes of the widest level, the narrower ones split each step in halves
+constexpr size_t LANES = 8;
+
+#define TPV_INLINE [[gnu::always_inline]] inline
+
+template <typename T>
+constexpr bool is_int = std::is_same_v<T, TPV_INT>;
+
+// int ops go through uint32_t so they wrap like the scalar handlers
+template <Vector_Op Op, typename T>
+TPV_INLINE T scalar_arith(T a, T b) {
+  if constexpr (is_int<T>) {
+    const auto ua = static_cast<uint32_t>(a);
+    const auto ub = static_cast<uint32_t>(b);
+    switch (Op) {
+      case Vector_Op::ADD:
+        return static_cast<T>(ua + ub);
+      case Vector_Op::SUB:
+        return static_cast<T>(ua - ub);
+      case Vector_Op::MUL:
+        return static_cast<T>(ua * ub);
+      default:
+        // the only quotient that overflows
+        return b == -1 ? static_cast<T>(0u - ua) : a / b;
+    }
+  } else {
+    switch (Op) {
+      case Vector_Op::ADD:
+        return a + b;
+      case Vector_Op::SUB:
+        return a - b;
+      case Vector_Op::MUL:
+        return a * b;
+      default:
+        return a / b;
+    }
+  }
+}
+
+template <Vector_Op Op, typename T>
+TPV_INLINE bool scalar_compare(T a, T b) {
+  switch (Op) {
+    case Vector_Op::EQ:
+      return a == b;
+    case Vector_Op::NEQ:
+      return a != b;
+    case Vector_Op::GT:
+      return a > b;
+    case Vector_Op::GTE:
+      return a >= b;
+    case Vector_Op::LT:
+      return a < b;
+    default:
+      return a <= b;
+  }
+}
+
+enum class Reduce : uint8_t { SUM, DOT, MIN, MAX };
+
+// one step of a reduction, also used to combine the lanes at the end
+template <Reduce R, typename T>
+TPV_INLINE T scalar_step(T acc, T x) {
+  switch (R) {
+    case Reduce::MIN:
+      return x < acc ? x : acc;
+    case Reduce::MAX:
+      return x > acc ? x : acc;
+    default:
+      return scalar_arith<Vector_Op::ADD>(acc, x);
+  }
+}
+
+template <Reduce R, typename T>
+TPV_INLINE T scalar_element(const T* a, const T* b, size_t i) {
+  if constexpr (R == Reduce::DOT) {
+    return scalar_arith<Vector_Op::MUL>(a[i], b[i]);
+  } else {
+    return a[i];
+  }
+}
+
+#if TPV_HAS_SIMD
+// every helper taking or returning lanes is inlined into a kernel of one
+// level, no vector crosses a call
+#pragma GCC diagnostic ignored "-Wpsabi"
+
+// GNU vector types, the target of the function they are used in picks the
+// instructions
+using Int_Lanes = TPV_INT __attribute__((vector_size(LANES * 4)));
+using Uint_Lanes = uint32_t __attribute__((vector_size(LANES * 4)));
+using Float_Lanes = TPV_FLOAT __attribute__((vector_size(LANES * 4)));
+
+template <typename T>
+using Lanes = std::conditional_t<is_int<T>, Int_Lanes, Float_Lanes>;
+
+template <typename T>
+TPV_INLINE Lanes<T> load(const T* src) {
+  Lanes<T> lanes;
+  std::memcpy(&lanes, src, sizeof(lanes));
+  return lanes;
+}
+
+template <typename T, typename V>
+TPV_INLINE void store(T* dst, V lanes) {
+  std::memcpy(dst, &lanes, sizeof(lanes));
+}
+
+// a where mask is set, b elsewhere
+template <typename V>
+TPV_INLINE V select(Int_Lanes mask, V a, V b) {
+  return (V)(((Int_Lanes)a & mask) | ((Int_Lanes)b & ~mask));
+}
+
+// int DIV has no vector form, arith_loop keeps it scalar
+template <Vector_Op Op, typename V>
+TPV_INLINE V lanes_arith(V a, V b) {
+  if constexpr (std::is_same_v<V, Int_Lanes>) {
+    const auto ua = (Uint_Lanes)a;
+    const auto ub = (Uint_Lanes)b;
+    switch (Op) {
+      case Vector_Op::ADD:
+        return (V)(ua + ub);
+      case Vector_Op::SUB:
+        return (V)(ua - ub);
+      default:
+        return (V)(ua * ub);
+    }
+  } else {
+    switch (Op) {
+      case Vector_Op::ADD:
+        return a + b;
+      case Vector_Op::SUB:
+        return a - b;
+      case Vector_Op::MUL:
+        return a * b;
+      default:
+        return a / b;
+    }
+  }
+}
+
+// compares give -1 or 0 per lane
+template <Vector_Op Op, typename V>
+TPV_INLINE Int_Lanes lanes_compare(V a, V b) {
+  switch (Op) {
+    case Vector_Op::EQ:
+      return (Int_Lanes)(a == b);
+    case Vector_Op::NEQ:
+      return (Int_Lanes)(a != b);
+    case Vector_Op::GT:
+      return (Int_Lanes)(a > b);
+    case Vector_Op::GTE:
+      return (Int_Lanes)(a >= b);
+    case Vector_Op::LT:
+      return (Int_Lanes)(a < b);
+    default:
+      return (Int_Lanes)(a <= b);
+  }
+}
+
+template <Reduce R, typename V>
+TPV_INLINE V lanes_step(V acc, V x) {
+  switch (R) {
+    case Reduce::MIN:
+      return select(lanes_compare<Vector_Op::LT>(x, acc), x, acc);
+    case Reduce::MAX:
+      return select(lanes_compare<Vector_Op::GT>(x, acc), x, acc);
+    default:
+      return lanes_arith<Vector_Op::ADD>(acc, x);
+  }
+}
+
+template <Reduce R, typename T>
+TPV_INLINE Lanes<T> lanes_element(const T* a, const T* b, size_t i) {
+  if constexpr (R == Reduce::DOT) {
+    return lanes_arith<Vector_Op::MUL>(load(a + i), load(b + i));
+  } else {
+    return load(a + i);
+  }
+}
+#endif
+
+// the loops every level runs. Wide adds the vector part in front of the
+// scalar one, which then only sees the tail
+template <bool Wide, Vector_Op Op, typename T>
+TPV_INLINE void arith_loop(const T* a, const T* b, T* out, size_t n) {
+  size_t i = 0;
+#if TPV_HAS_SIMD
+  if constexpr (Wide && !(is_int<T> && Op == Vector_Op::DIV)) {
+    for (; i + LANES <= n; i += LANES) {
+      store(out + i, lanes_arith<Op>(load(a + i), load(b + i)));
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = scalar_arith<Op>(a[i], b[i]);
+  }
+}
+
+template <bool Wide, Vector_Op Op, typename T>
+TPV_INLINE void compare_loop(const T* a, const T* b, TPV_INT* out, size_t n) {
+  size_t i = 0;
+#if TPV_HAS_SIMD
+  if constexpr (Wide) {
+    for (; i + LANES <= n; i += LANES) {
+      store(out + i, lanes_compare<Op>(load(a + i), load(b + i)) & 1);
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = scalar_compare<Op>(a[i], b[i]);
+  }
+}
+
+template <bool Wide, typename T>
+TPV_INLINE void scale_loop(const T* a, T factor, T* out, size_t n) {
+  size_t i = 0;
+#if TPV_HAS_SIMD
+  if constexpr (Wide) {
+    const auto factors = Lanes<T>{} + factor;
+    for (; i + LANES <= n; i += LANES) {
+      store(out + i, lanes_arith<Vector_Op::MUL>(load(a + i), factors));
+    }
+  }
+#endif
+  for (; i < n; i++) {
+    out[i] = scalar_arith<Vector_Op::MUL>(a[i], factor);
+  }
+}
+
+// element i goes to lane i % LANES whether or not the level is Wide
+template <bool Wide, Reduce R, typename T>
+TPV_INLINE T reduce_loop(const T* a, const T* b, size_t n) {
+  std::array<T, LANES> lanes;
+  lanes.fill(R == Reduce::MIN || R == Reduce::MAX ? a[0] : T{});
+
+  size_t i = 0;
+#if TPV_HAS_SIMD
+  if constexpr (Wide) {
+    auto acc = load(lanes.data());
+    for (; i + LANES <= n; i += LANES) {
+      acc = lanes_step<R>(acc, lanes_element<R>(a, b, i));
+    }
+    store(lanes.data(), acc);
+  }
+#endif
+  for (; i < n; i++) {
+    auto& lane = lanes[i % LANES];
+    lane = scalar_step<R>(lane, scalar_element<R>(a, b, i));
+  }
+
+  T result = lanes[0];
+  for (size_t lane = 1; lane < LANES; lane++) {
+    result = scalar_step<R>(result, lanes[lane]);
+  }
+  return result;
+}
+
+template <bool Wide, typename T>
+TPV_INLINE void arith_switch(Vector_Op op,
+                             const T* a,
+                             const T* b,
+                             T* out,
+                             size_t n) {
+  switch (op) {
+    case Vector_Op::ADD:
+      return arith_loop<Wide, Vector_Op::ADD>(a, b, out, n);
+    case Vector_Op::SUB:
+      return arith_loop<Wide, Vector_Op::SUB>(a, b, out, n);
+    case Vector_Op::MUL:
+      return arith_loop<Wide, Vector_Op::MUL>(a, b, out, n);
+    default:
+      return arith_loop<Wide, Vector_Op::DIV>(a, b, out, n);
+  }
+}
+
+template <bool Wide, typename T>
+TPV_INLINE void compare_switch(Vector_Op op,
+                               const T* a,
+                               const T* b,
+                               TPV_INT* out,
+                               size_t n) {
+  switch (op) {
+    case Vector_Op::EQ:
+      return compare_loop<Wide, Vector_Op::EQ>(a, b, out, n);
+    case Vector_Op::NEQ:
+      return compare_loop<Wide, Vector_Op::NEQ>(a, b, out, n);
+    case Vector_Op::GT:
+      return compare_loop<Wide, Vector_Op::GT>(a, b, out, n);
+    case Vector_Op::GTE:
+      return compare_loop<Wide, Vector_Op::GTE>(a, b, out, n);
+    case Vector_Op::LT:
+      return compare_loop<Wide, Vector_Op::LT>(a, b, out, n);
+    default:
+      return compare_loop<Wide, Vector_Op::LTE>(a, b, out, n);
+  }
+}
+
+template <bool Wide, typename T>
+TPV_INLINE T reduce_switch(Reduce r, const T* a, const T* b, size_t n) {
+  switch (r) {
+    case Reduce::SUM:
+      return reduce_loop<Wide, Reduce::SUM>(a, b, n);
+    case Reduce::DOT:
+      return reduce_loop<Wide, Reduce::DOT>(a, b, n);
+    case Reduce::MIN:
+      return reduce_loop<Wide, Reduce::MIN>(a, b, n);
+    default:
+      return reduce_loop<Wide, Reduce::MAX>(a, b, n);
+  }
+}
+
+// the kernels of one level, compiled for its target
+#define TPV_LEVEL_KERNELS(LEVEL, TARGET, WIDE)                             \
+  template <typename T>                                                    \
+  TARGET void arith_##LEVEL(Vector_Op op, const T* a, const T* b, T* out,  \
+                            size_t n) {                                    \
+    arith_switch<WIDE>(op, a, b, out, n);                                  \
+  }                                                                        \
+  template <typename T>                                                    \
+  TARGET void compare_##LEVEL(Vector_Op op, const T* a, const T* b,        \
+                              TPV_INT* out, size_t n) {                    \
+    compare_switch<WIDE>(op, a, b, out, n);                                \
+  }                                                                        \
+  template <typename T>                                                    \
+  TARGET void scale_##LEVEL(const T* a, T factor, T* out, size_t n) {      \
+    scale_loop<WIDE>(a, factor, out, n);                                   \
+  }                                                                        \
+  template <typename T>                                                    \
+  TARGET T reduce_##LEVEL(Reduce r, const T* a, const T* b, size_t n) {    \
+    return reduce_switch<WIDE>(r, a, b, n);                                \
+  }
+
+TPV_LEVEL_KERNELS(scalar, , false)
+#if TPV_HAS_SIMD
+TPV_LEVEL_KERNELS(sse4_1, __attribute__((target("sse4.1"))), true)
+TPV_LEVEL_KERNELS(avx2, __attribute__((target("avx2"))), true)
+#endif
+
+#undef TPV_LEVEL_KERNELS
+
+// run KERNEL at the current level
+#if TPV_HAS_SIMD
+#define TPV_RUN_KERNEL(KERNEL, ...)            \
+  switch (simd_level()) {                      \
+    case Simd_Level::AVX2:                     \
+      return KERNEL##_avx2(__VA_ARGS__);       \
+    case Simd_Level::SSE4_1:                   \
+      return KERNEL##_sse4_1(__VA_ARGS__);     \
+    default:                                   \
+      return KERNEL##_scalar(__VA_ARGS__);     \
+  }
+#else
+#define TPV_RUN_KERNEL(KERNEL, ...) return KERNEL##_scalar(__VA_ARGS__);
+#endif
+
+template <typename T>
+void run_arith(Vector_Op op, const T* a, const T* b, T* out, size_t n) {
+  TPV_RUN_KERNEL(arith, op, a, b, out, n)
+}
+
+template <typename T>
+void compare(Vector_Op op, const T* a, const T* b, TPV_INT* out, size_t n) {
+  TPV_RUN_KERNEL(compare, op, a, b, out, n)
+}
+
+template <typename T>
+void scale(const T* a, T factor, T* out, size_t n) {
+  TPV_RUN_KERNEL(scale, a, factor, out, n)
+}
+
+template <typename T>
+T reduce(Reduce r, const T* a, const T* b, size_t n) {
+  TPV_RUN_KERNEL(reduce, r, a, b, n)
+}
+
+#undef TPV_RUN_KERNEL
+
+template <typename T>
+bool arith(Vector_Op op, const T* a, const T* b, T* out, size_t n) {
+  if (op == Vector_Op::DIV) {
+    for (size_t i = 0; i < n; i++) {
+      if (b[i] == 0) {
+        return false;
+      }
+    }
+  }
+
+  run_arith(op, a, b, out, n);
+  return true;
+}
+
+Simd_Level& current_level() {
+  static Simd_Level level = detect_simd_level();
+  return level;
+}
+
+}  // namespace
+
+Simd_Level detect_simd_level() {
+#if TPV_HAS_SIMD
+  static const Simd_Level level = [] {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+      return Simd_Level::AVX2;
+    }
+    if (__builtin_cpu_supports("sse4.1")) {
+      return Simd_Level::SSE4_1;
+    }
+    return Simd_Level::SCALAR;
+  }();
+  return level;
+#else
+  return Simd_Level::SCALAR;
+#endif
+}
+
+Simd_Level simd_level() {
+  return current_level();
+}
+
+void set_simd_level(Simd_Level level) {
+  const auto best = detect_simd_level();
+  current_level() = level > best ? best : level;
+}
+
+const char* simd_level_name(Simd_Level level) {
+  switch (level) {
+    case Simd_Level::AVX2:
+      return "avx2";
+    case Simd_Level::SSE4_1:
+      return "sse4.1";
+    default:
+      return "scalar";
+  }
+}
+
+bool vector_arith(Vector_Op op,
+                  const TPV_INT* a,
+                  const TPV_INT* b,
+                  TPV_INT* out,
+                  size_t n) {
+  return arith(op, a, b, out, n);
+}
+
+bool vector_arith(Vector_Op op,
+                  const TPV_FLOAT* a,
+                  const TPV_FLOAT* b,
+                  TPV_FLOAT* out,
+                  size_t n) {
+  return arith(op, a, b, out, n);
+}
+
+void vector_compare(Vector_Op op,
+                    const TPV_INT* a,
+                    const TPV_INT* b,
+                    TPV_INT* out,
+                    size_t n) {
+  compare(op, a, b, out, n);
+}
+
+void vector_compare(Vector_Op op,
+                    const TPV_FLOAT* a,
+                    const TPV_FLOAT* b,
+                    TPV_INT* out,
+                    size_t n) {
+  compare(op, a, b, out, n);
+}
+
+void vector_scale(const TPV_INT* a, TPV_INT factor, TPV_INT* out, size_t n) {
+  scale(a, factor, out, n);
+}
+
+void vector_scale(const TPV_FLOAT* a,
+                  TPV_FLOAT factor,
+                  TPV_FLOAT* out,
+                  size_t n) {
+  scale(a, factor, out, n);
+}
+
+TPV_INT vector_dot(const TPV_INT* a, const TPV_INT* b, size_t n) {
+  return reduce(Reduce::DOT, a, b, n);
+}
+
+TPV_FLOAT vector_dot(const TPV_FLOAT* a, const TPV_FLOAT* b, size_t n) {
+  return reduce(Reduce::DOT, a, b, n);
+}
+
+TPV_INT vector_sum(const TPV_INT* a, size_t n) {
+  return reduce(Reduce::SUM, a, a, n);
+}
+
+TPV_FLOAT vector_sum(const TPV_FLOAT* a, size_t n) {
+  return reduce(Reduce::SUM, a, a, n);
+}
+
+TPV_INT vector_min(const TPV_INT* a, size_t n) {
+  return reduce(Reduce::MIN, a, a, n);
+}
+
+TPV_FLOAT vector_min(const TPV_FLOAT* a, size_t n) {
+  return reduce(Reduce::MIN, a, a, n);
+}
+
+TPV_INT vector_max(const TPV_INT* a, size_t n) {
+  return reduce(Reduce::MAX, a, a, n);
+}
+
+TPV_FLOAT vector_max(const TPV_FLOAT* a, size_t n) {
+  return reduce(Reduce::MAX, a, a, n);
+}
+
+}  // namespace TPV
@@ -0,0 +1,96 @@
+#ifndef SIMD_HPP
+#define SIMD_HPP
+
+#include <cstddef>
+#include <cstdint>
+
+#include "../common.hpp"
+
+// the SSE4.1 and AVX2 kernels need x86 and the GNU target attribute,
+// elsewhere every kernel runs the scalar loop
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#define TPV_HAS_SIMD 1
+#else
+#define TPV_HAS_SIMD 0
+#endif
+
+namespace TPV {
+
+// instruction sets the array kernels are compiled for, lowest first
+enum class Simd_Level : uint8_t {
+  SCALAR,  // one element at a time
+  SSE4_1,  // 128bit, 4 lanes
+  AVX2,    // 256bit, 8 lanes
+};
+
+// best level the CPU supports, checked once
+Simd_Level detect_simd_level();
+// level the kernels run at, detect_simd_level() unless lowered
+Simd_Level simd_level();
+// pick a lower level, e.g. to compare against the scalar loop. Levels the
+// CPU lacks fall back to the detected one
+void set_simd_level(Simd_Level level);
+const char* simd_level_name(Simd_Level level);
+
+enum class Vector_Op : uint8_t {
+  ADD,
+  SUB,
+  MUL,
+  DIV,
+  EQ,
+  NEQ,
+  GT,
+  GTE,
+  LT,
+  LTE,
+};
+
+// out[i] = a[i] op b[i] for ADD/SUB/MUL/DIV, with the scalar ops' rules: int
+// arithmetic wraps and int DIV truncates, INT_MIN / -1 is INT_MIN. DIV
+// returns false and writes nothing if any b[i] is zero
+bool vector_arith(Vector_Op op,
+                  const TPV_INT* a,
+                  const TPV_INT* b,
+                  TPV_INT* out,
+                  size_t n);
+bool vector_arith(Vector_Op op,
+                  const TPV_FLOAT* a,
+                  const TPV_FLOAT* b,
+                  TPV_FLOAT* out,
+                  size_t n);
+
+// out[i] = a[i] op b[i] ? 1 : 0 for EQ ... LTE
+void vector_compare(Vector_Op op,
+                    const TPV_INT* a,
+                    const TPV_INT* b,
+                    TPV_INT* out,
+                    size_t n);
+void vector_compare(Vector_Op op,
+                    const TPV_FLOAT* a,
+                    const TPV_FLOAT* b,
+                    TPV_INT* out,
+                    size_t n);
+
+// out[i] = a[i] * factor
+void vector_scale(const TPV_INT* a, TPV_INT factor, TPV_INT* out, size_t n);
+void vector_scale(const TPV_FLOAT* a,
+                  TPV_FLOAT factor,
+                  TPV_FLOAT* out,
+                  size_t n);
+
+// reductions run on 8 lanes at every level, element i goes to lane i % 8 and
+// the lanes are combined in order, so float results do not depend on the CPU.
+// They can differ in the last bits from a left to right loop
+TPV_INT vector_dot(const TPV_INT* a, const TPV_INT* b, size_t n);
+TPV_FLOAT vector_dot(const TPV_FLOAT* a, const TPV_FLOAT* b, size_t n);
+TPV_INT vector_sum(const TPV_INT* a, size_t n);
+TPV_FLOAT vector_sum(const TPV_FLOAT* a, size_t n);
+// n must be at least 1. A NaN in a float array wins only if it is a[0]
+TPV_INT vector_min(const TPV_INT* a, size_t n);
+TPV_FLOAT vector_min(const TPV_FLOAT* a, size_t n);
+TPV_INT vector_max(const TPV_INT* a, size_t n);
+TPV_FLOAT vector_max(const TPV_FLOAT* a, size_t n);
+
+}  // namespace TPV
+
+#endif  // !SIMD_HPP
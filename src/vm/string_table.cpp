@@ -0,0 +1,77 @@
+#include "string_table.hpp"
+
+#include <algorithm>
+#include <functional>
+
+namespace TPV {
+
+namespace {
+
+constexpr size_t MIN_SLOTS = 64;
+
+}  // namespace
+
+uint64_t String_Table::hash(std::string_view str) {
+  return std::hash<std::string_view>{}(str);
+}
+
+std::optional<String_Table::Handle> String_Table::find(std::string_view str,
+                                                       uint64_t hash) const {
+  if (slots.empty()) {
+    return std::nullopt;
+  }
+  const auto mask = slots.size() - 1;
+  for (auto i = hash & mask;; i = (i + 1) & mask) {
+    const auto& slot = slots[i];
+    if (!slot.entry) {
+      return std::nullopt;
+    }
+    if (slot.hash == hash && strings[slot.entry - 1]->value == str) {
+      return slot.entry - 1;
+    }
+  }
+}
+
+String_Table::Handle String_Table::add(TPV_ObjString* str) {
+  const auto handle = static_cast<Handle>(strings.size());
+  strings.push_back(str);
+  // find only ever returns the first of equal strings, the others are only
+  // reached by handle. Keeping them out of the index keeps them from piling
+  // up in one run of slots
+  if (find(str->value, str->hash)) {
+    return handle;
+  }
+  if ((indexed + 1) * 2 > slots.size()) {
+    grow();
+  }
+  insert(str->hash, handle);
+  ++indexed;
+  return handle;
+}
+
+void String_Table::clear() {
+  strings.clear();
+  indexed = 0;
+  std::fill(slots.begin(), slots.end(), Slot{});
+}
+
+void String_Table::grow() {
+  auto old = std::move(slots);
+  slots.assign(std::max(MIN_SLOTS, old.size() * 2), Slot{});
+  for (const auto& slot : old) {
+    if (slot.entry) {
+      insert(slot.hash, slot.entry - 1);
+    }
+  }
+}
+
+void String_Table::insert(uint64_t hash, Handle handle) {
+  const auto mask = slots.size() - 1;
+  auto i = hash & mask;
+  while (slots[i].entry) {
+    i = (i + 1) & mask;
+  }
+  slots[i] = {.hash = hash, .entry = handle + 1};
+}
+
+}  // namespace TPV
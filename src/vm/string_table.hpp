@@ -0,0 +1,64 @@
+#ifndef STRING_TABLE_HPP
+#define STRING_TABLE_HPP
+
+#include <cstddef>
+#include <cstdint>
+#include <optional>
+#include <string_view>
+#include <vector>
+
+#include "../value.hpp"
+
+namespace TPV {
+
+// the VM's strings. Each one gets a handle, the number of strings added
+// before it, which stays valid until clear(). Lookups hash the string once to
+// 64 bits and probe an open addressing index of hashes and handles, so a
+// probe touches one flat slot and only strings with the same hash are
+// compared
+class String_Table {
+ public:
+  using Handle = uint32_t;
+
+  static uint64_t hash(std::string_view str);
+
+  // handle of the first string added that equals str, hash is hash(str)
+  std::optional<Handle> find(std::string_view str, uint64_t hash) const;
+  // add str under str->hash even if an equal string is there already
+  Handle add(TPV_ObjString* str);
+  // std::out_of_range for a handle add never returned
+  TPV_ObjString* at(Handle handle) const { return strings.at(handle); }
+  // unchecked, for handles add returned
+  TPV_ObjString* operator[](Handle handle) const { return strings[handle]; }
+  size_t size() const { return strings.size(); }
+  // drop every string, keeping the memory
+  void clear();
+
+  // by reference, a minor collection updates the strings it moves
+  auto begin() { return strings.begin(); }
+  auto end() { return strings.end(); }
+  auto begin() const { return strings.begin(); }
+  auto end() const { return strings.end(); }
+
+ private:
+  struct Slot {
+    uint64_t hash = 0;
+    // handle + 1, 0 for an empty slot
+    uint32_t entry = 0;
+  };
+
+  // twice as many slots, every indexed string is added again
+  void grow();
+  void insert(uint64_t hash, Handle handle);
+
+  // indexed by handle
+  std::vector<TPV_ObjString*> strings;
+  // a power of two, at most half full
+  std::vector<Slot> slots;
+  // strings with a slot
+  size_t indexed = 0;
+};
+
+}  // namespace TPV
+
+#endif  // !STRING_TABLE_HPP
@@ -0,0 +1,378 @@
+#include "type_inference.hpp"
+
+#include <array>
+#include <cstddef>
+#include <format>
+#include <string>
+
+#include "../instructions.hpp"
+#include "../utils.hpp"
+#include "cfg.hpp"
+#include "handlers.hpp"
+#include "vm.hpp"
+
+namespace TPV {
+
+namespace {
+
+// ValueTypes a register may hold, one bit each
+using Type_Set = uint8_t;
+
+constexpr Type_Set type_bit(ValueType type) {
+  return static_cast<Type_Set>(1 << to_integral(type));
+}
+
+constexpr Type_Set INT_SET = type_bit(ValueType::TPV_INT);
+constexpr Type_Set FLOAT_SET = type_bit(ValueType::TPV_FLOAT);
+constexpr Type_Set OBJ_SET = type_bit(ValueType::TPV_OBJ);
+constexpr Type_Set UNIT_SET = type_bit(ValueType::TPV_UNIT);
+constexpr Type_Set NUMBER_SET = INT_SET | FLOAT_SET;
+constexpr Type_Set ANY_SET = NUMBER_SET | OBJ_SET | UNIT_SET;
+
+using Types = std::array<Type_Set, MAX_REGISTERS>;
+
+// what one instruction does to the register it writes, mirrors handlers.hpp
+struct Effect {
+  bool writes = false;
+  uint8_t reg = 0;
+  // types reg holds if the instruction succeeds
+  Type_Set result = 0;
+  // it may fail and leave reg as it was
+  bool may_fail = false;
+  // fails with a type error for every type its operands may have
+  bool type_error = false;
+};
+
+Effect effect_of(const Instr& ins, const Types& types) {
+  const auto op = base_op(ins.op);
+  const auto t1 = types[ins.r1];
+  const auto t2 = types[ins.r2];
+  const bool same_number = t1 == t2 && (t1 == INT_SET || t1 == FLOAT_SET);
+
+  auto write = [&](uint8_t reg, Type_Set result, bool may_fail) {
+    return Effect{.writes = true,
+                  .reg = reg,
+                  .result = result,
+                  .may_fail = may_fail,
+                  .type_error = false};
+  };
+  auto checked = [&](Type_Set ok, Type_Set result, bool may_fail) {
+    auto effect = write(ins.rd, ok ? result : 0, may_fail);
+    effect.type_error = ok == 0;
+    return effect;
+  };
+
+  switch (op) {
+    case Opcode::SETI:
+      return write(ins.rd, INT_SET, false);
+    case Opcode::SETF:
+      return write(ins.rd, FLOAT_SET, false);
+    case Opcode::SETS:
+    case Opcode::NEW_ARRAY:
+      return write(ins.rd, OBJ_SET, false);
+    case Opcode::SETNIL:
+      return write(ins.rd, UNIT_SET, false);
+    case Opcode::STORE: {
+      // the index the value went to. An OBJ item may be an array, which the
+      // string table does not take
+      const Type_Set item = ins.imm == INT_TABLE     ? INT_SET
+                            : ins.imm == FLOAT_TABLE ? FLOAT_SET
+                                                     : OBJ_SET;
+      return checked(t1 & item, INT_SET, true);
+    }
+    case Opcode::LOAD:
+      // the table's type, a table that does not exist fails
+      return checked(t1 & INT_SET,
+                     ins.imm == INT_TABLE     ? INT_SET
+                     : ins.imm == FLOAT_TABLE ? FLOAT_SET
+                                              : OBJ_SET,
+                     true);
+    case Opcode::ADD:
+    case Opcode::SUB:
+    case Opcode::MUL: {
+      const auto ok = t1 & t2 & NUMBER_SET;
+      return checked(ok, ok, !same_number);
+    }
+    case Opcode::DIV: {
+      // a zero divisor fails too
+      const auto ok = t1 & t2 & NUMBER_SET;
+      return checked(ok, ok, true);
+    }
+    case Opcode::EQ:
+    case Opcode::NEQ:
+    case Opcode::GT:
+    case Opcode::GTE:
+    case Opcode::LT:
+    case Opcode::LTE:
+      return checked(t1 & t2 & NUMBER_SET, INT_SET, !same_number);
+    case Opcode::BITAND:
+    case Opcode::BITOR:
+    case Opcode::BITXOR:
+      return checked(t1 & t2 & INT_SET, INT_SET,
+                     t1 != INT_SET || t2 != INT_SET);
+    case Opcode::BITNOT:
+    case Opcode::BITSHL:
+    case Opcode::BITSHRL:
+    case Opcode::BITSHRA:
+      return checked(t1 & INT_SET, INT_SET, t1 != INT_SET);
+    case Opcode::CVT_I_D:
+    case Opcode::NEGATE:
+      return checked(t1 & NUMBER_SET, FLOAT_SET, (t1 & ~NUMBER_SET) != 0);
+    case Opcode::CVT_D_I:
+      return checked(t1 & NUMBER_SET, INT_SET, (t1 & ~NUMBER_SET) != 0);
+    case Opcode::JMP_IF: {
+      Effect effect;
+      effect.type_error = (t1 & NUMBER_SET) == 0;
+      return effect;
+    }
+    case Opcode::GET_ARRAY:
+      return write(ins.rd, ANY_SET, true);
+    case Opcode::GET_ARRAY_LEN:
+      // OBJ_SET does not tell an array from a string
+      return write(ins.rd, INT_SET, true);
+    case Opcode::VADD:
+    case Opcode::VSUB:
+    case Opcode::VMUL:
+    case Opcode::VDIV:
+    case Opcode::VEQ:
+    case Opcode::VNEQ:
+    case Opcode::VGT:
+    case Opcode::VGTE:
+    case Opcode::VLT:
+    case Opcode::VLTE:
+      // the elements are only known at run time
+      return checked(t1 & t2 & OBJ_SET, OBJ_SET, true);
+    case Opcode::VDOT:
+      return checked(t1 & t2 & OBJ_SET, NUMBER_SET, true);
+    case Opcode::VSCALE:
+      return checked((t1 & OBJ_SET) && (t2 & NUMBER_SET) ? OBJ_SET : 0,
+                     OBJ_SET, true);
+    case Opcode::VSUM:
+    case Opcode::VMIN:
+    case Opcode::VMAX:
+      return checked(t1 & OBJ_SET, NUMBER_SET, true);
+    case Opcode::POP:
+    case Opcode::GET_ARG:
+      return write(ins.rd, ANY_SET, false);
+    case Opcode::MOV:
+      return write(ins.rd, t1, false);
+    case Opcode::CALL:
+      // the callee's RETURN, unless the call fails
+      return write(ins.rd, ANY_SET, true);
+    case Opcode::VMCALL:
+      // input services write r1, unless reading fails
+      switch (ins.imm) {
+        case 1:
+          return write(ins.r1, INT_SET, true);
+        case 2:
+          return write(ins.r1, FLOAT_SET, true);
+        case 3:
+          return write(ins.r1, OBJ_SET, true);
+        default:
+          return {};
+      }
+    default:
+      // SET_ARRAY and RM_ARRAY change the array
+      return {};
+  }
+}
+
+void apply_effect(const Effect& effect, Types& types) {
+  if (effect.writes) {
+    auto& set = types[effect.reg];
+    set = effect.may_fail ? (set | effect.result) : effect.result;
+  }
+}
+
+const char* op_name(Opcode op) {
+  switch (op) {
+    case Opcode::STORE:
+      return "STORE";
+    case Opcode::LOAD:
+      return "LOAD";
+    case Opcode::ADD:
+      return "ADD";
+    case Opcode::SUB:
+      return "SUB";
+    case Opcode::MUL:
+      return "MUL";
+    case Opcode::DIV:
+      return "DIV";
+    case Opcode::EQ:
+      return "EQ";
+    case Opcode::NEQ:
+      return "NEQ";
+    case Opcode::GT:
+      return "GT";
+    case Opcode::GTE:
+      return "GTE";
+    case Opcode::LT:
+      return "LT";
+    case Opcode::LTE:
+      return "LTE";
+    case Opcode::BITAND:
+      return "BITAND";
+    case Opcode::BITOR:
+      return "BITOR";
+    case Opcode::BITXOR:
+      return "BITXOR";
+    case Opcode::BITNOT:
+      return "BITNOT";
+    case Opcode::BITSHL:
+      return "BITSHL";
+    case Opcode::BITSHRL:
+      return "BITSHRL";
+    case Opcode::BITSHRA:
+      return "BITSHRA";
+    case Opcode::CVT_I_D:
+      return "CVT_I_D";
+    case Opcode::CVT_D_I:
+      return "CVT_D_I";
+    case Opcode::NEGATE:
+      return "NEGATE";
+    case Opcode::JMP_IF:
+      return "JMP_IF";
+    case Opcode::VADD:
+      return "VADD";
+    case Opcode::VSUB:
+      return "VSUB";
+    case Opcode::VMUL:
+      return "VMUL";
+    case Opcode::VDIV:
+      return "VDIV";
+    case Opcode::VEQ:
+      return "VEQ";
+    case Opcode::VNEQ:
+      return "VNEQ";
+    case Opcode::VGT:
+      return "VGT";
+    case Opcode::VGTE:
+      return "VGTE";
+    case Opcode::VLT:
+      return "VLT";
+    case Opcode::VLTE:
+      return "VLTE";
+    case Opcode::VDOT:
+      return "VDOT";
+    case Opcode::VSCALE:
+      return "VSCALE";
+    case Opcode::VSUM:
+      return "VSUM";
+    case Opcode::VMIN:
+      return "VMIN";
+    case Opcode::VMAX:
+      return "VMAX";
+    default:
+      return "instruction";
+  }
+}
+
+std::string describe(Type_Set set) {
+  std::string names;
+  for (size_t type = 0; type < value_type_names.size(); type++) {
+    if (set & (1 << type)) {
+      names += names.empty() ? "" : " or ";
+      names += value_type_names[type];
+    }
+  }
+  return names;
+}
+
+}  // namespace
+
+bool infer_types(TPV_Function& func,
+                 uint32_t resume_pc,
+                 std::vector<Error>& errors) {
+  auto& code = func.code;
+
+  // main and bodies alike, so a RETURN is taken to go on like it does in main
+  const auto blocks = find_blocks(code, resume_pc, false);
+  const auto& starts = blocks.starts;
+  auto block_end = [&](size_t block) { return blocks.end(block, code.size()); };
+
+  // types at the start of each block, joined over its predecessors
+  std::vector<Types> in(starts.size());
+  std::vector<bool> reached(starts.size(), false);
+  std::vector<bool> queued(starts.size(), false);
+  std::vector<uint32_t> work;
+
+  auto flow = [&](uint32_t block, const Types& types) {
+    bool changed = !reached[block];
+    if (!reached[block]) {
+      in[block] = types;
+      reached[block] = true;
+    } else {
+      for (size_t r = 0; r < types.size(); r++) {
+        const Type_Set joined = in[block][r] | types[r];
+        changed = changed || joined != in[block][r];
+        in[block][r] = joined;
+      }
+    }
+    if (changed && !queued[block]) {
+      queued[block] = true;
+      work.push_back(block);
+    }
+  };
+
+  Types unknown;
+  unknown.fill(ANY_SET);
+  flow(0, unknown);
+  if (resume_pc < code.size()) {
+    flow(blocks.block_of[resume_pc], unknown);
+  }
+
+  while (!work.empty()) {
+    const auto block = work.back();
+    work.pop_back();
+    queued[block] = false;
+
+    auto types = in[block];
+    const auto end = block_end(block);
+    for (size_t idx = starts[block]; idx < end; idx++) {
+      apply_effect(effect_of(code[idx], types), types);
+    }
+
+    for (const auto succ : successors(code, blocks, block)) {
+      flow(succ, types);
+    }
+  }
+
+  // walk every reachable block once more with the final types
+  bool ok = true;
+  for (size_t block = 0; block < starts.size(); block++) {
+    if (!reached[block]) {
+      continue;
+    }
+
+    auto types = in[block];
+    for (size_t idx = starts[block]; idx < block_end(block); idx++) {
+      auto& ins = code[idx];
+      const auto op = base_op(ins.op);
+      const auto effect = effect_of(ins, types);
+
+      if (effect.type_error) {
+        const bool binary = operands_of(op) == Operands::RD_R1_R2;
+        errors.push_back(
+            {.msg = std::format(
+                 "Type Error: {} on {}{} at instruction {} in function '{}'",
+                 op_name(op), describe(types[ins.r1]),
+                 binary ? " and " + describe(types[ins.r2]) : "", idx,
+                 func.name)});
+        ok = false;
+      } else if (proven(op, ValueType::TPV_INT) != op &&
+                 types[ins.r1] == types[ins.r2]) {
+        if (types[ins.r1] == INT_SET) {
+          ins.op = proven(op, ValueType::TPV_INT);
+        } else if (types[ins.r1] == FLOAT_SET) {
+          ins.op = proven(op, ValueType::TPV_FLOAT);
+        }
+      }
+
+      apply_effect(effect, types);
+    }
+  }
+
+  return ok;
+}
+
+}  // namespace TPV
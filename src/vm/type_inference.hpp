@@ -0,0 +1,27 @@
+#ifndef TYPE_INFERENCE_HPP
+#define TYPE_INFERENCE_HPP
+
+#include <cstdint>
+#include <vector>
+
+#include "../error_code.hpp"
+#include "../value.hpp"
+
+namespace TPV {
+
+// forward dataflow over the basic blocks of a verified function: the set of
+// ValueTypes each register may hold before every instruction. Where both
+// operands of ADD/SUB/MUL/DIV or a compare can only be int, or only float,
+// the op becomes its proven form (handlers.hpp), which skips the tag checks.
+// Registers are unknown at instruction 0 and at resume_pc, where main carries
+// on after an earlier load. Runs before fusion, so only bytecode ops are seen.
+// Returns false and appends to errors if an instruction that can be reached
+// fails with a type error whatever values it gets, e.g. ADD on an int and a
+// string
+bool infer_types(TPV_Function& func,
+                 uint32_t resume_pc,
+                 std::vector<Error>& errors);
+
+}  // namespace TPV
+
+#endif  // !TYPE_INFERENCE_HPP
@@ -0,0 +1,155 @@
+#include "verifier.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <format>
+#include <string>
+
+#include "../instructions.hpp"
+
+namespace TPV {
+
+namespace {
+
+// tables of STORE and LOAD, see handlers.hpp
+constexpr int32_t TABLE_COUNT = 3;
+// VMCALL services: print, read int, read float, read string
+constexpr int32_t VMCALL_COUNT = 4;
+
+}  // namespace
+
+bool verify_function(TPV_Function& func,
+                     size_t function_count,
+                     size_t frame_registers,
+                     std::vector<Error>& errors) {
+  const auto& code = func.code;
+
+  auto reject = [&](size_t idx, std::string_view what) {
+    errors.push_back(
+        {.msg = std::format("Verify Error: {} at instruction {} in function "
+                            "'{}'",
+                            what, idx, func.name)});
+    return false;
+  };
+
+  if (code.empty() || code.back().op != Opcode::END) {
+    return reject(code.size(), "code does not end with END");
+  }
+
+  size_t num_registers = 0;
+  size_t arity = 0;
+  auto use = [&](uint8_t r) {
+    num_registers = std::max(num_registers, size_t(r) + 1);
+  };
+
+  for (size_t idx = 0; idx < code.size(); idx++) {
+    const auto& ins = code[idx];
+
+    if (ins.op == Opcode::END) {
+      if (idx != code.size() - 1) {
+        return reject(idx, "END before the end of the code");
+      }
+      continue;
+    }
+    if (static_cast<size_t>(ins.op) >= OPCODE_COUNT) {
+      return reject(idx, "internal opcode");
+    }
+
+    switch (operands_of(ins.op)) {
+      case Operands::NONE:
+      case Operands::IMM:
+        break;
+      case Operands::RD:
+      case Operands::RD_IMM:
+      case Operands::RD_STR:
+        use(ins.rd);
+        break;
+      case Operands::R1:
+      case Operands::R1_IMM:
+        use(ins.r1);
+        break;
+      case Operands::RD_R1:
+      case Operands::RD_R1_IMM:
+        use(ins.rd);
+        use(ins.r1);
+        break;
+      case Operands::RD_R1_R2:
+        use(ins.rd);
+        use(ins.r1);
+        use(ins.r2);
+        break;
+      case Operands::R1_R2_IMM:
+        use(ins.r1);
+        use(ins.r2);
+        break;
+    }
+    if (num_registers > frame_registers) {
+      return reject(idx, std::format("register r{} out of a frame of {}",
+                                     num_registers - 1, frame_registers));
+    }
+
+    switch (ins.op) {
+      case Opcode::FUNCDEF:
+      case Opcode::FUNCDEF_G:
+      case Opcode::FUNCEND:
+        return reject(idx, "function definition inside code");
+      case Opcode::JMP:
+      case Opcode::JMP_IF:
+        if (ins.imm < 0 || static_cast<size_t>(ins.imm) >= code.size()) {
+          return reject(idx, "jump out of the code");
+        }
+        break;
+      case Opcode::SETS:
+        if (ins.imm < 0 ||
+            static_cast<size_t>(ins.imm) >= func.str_literals.size()) {
+          return reject(idx, "missing string literal");
+        }
+        break;
+      case Opcode::CALL:
+      case Opcode::TAILCALL:
+        if (ins.imm < 0 || static_cast<size_t>(ins.imm) >= function_count) {
+          return reject(idx, std::format("{} to unknown function {}",
+                                         ins.op == Opcode::CALL ? "CALL"
+                                                                : "TAILCALL",
+                                         ins.imm));
+        }
+        break;
+      case Opcode::SET_ARG:
+      case Opcode::GET_ARG:
+        if (ins.imm < 0 || static_cast<size_t>(ins.imm) >= frame_registers) {
+          return reject(idx, std::format("argument {} out of {}", ins.imm,
+                                         frame_registers));
+        }
+        if (ins.op == Opcode::GET_ARG) {
+          arity = std::max(arity, static_cast<size_t>(ins.imm) + 1);
+        }
+        break;
+      case Opcode::STORE:
+      case Opcode::LOAD:
+        if (ins.imm < 0 || ins.imm >= TABLE_COUNT) {
+          return reject(idx, std::format("unknown table {}", ins.imm));
+        }
+        break;
+      case Opcode::VMCALL:
+        if (ins.imm < 0 || ins.imm >= VMCALL_COUNT) {
+          return reject(idx, std::format("unknown VMCALL {}", ins.imm));
+        }
+        break;
+      case Opcode::BITSHL:
+      case Opcode::BITSHRL:
+      case Opcode::BITSHRA:
+        if (ins.imm < 0 || ins.imm >= 32) {
+          return reject(idx, std::format("shift by {}", ins.imm));
+        }
+        break;
+      default:
+        break;
+    }
+  }
+
+  func.num_registers = num_registers;
+  func.arity = arity;
+  return true;
+}
+
+}  // namespace TPV
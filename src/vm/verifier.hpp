@@ -0,0 +1,27 @@
+#ifndef VERIFIER_HPP
+#define VERIFIER_HPP
+
+#include <cstddef>
+#include <vector>
+
+#include "../error_code.hpp"
+#include "../value.hpp"
+
+namespace TPV {
+
+// check a freshly decoded function once before it is allowed to run. The
+// handlers index registers and code without bounds checks, so this rejects
+// anything they would trip over: ops that are not bytecode ops, registers
+// past frame_registers, jumps that miss an instruction, CALLs and TAILCALLs to
+// functions that are not loaded, and immediates picking a table, a VMCALL, a shift
+// amount or an argument that does not exist. Sets func.num_registers, and
+// func.arity to one past the highest argument GET_ARG reads.
+// Returns false and appends to errors if the code is rejected.
+bool verify_function(TPV_Function& func,
+                     size_t function_count,
+                     size_t frame_registers,
+                     std::vector<Error>& errors);
+
+}  // namespace TPV
+
+#endif  // !VERIFIER_HPP
@@ -13,120 +13,289 @@
 #include <vector>
 #include "../error_code.hpp"
 #include "../instructions.hpp"
+#include "../jit/jit.hpp"
 #include "../parser/parser.hpp"
 #include "../scanner/scanner.hpp"
 #include "../utils.hpp"
+#include "decoder.hpp"
+#include "dispatch.hpp"
+#include "fusion.hpp"
+#include "escape.hpp"
+#include "inliner.hpp"
+#include "type_inference.hpp"
+#include "verifier.hpp"
 #include "common.hpp"
 #include "value.hpp"
 
 using std::vector;
 
-#define INT_TABLE 0
-#define FLOAT_TABLE 1
-#define STR_TABLE 2
-#define TABLE_TABLE 3
-
 namespace TPV {
 
-VM::VM()
-    : int32_table(),
-      float32_table(),
-      str_table(),
-      frames(MAX_FRAME),
+VM::VM(Dispatch dispatch)
+    : str_table(),
       flags(),
-      is_running(true) {
-  auto& current_frame = this->frames.back();
-  current_frame.function = new TPV_Function();
-  current_frame.function->bytes = std::vector<uint8_t>();
-  current_frame.function->arity = 0;
-  current_frame.function->name = "";
-  current_frame.pc = 0;
-  current_frame.registers = std::vector<Value>(MAX_REGISTERS);
-  current_frame.stack = std::vector<Value>(MAX_STACKS);
-  current_frame.stack.reserve(MAX_REGISTERS);
-  current_frame.registers.reserve(MAX_STACKS);
-  this->frames.push_back(current_frame);
-  this->frames.back().function = current_frame.function;
-  this->frames.back().pc = 0;
+      is_running(true),
+      dispatch(dispatch),
+      use_jit(TPV_HAS_JIT),
+      main_function(std::make_unique<TPV_Function>()) {
+  // main keeps a full window, code a later load_bytes appends may use any
+  // register
+  register_stack.resize(MAX_REGISTERS);
+
+  main_function->name = "main";
+  // empty main is just END, so eval_all before load_bytes halts right away
+  decode_function(*main_function, this->errors);
+  this->frames.push_back(Frame{.registers = register_stack.data(),
+                               .base = 0,
+                               .num_registers = MAX_REGISTERS,
+                               .stack = {},
+                               .pc = 0,
+                               .function = main_function.get()});
 }
 
-uint8_t VM::next_8_bit() {
-  auto& current_frame = this->frames.back();
-  if (current_frame.pc >= current_frame.function->bytes.size()) {
-    throw std::out_of_range("No more bytes available");
+void VM::reset() {
+  frames.resize(1);
+  auto& main_frame = frames.front();
+  main_frame.stack.clear();
+  main_frame.pc = 0;
+  // a SET_ARG of the last program must not count for the next one's CALL
+  main_frame.arg_count = 0;
+  std::fill(register_stack.begin(), register_stack.begin() + MAX_REGISTERS,
+            Value{});
+
+  auto& main_func = *main_function;
+  main_func.bytes.clear();
+  main_func.num_registers = 0;
+  main_func.str_constants.clear();
+  main_func.jit.reset();
+  decode_function(main_func, this->errors);
+  functions.clear();
+
+  int32_table.clear();
+  float32_table.clear();
+  str_table.clear();
+
+  // nothing refers to the objects anymore, the heap and nursery keep their
+  // memory
+  heap.clear();
+  nursery.reset();
+  remembered.clear();
+  // the frames that had them are gone without popping
+  for (auto& array : scratch) {
+    array->clear();
   }
-  auto byte = current_frame.function->bytes.at(current_frame.pc);
-  current_frame.pc += 1;
-
-  return byte;
-}
-
-std::vector<uint8_t> VM::next_16_bit() {
-  auto bytes = {this->next_8_bit(), this->next_8_bit()};
-
-  return bytes;
+  major_gc.phase = Gc_Phase::IDLE;
+  major_gc.gray.clear();
+  major_gc.partial = nullptr;
+  major_gc.partial_left = 0;
+  major_gc.debt = 0;
+  gc_stats = {};
+  inline_stats = {};
+
+  errors.clear();
+  flags = {};
+  is_running = true;
 }
 
-std::vector<uint8_t> VM::next_32_bit() {
-  auto bytes = {this->next_8_bit(), this->next_8_bit(), this->next_8_bit(),
-                this->next_8_bit()};
-
-  return bytes;
-}
-
-std::vector<uint8_t> VM::next_string() {
-  std::vector<uint8_t> result;
-  while (true) {
-    uint8_t byte = this->next_8_bit();
-    if (byte == 0) {
-      break;
-    }
-    result.push_back(byte);
+void VM::grow_register_stack(size_t size) {
+  // at least double so deep recursion moves the windows a few times only
+  register_stack.resize(std::max(size, register_stack.size() * 2));
+  for (auto& frame : frames) {
+    frame.registers = register_stack.data() + frame.base;
   }
-  return result;
 }
 
 bool VM::load_bytes(const vector<uint8_t> instructions) {
-  auto& current_frame = this->frames.back();
-  auto it = instructions.cbegin();
-  auto end = instructions.cend();
-  const auto END_FUNC = static_cast<uint8_t>(Opcode::FUNCEND);
+  auto& main_func = *main_function;
+  // only committed once everything decoded
+  auto main_bytes = main_func.bytes;
+  std::vector<std::unique_ptr<TPV_Function>> new_functions;
+
+  size_t offset = 0;
+  while (offset < instructions.size()) {
+    auto size = instruction_size(instructions, offset);
+    if (!size) {
+      this->errors.push_back(
+          {.msg = std::format("Load Error: malformed instruction at byte {}",
+                              offset)});
+      return false;
+    }
 
-  while (it != end) {
-    auto opcode = static_cast<Opcode>(*it);
+    auto opcode = static_cast<Opcode>(instructions[offset]);
     switch (opcode) {
       case Opcode::FUNCDEF:
       case Opcode::FUNCDEF_G: {
-        auto func = new TPV_Function();
+        auto owned = std::make_unique<TPV_Function>();
+        auto& func = *owned;
+        func.name =
+            std::format("fn{}", functions.size() + new_functions.size());
+        func.arity = 0;
+
+        // skip FUNCDEF r1, imm1
+        offset += *size;
+
+        // body runs up to the FUNCEND on an instruction boundary
+        while (true) {
+          auto body_size = instruction_size(instructions, offset);
+          if (!body_size) {
+            this->errors.push_back(
+                {.msg = std::format("Load Error: FUNCDEF without FUNCEND in {}",
+                                    func.name)});
+            return false;
+          }
 
-        it += 1;  // skip FUNCDEF
-        it += 1;  // skip r1
-        it += 4;  // skip imm1
+          auto body_op = static_cast<Opcode>(instructions[offset]);
+          if (body_op == Opcode::FUNCEND) {
+            offset += *body_size;
+            break;
+          }
+          if (body_op == Opcode::FUNCDEF || body_op == Opcode::FUNCDEF_G) {
+            this->errors.push_back(
+                {.msg = std::format("Load Error: nested FUNCDEF in {}",
+                                    func.name)});
+            return false;
+          }
 
-        while (it != end && *it != END_FUNC) {
-          func->bytes.push_back(*it);
-          it += 1;
+          func.bytes.insert(func.bytes.end(), instructions.begin() + offset,
+                            instructions.begin() + offset + *body_size);
+          offset += *body_size;
         }
 
-        // if not end, then error
-        if (it == end && *it != END_FUNC) {
-          throw std::runtime_error("FUNCDEF without FUNCEND");
+        if (!decode_function(func, this->errors)) {
+          return false;
         }
-
-        this->functions.push_back(*func);
+        new_functions.push_back(std::move(owned));
         break;
       }
       default:
-        current_frame.function->bytes.push_back(*it);
-        // next byte
-        it += 1;
+        main_bytes.insert(main_bytes.end(), instructions.begin() + offset,
+                          instructions.begin() + offset + *size);
+        offset += *size;
         break;
     }
   }
 
+  // CALL may name any function of this load, so verify once all are decoded
+  const auto function_count = functions.size() + new_functions.size();
+  for (auto& func : new_functions) {
+    if (!verify_function(*func, function_count, MAX_REGISTERS,
+                         this->errors) ||
+        !infer_types(*func, 0, this->errors)) {
+      return false;
+    }
+  }
+
+  // main keeps its old code unless the new one decodes, verifies and type
+  // checks. It carries on from the pc where the last load stopped
+  auto main_code = main_func.code;
+  auto main_literals = main_func.str_literals;
+  // nothing calls main, so it has no arguments to read
+  auto no_arguments = [&] {
+    if (main_func.arity == 0) {
+      return true;
+    }
+    this->errors.push_back(
+        {.msg = std::format("Load Error: GET_ARG {} in main",
+                            main_func.arity - 1)});
+    return false;
+  };
+  std::swap(main_func.bytes, main_bytes);
+  if (!decode_function(main_func, this->errors) ||
+      !verify_function(main_func, function_count, MAX_REGISTERS,
+                       this->errors) ||
+      !infer_types(main_func, this->frames.front().pc, this->errors) ||
+      !no_arguments()) {
+    std::swap(main_func.bytes, main_bytes);
+    main_func.code = std::move(main_code);
+    main_func.str_literals = std::move(main_literals);
+    main_func.arity = 0;
+    return false;
+  }
+
+  // a callee is spliced in as verified bytecode ops, so before fusion. main
+  // is left alone, a later load carries on from its pc
+  if (inline_config.enabled) {
+    std::vector<TPV_Function*> all;
+    for (auto& func : functions) {
+      all.push_back(func.get());
+    }
+    for (auto& func : new_functions) {
+      all.push_back(func.get());
+    }
+    for (auto& func : new_functions) {
+      inline_calls(*func, all, inline_config, inline_stats);
+    }
+  }
+
+  // after inlining, an array of a callee may not escape the caller either
+  for (auto& func : new_functions) {
+    allocate_scratch_arrays(*func);
+  }
+
+  // fusion and quickening bring in internal ops, so only after verifying and
+  // type inference
+  fuse_superinstructions(main_func);
+  main_func.jit.reset();
+  for (auto& func : new_functions) {
+    fuse_superinstructions(*func);
+  }
+
+  // every literal is interned once here instead of each time its SETS runs
+  intern_literals(main_func);
+  const auto first_new = functions.size();
+  for (auto& func : new_functions) {
+    intern_literals(*func);
+    this->functions.push_back(std::move(func));
+  }
+
+  // CALLs go straight to their callee from now on, main is decoded again
+  // each load so its old CALLs are linked again too
+  for (auto i = first_new; i < functions.size(); i++) {
+    link_calls(*functions[i]);
+  }
+  link_calls(main_func);
+
   return true;
 }
 
+String_Table::Handle VM::intern(std::string_view str) {
+  const auto hash = String_Table::hash(str);
+  if (auto handle = str_table.find(str, hash)) {
+    return *handle;
+  }
+  return str_table.add(new_object<TPV_ObjString>(hash, std::string(str)));
+}
+
+void VM::intern_literals(TPV_Function& func) {
+  func.str_constants.clear();
+  for (const auto& literal : func.str_literals) {
+    func.str_constants.push_back(intern(literal));
+  }
+}
+
+void VM::link_calls(TPV_Function& func) {
+  func.call_targets.clear();
+  // function index -> its call_targets entry, a callee called from many
+  // places gets one
+  std::vector<int32_t> target_of(functions.size(), -1);
+  for (auto& ins : func.code) {
+    if (ins.op != Opcode::CALL && ins.op != Opcode::TAILCALL) {
+      continue;
+    }
+
+    auto& target = target_of[ins.imm];
+    if (target < 0) {
+      auto& callee = *functions[ins.imm];
+      target = static_cast<int32_t>(func.call_targets.size());
+      func.call_targets.push_back(
+          {.function = &callee,
+           .arity = static_cast<uint32_t>(callee.arity),
+           .num_registers = static_cast<uint32_t>(callee.num_registers)});
+    }
+    ins.imm = target;
+  }
+}
+
 bool VM::run_bytecode_file(std::string_view path) {
   constexpr auto read_size = std::size_t(4096);
   auto stream = std::ifstream(path.data(), std::ios::binary);
@@ -194,844 +363,17 @@ bool VM::run_src_file(std::string_view path) {
 }
 
 VM_Result VM::eval_all() {
-  while (is_running &&
-         this->frames.back().function->bytes.size() > this->frames.back().pc) {
-    auto byte = this->next_8_bit();
-
-    // decoding
-    auto opcode = static_cast<Opcode>(byte);
-
-    switch (opcode) {
-      case Opcode::SETI: {
-        auto rd = this->next_8_bit();
-        const auto val = this->next_32_bit();
-
-        this->frames.back().registers.at(rd) = {.type = ValueType::TPV_INT,
-                                                .is_const = false,
-                                                .value = bytes_to_int32(val)};
-
-        break;
-      }
-      case Opcode::SETF: {
-        auto rd = this->next_8_bit();
-        const auto val = this->next_32_bit();
-
-        this->frames.back().registers.at(rd) = {.type = ValueType::TPV_FLOAT,
-                                                .is_const = false,
-                                                .value = bytes_to_float32(val)};
-
-        break;
-      }
-      case Opcode::SETS: {
-        auto rd = this->next_8_bit();
-        const auto str = bytes_to_string(this->next_string());
-
-        // check if str exist in the table, and find the idx
-        auto idx = hash_string(str);
-        auto it = this->str_table.find(idx);
-        while (it != this->str_table.cend() && it->second->value != str) {
-          idx += 1;
-          it = this->str_table.find(idx);
-        }
-
-        // add to str_table if not exist
-        if (it == this->str_table.cend()) {
-          auto ptr = std::make_shared<TPV_ObjString>(
-              (TPV_ObjString){.hash = (size_t)idx, .value = str});
-          this->str_table[idx] = ptr;
-        }
-
-        this->frames.back().registers.at(rd) =
-            from_obj_value(this->str_table.at(idx));
-
-        break;
-      }
-      case Opcode::SETNIL: {
-        auto rd = this->next_8_bit();
-
-        this->frames.back().registers.at(rd) = {.type = ValueType::TPV_UNIT,
-                                                .is_const = false,
-                                                .value = (TPV_Unit){}};
-
-        break;
-      }
-      case Opcode::STORE: {
-        // return ref idx
-        auto& rd = this->frames.back().registers.at(this->next_8_bit());
-        // store item
-        auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        // type of table
-        auto imm = bytes_to_int32(this->next_32_bit());
-
-        switch (imm) {
-          case INT_TABLE: {
-            rd = from_raw_value((int32_t)int32_table.size());
-            this->int32_table[int32_table.size()] = get_int32(r1);
-            break;
-          }
-          case FLOAT_TABLE: {
-            rd = from_raw_value((int32_t)float32_table.size());
-            this->float32_table[float32_table.size()] = get_float32(r1);
-            break;
-          }
-          case STR_TABLE: {
-            auto str = get_str(r1);
-            auto idx = hash_string(str.value);
-            auto it = this->str_table.find(idx);
-            while (it != this->str_table.cend()) {
-              idx += 1;
-              it = this->str_table.find(idx);
-            }
-
-            str.hash = idx;
-            auto ptr = std::make_shared<TPV_ObjString>(str);
-            this->str_table[idx] = ptr;
-            rd = from_raw_value(idx);
-
-            break;
-          }
-          default: {
-            this->errors.push_back(
-                {.msg = std::format(
-                     "Type Error: STORE operation on non-exist table type {}",
-                     imm)});
-            break;
-          }
-        }
-
-        break;
-      }
-      case Opcode::LOAD: {
-        // return ref
-        auto& rd = this->frames.back().registers.at(this->next_8_bit());
-        // access idx
-        auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        // type of table
-        auto imm = bytes_to_int32(this->next_32_bit());
-        auto idx = get_int32(r1);
-
-        switch (imm) {
-          case INT_TABLE: {
-            rd = from_raw_value(this->int32_table.at(idx));
-            break;
-          }
-          case FLOAT_TABLE: {
-            rd = from_raw_value(this->float32_table.at(idx));
-            break;
-          }
-          case STR_TABLE: {
-            rd = from_obj_value(this->str_table.at(idx));
-            break;
-          }
-          default: {
-            this->errors.push_back(
-                {.msg = std::format(
-                     "Type Error: LOAD operation on non-exist table type {}",
-                     imm)});
-            break;
-          }
-        }
-
-        break;
-      }
-      case Opcode::ADD: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) + get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) + get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: ADD operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::SUB: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) - get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) - get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: SUB operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::MUL: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) * get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) * get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: MUL operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::DIV: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            if (std::get<TPV_INT>(r2.value) == 0) {
-              this->errors.push_back({});
-            } else {
-              ref = from_raw_value(get_int32(r1) / get_int32(r2));
-            }
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            if (std::get<TPV_FLOAT>(r2.value) == 0.0) {
-              this->errors.push_back({});
-            } else {
-              ref = from_raw_value(get_float32(r1) / get_float32(r2));
-            }
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: DIV operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::CVT_I_D: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == ValueType::TPV_INT) {
-          ref = from_raw_value(static_cast<TPV_FLOAT>(get_int32(r1)));
-        } else if (r1.type == ValueType::TPV_FLOAT) {
-          ref = r1;
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: CVT_I_D operation on {}",
-                                  get_value_type_name(r1.type))});
-        }
-
-        break;
-      }
-      case Opcode::CVT_D_I: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == ValueType::TPV_INT) {
-          ref = r1;
-        } else if (r1.type == ValueType::TPV_FLOAT) {
-          this->frames.back().registers.at(rd) =
-              from_raw_value(static_cast<TPV_INT>(get_float32(r1)));
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: CVT_D_I operation on {}",
-                                  get_value_type_name(r1.type))});
-        }
-
-        break;
-      }
-      case Opcode::NEGATE: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == ValueType::TPV_INT) {
-          this->frames.back().registers.at(rd) =
-              from_raw_value(static_cast<TPV_FLOAT>(-get_int32(r1)));
-        } else if (r1.type == ValueType::TPV_FLOAT) {
-          this->frames.back().registers.at(rd) =
-              from_raw_value(static_cast<TPV_FLOAT>(-get_float32(r1)));
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: NEGATE operation on {}",
-                                  get_value_type_name(r1.type))});
-        }
-
-        break;
-      }
-      case Opcode::HLT: {
-        this->is_running = false;
-        break;
-      }
-      case Opcode::JMP: {
-        const auto new_pc = bytes_to_int32(this->next_32_bit());
-        this->frames.back().pc = new_pc;
-        break;
-      }
-      case Opcode::JMP_IF: {
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto new_pc = bytes_to_int32(this->next_32_bit());
-
-        if (r1.type == ValueType::TPV_INT) {
-          auto val = get_int32(r1);
-          if (val)
-            this->frames.back().pc = new_pc;
-        } else if (r1.type == ValueType::TPV_FLOAT) {
-          auto val = get_float32(r1);
-          if (val)
-            this->frames.back().pc = new_pc;
-        } else {
-          this->errors.push_back({});
-        }
-        break;
-      }
-      case Opcode::EQ: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) == get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) == get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: EQ operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::NEQ: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) != get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) != get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: NEQ operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::GT: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) > get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) > get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: GT operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::GTE: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) >= get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) >= get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: GTE operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::LT: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) < get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) < get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: LT operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::LTE: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) <= get_int32(r2));
-          } else if (r1.type == ValueType::TPV_FLOAT) {
-            ref = from_raw_value(get_float32(r1) <= get_float32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: LTE operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::BITAND: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) & get_int32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: BITAND operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: BITAND operation on {} and {}",
-                                  get_value_type_name(r1.type),
-                                  get_value_type_name(r2.type))});
-        }
-
-        break;
-      }
-      case Opcode::BITOR: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) | get_int32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: BITOR operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: BITOR operation on {} and {}",
-                                  get_value_type_name(r1.type),
-                                  get_value_type_name(r2.type))});
-        }
-
-        break;
-      }
-      case Opcode::BITXOR: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == r2.type) {
-          if (r1.type == ValueType::TPV_INT) {
-            ref = from_raw_value(get_int32(r1) ^ get_int32(r2));
-          } else {
-            this->errors.push_back(
-                {.msg = std::format("Type Error: BITXOR operation on {} and {}",
-                                    get_value_type_name(r1.type),
-                                    get_value_type_name(r2.type))});
-          }
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: BITXOR operation on {} and {}",
-                                  get_value_type_name(r1.type),
-                                  get_value_type_name(r2.type))});
-        }
-
-        break;
-      }
-      case Opcode::BITNOT: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == ValueType::TPV_INT) {
-          ref = from_raw_value(~get_int32(r1));
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: BITNOT operation on {}",
-                                  get_value_type_name(r1.type))});
-        }
-
-        break;
-      }
-      case Opcode::BITSHL: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto imm = bytes_to_int32(this->next_32_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == ValueType::TPV_INT) {
-          ref = from_raw_value(get_int32(r1) << imm);
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: BITSHL operation on {}",
-                                  get_value_type_name(r1.type))});
-        }
-
-        break;
-      }
-      case Opcode::BITSHRL: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto imm = bytes_to_int32(this->next_32_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == ValueType::TPV_INT) {
-          auto val = std::get<TPV_INT>(r1.value);
-
-          if (val < 0) {
-            auto result =
-                static_cast<std::make_unsigned_t<TPV_INT>>(val) >> imm;
-            ref = from_raw_value(static_cast<TPV_INT>(result));
-          } else {
-            ref = from_raw_value(val >> imm);
-          }
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: BITSHRL operation on {}",
-                                  get_value_type_name(r1.type))});
-        }
-
-        break;
-      }
-      case Opcode::BITSHRA: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto imm = bytes_to_int32(this->next_32_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-
-        if (r1.type == ValueType::TPV_INT) {
-          ref = from_raw_value(get_int32(r1) >> imm);
-        } else {
-          this->errors.push_back(
-              {.msg = std::format("Type Error: BITSHRA operation on {}",
-                                  get_value_type_name(r1.type))});
-        }
-
-        break;
-      }
-      case Opcode::PUSH: {
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        this->frames.back().stack.push_back(r1);
-        break;
-      }
-      case Opcode::POP: {
-        this->frames.back().registers.at(this->next_8_bit()) =
-            this->frames.back().stack.back();
-        this->frames.back().stack.pop_back();
-        break;
-      }
-      case Opcode::VMCALL: {
-        const auto r1_idx = this->next_8_bit();
-        const auto r2_idx = this->next_8_bit();
-        const auto imm = bytes_to_int32(this->next_32_bit());
-
-        switch (imm) {
-          case 0: {
-            const auto& r1 = this->frames.back().registers.at(r1_idx);
-            if (r1.type == ValueType::TPV_INT) {
-              const auto num = get_int32(r1);
-              std::printf("%d", num);
-            } else if (r1.type == ValueType::TPV_FLOAT) {
-              const auto num = get_float32(r1);
-              std::printf("%f", num);
-            } else if (r1.type == ValueType::TPV_OBJ) {
-              const auto obj = get_str_ptr(r1);
-              std::printf("%s", obj->value.c_str());
-            } else {
-              this->errors.push_back({"Nothing in the register"});
-            }
-
-            const auto& r2 = this->frames.back().registers.at(r2_idx);
-            if (r2.type == ValueType::TPV_INT) {
-              const auto flag = get_int32(r2);
-              if (flag == 1) {
-                std::printf("\n");
-              }
-            } else {
-              this->errors.push_back({});
-            }
-            break;
-          }
-          case 1: {
-            char buffer[256];
-            if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
-              char* endptr;
-              long int input = strtol(buffer, &endptr, 10);
-              if (*endptr == '\n' || *endptr == '\0') {
-                this->frames.back().registers.at(r1_idx) =
-                    from_raw_value(static_cast<TPV_INT>(input));
-              } else {
-                this->errors.push_back({"Invalid integer input"});
-              }
-            } else {
-              this->errors.push_back({"Failed to read input"});
-            }
-            break;
-          }
-          case 2: {
-            char buffer[256];
-            if (fgets(buffer, sizeof(buffer), stdin) != NULL) {
-              char* endptr;
-              float input = strtof(buffer, &endptr);
-              if (*endptr == '\n' || *endptr == '\0') {
-                this->frames.back().registers.at(r1_idx) =
-                    from_raw_value(static_cast<TPV_FLOAT>(input));
-              } else {
-                this->errors.push_back({"Invalid integer input"});
-              }
-            } else {
-              this->errors.push_back({"Failed to read input"});
-            }
-            break;
-          }
-          case 3: {
-            std::string input;
-            std::getline(std::cin, input);
-            size_t input_size = input.size();
-
-            if (input_size != -1) {
-              if (input[input_size - 1] == '\n') {
-                input[input_size - 1] = '\0';
-              }
-
-              auto str = input;
-              auto idx = hash_string(str);
-              auto it = this->str_table.find(idx);
-              while (it != this->str_table.cend() && it->second->value != str) {
-                idx += 1;
-                it = this->str_table.find(idx);
-              }
-
-              this->str_table[idx] = std::make_shared<TPV_ObjString>(
-                  TPV_ObjString{.hash = (size_t)idx, .value = str});
-
-              this->frames.back().registers.at(r1_idx) = {
-                  .type = ValueType::TPV_OBJ,
-                  .is_const = false,
-                  .value = (TPV_Obj){.type = ObjType::STRING,
-                                     .obj = this->str_table.at(idx)}};
-            } else {
-              this->errors.push_back({"Failed to read input"});
-            }
-
-            break;
-          }
-          default:
-            this->errors.push_back({"Invalid flag"});
-            break;
-        }
-
-        break;
-      }
-      case Opcode::CALL: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r1_value = get_int32(r1);
-        const auto imm1 = bytes_to_int32(this->next_32_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-        if (r1_value == 0) {
-          auto& func = this->functions.at(imm1);
-          auto new_frame = Frame{.registers = this->frames.back().registers,
-                                 .stack = {},
-                                 .pc = 0,
-                                 .function = &func};
-          this->frames.push_back(new_frame);
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::RETURN: {
-        break;
-      }
-      case Opcode::NEW_ARRAY: {
-        auto rd = this->next_8_bit();
-
-        this->frames.back().registers.at(rd) = {
-            .type = ValueType::TPV_OBJ,
-            .is_const = false,
-            .value = (TPV_Obj){.type = ObjType::ARRAY,
-                               .obj = std::make_shared<TPV_ObjArray>(
-                                   TPV_ObjArray{.values = {}})}};
-        break;
-      }
-      case Opcode::SET_ARRAY: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-        if (r1.type == ValueType::TPV_OBJ && r2.type == ValueType::TPV_INT) {
-          auto list_ref = std::get<TPV_Obj>(r1.value);
-          auto list_ptr = std::get<std::shared_ptr<TPV_ObjArray>>(list_ref.obj);
-          list_ptr->values.at(std::get<TPV_INT>(r2.value)) =
-              this->frames.back().registers.at(rd);
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::GET_ARRAY: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-        if (r1.type == ValueType::TPV_OBJ && r2.type == ValueType::TPV_INT) {
-          auto list_ref = std::get<TPV_Obj>(r1.value);
-          auto list_ptr = std::get<std::shared_ptr<TPV_ObjArray>>(list_ref.obj);
-          ref = list_ptr->values.at(std::get<TPV_INT>(r2.value));
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::RM_ARRAY: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-        const auto r2 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-        if (r1.type == ValueType::TPV_OBJ && r2.type == ValueType::TPV_INT) {
-          auto list_ref = std::get<TPV_Obj>(r1.value);
-          auto list_ptr = std::get<std::shared_ptr<TPV_ObjArray>>(list_ref.obj);
-          list_ptr->values.erase(list_ptr->values.begin() +
-                                 std::get<TPV_INT>(r2.value));
-        } else {
-          this->errors.push_back({});
-        }
-
-        break;
-      }
-      case Opcode::GET_ARRAY_LEN: {
-        auto rd = this->next_8_bit();
-        const auto r1 = this->frames.back().registers.at(this->next_8_bit());
-
-        auto& ref = this->frames.back().registers.at(rd);
-        if (r1.type == ValueType::TPV_OBJ) {
-          auto list_ref = std::get<TPV_Obj>(r1.value);
-          auto list_ptr = std::get<std::shared_ptr<TPV_ObjArray>>(list_ref.obj);
-          ref = from_raw_value((TPV_INT)list_ptr->values.size());
-        } else {
-          this->errors.push_back({});
-        }
+  if (!is_running) {
+    return VM_Result::OK;
+  }
 
-        break;
-      }
-      case Opcode::IGL:
-        break;
-      case Opcode::NOP:
-        break;
-    }
+  switch (this->dispatch) {
+    case Dispatch::SWITCH:
+      return dispatch_switch(*this);
+    case Dispatch::COMPUTED_GOTO:
+      return dispatch_computed_goto(*this);
+    case Dispatch::TAIL_CALL:
+      return dispatch_tail_call(*this);
   }
 
   return VM_Result::OK;
@@ -1041,40 +383,104 @@ VM_Result VM::eval_one() {
   return VM_Result::OK;
 }
 
-void VM::print_regs() {
-  for (int i = 0; i < this->frames.back().registers.size(); i++) {
-    auto&& ref = this->frames.back().registers.at(i);
+void VM::track_growth(const TPV_Object* obj, size_t bytes) {
+  if (nursery.contains(obj)) {
+    nursery.young_bytes += bytes;
+    if (nursery.young_bytes >= GC_NURSERY_LIMIT) {
+      collect(*this);
+    }
+  } else {
+    gc_stats.allocated += bytes;
+  }
+  advance_major(*this, bytes);
+}
+
+void* VM::young_slot(size_t size, size_t bytes) {
+  // a slice can run a minor collection, so before the slot is taken
+  advance_major(*this, bytes);
+  if (nursery.young_bytes + bytes > GC_NURSERY_LIMIT) {
+    collect(*this);
+  }
+  auto* slot = nursery.allocate(size);
+  if (!slot) {
+    collect(*this);
+    slot = nursery.allocate(size);
+  }
+  nursery.young_bytes += bytes;
+  return slot;
+}
 
-    if (ref.type == ValueType::TPV_INT) {
-      std::cout << "[int] reg " << i << " : " << std::get<TPV_INT>(ref.value)
-                << "\n";
-    } else if (ref.type == ValueType::TPV_FLOAT) {
-      std::cout << "[float] reg " << i << " : "
-                << std::get<TPV_FLOAT>(ref.value) << "\n";
-    } else if (ref.type == ValueType::TPV_UNIT) {
+void VM::print_regs() {
+  for (uint32_t i = 0; i < this->frames.back().num_registers; i++) {
+    auto&& ref = this->frames.back().registers[i];
+
+    if (ref.type() == ValueType::TPV_INT) {
+      std::cout << "[int] reg " << i << " : " << as_int(ref) << "\n";
+    } else if (ref.type() == ValueType::TPV_FLOAT) {
+      std::cout << "[float] reg " << i << " : " << as_float(ref) << "\n";
+    } else if (ref.type() == ValueType::TPV_UNIT) {
       std::cout << "[unit] reg " << i << " : NIL\n";
-    } else if (ref.type == ValueType::TPV_OBJ) {
-      auto&& obj_ref = std::get<TPV_Obj>(ref.value);
-      if (obj_ref.type == ObjType::STRING) {
-        auto&& ref = std::get<std::shared_ptr<TPV_ObjString>>(obj_ref.obj);
-        std::cout << "[string] reg " << i << " : <TPV_ObjString " << ref->hash
-                  << "> " << ref->value << "\n";
-      }
+    } else if (const auto* str = as_string(ref)) {
+      std::cout << "[string] reg " << i << " : <TPV_ObjString " << str->hash
+                << "> " << str->value << "\n";
     }
   }
 }
 void VM::print_str_table() {
   std::cout << "String Table Contents:" << std::endl;
 
-  for (const auto& entry : str_table) {
-    int idx = entry.first;
-    const auto& str_obj = entry.second;
+  for (String_Table::Handle idx = 0; idx < str_table.size(); ++idx) {
+    std::cout << "Index " << idx << ": " << str_table.at(idx)->value
+              << std::endl;
+  }
+}
 
-    if (str_obj) {
-      std::cout << "Index " << idx << ": " << str_obj->value << std::endl;
+namespace {
+
+// p50, p99 and max, then the count of every bucket that has any
+void print_pauses(const char* name, const Pause_Histogram& pauses) {
+  std::cout << "  " << name << " pauses: " << pauses.pauses << ", p50 <= "
+            << pauses.percentile_ms(50) << " ms, p99 <= "
+            << pauses.percentile_ms(99) << " ms, max " << pauses.max_ms
+            << " ms" << std::endl;
+  for (size_t bucket = 0; bucket < Pause_Histogram::BUCKETS; ++bucket) {
+    if (pauses.counts[bucket] == 0) {
+      continue;
+    }
+    if (bucket + 1 == Pause_Histogram::BUCKETS) {
+      std::cout << "    longer: ";
     } else {
-      std::cout << "Index " << idx << ": [null]" << std::endl;
+      std::cout << "    < " << (size_t{1} << bucket) << " us: ";
     }
+    std::cout << pauses.counts[bucket] << std::endl;
   }
 }
-}  // namespace TPV
\ No newline at end of file
+
+}  // namespace
+
+void VM::print_gc_stats() {
+  std::cout << "GC Stats:" << std::endl;
+  std::cout << "  minor collections: " << gc_stats.minor_collections << ", "
+            << gc_stats.objects_promoted << " objects / "
+            << gc_stats.bytes_promoted << " bytes promoted" << std::endl;
+  std::cout << "  major collections: " << gc_stats.collections << " in "
+            << gc_stats.slices << " slices, " << gc_stats.objects_freed
+            << " objects / " << gc_stats.bytes_freed << " bytes freed"
+            << std::endl;
+  std::cout << "  live after the last: " << gc_stats.live_objects
+            << " objects, " << gc_stats.live_bytes << " bytes" << std::endl;
+  std::cout << "  old space: " << heap.size() << " objects" << std::endl;
+  std::cout << "  scratch arrays: " << scratch.size() << std::endl;
+  std::cout << "  time: " << gc_stats.total_ms << " ms" << std::endl;
+  print_pauses("minor", gc_stats.minor_pauses);
+  print_pauses("major", gc_stats.major_pauses);
+}
+
+void VM::print_inline_stats() {
+  std::cout << "Inline Stats:" << std::endl;
+  std::cout << "  calls inlined: " << inline_stats.inlined << " of "
+            << inline_stats.call_sites << ", "
+            << inline_stats.instructions_added << " instructions added"
+            << std::endl;
+}
+}  // namespace TPV
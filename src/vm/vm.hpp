@@ -1,19 +1,41 @@
 #ifndef VM_H
 #define VM_H
 
+#include <algorithm>
 #include <cmath>
 #include <cstdint>
-#include <unordered_map>
+#include <memory>
+#include <new>
+#include <string_view>
+#include <utility>
 #include <vector>
 
 #include "../error_code.hpp"
 #include "../value.hpp"
+#include "gc.hpp"
+#include "inliner.hpp"
+#include "string_table.hpp"
 
 namespace TPV {
 const int32_t MAX_FRAME = 2048;
-const int32_t MAX_STACKS = 2048;
 const int32_t MAX_REGISTERS = 256;
 
+// how eval_all hands control from one instruction to the next
+enum class Dispatch {
+  SWITCH,         // one switch in a loop
+  COMPUTED_GOTO,  // direct threaded, every handler jumps to the next one
+  TAIL_CALL,      // every handler is a function, chained by [[clang::musttail]]
+};
+
+// picked at build time by `xmake f --dispatch=...`
+#if defined(TPV_DISPATCH_SWITCH)
+constexpr Dispatch DEFAULT_DISPATCH = Dispatch::SWITCH;
+#elif defined(TPV_DISPATCH_TAILCALL)
+constexpr Dispatch DEFAULT_DISPATCH = Dispatch::TAIL_CALL;
+#else
+constexpr Dispatch DEFAULT_DISPATCH = Dispatch::COMPUTED_GOTO;
+#endif
+
 struct FLAGS {
   bool eq_flag = false;
   bool is_true = false;
@@ -21,49 +43,269 @@ struct FLAGS {
   bool is_panic = false;
 };
 
+// copy of the int and float tables, see VM::snapshot_tables
+struct Table_Snapshot {
+  std::vector<TPV_INT> ints;
+  std::vector<TPV_FLOAT> floats;
+};
+
 // store each scope values
 struct Frame {
-  std::vector<Value> registers;
+  // this frame's window of VM::register_stack, num_registers wide from base.
+  // registers moves when the register stack grows, base does not. The
+  // function->arity arguments sit right before it
+  Value* registers = nullptr;
+  uint32_t base = 0;
+  uint32_t num_registers = 0;
+  // arguments SET_ARG put past the window for the next CALL, highest + 1
+  uint32_t arg_count = 0;
+  // caller register RETURN writes the result to
+  uint8_t result = 0;
   std::vector<Value> stack;
+  // index into function->code
   uint32_t pc = 0;
   TPV_Function* function = nullptr;
+  // its function->scratch_arrays arrays in VM::scratch start here, the frames
+  // under it have theirs before
+  uint32_t scratch_base = 0;
 };
 
 class VM {
  private:
  public:
 //   std::vector<uint8_t> bytes;
+  // grows with the call depth, only main is there before the first CALL
   std::vector<Frame> frames;
-  std::vector<TPV_Function> functions;
+  // register windows of all frames, one after another, grown as deeper calls
+  // need it
+  std::vector<Value> register_stack;
+  // in FUNCDEF order over all loads. Each one stays where it is, frames and
+  // Call_Targets point at them
+  std::vector<std::unique_ptr<TPV_Function>> functions;
 
-  std::unordered_map<size_t, TPV_INT> int32_table;
-  std::unordered_map<size_t, TPV_FLOAT> float32_table;
-  std::unordered_map<size_t, std::shared_ptr<TPV_ObjString>> str_table;
+  // STORE appends, the index it returns is where LOAD finds the value
+  std::vector<TPV_INT> int32_table;
+  std::vector<TPV_FLOAT> float32_table;
+  // every string SETS, STORE and VMCALL 3 made, see string_table.hpp
+  String_Table str_table;
 
-  // to store all values
-  std::vector<std::shared_ptr<TPV_Obj>> heap;
+  // objects start in the nursery and move to heap, the old space, if they
+  // live through a minor collection. See gc.hpp
+  Nursery nursery{GC_NURSERY_SIZE};
+  std::vector<std::unique_ptr<TPV_Object>> heap;
+  // old objects a young one was stored into since the last minor collection
+  std::vector<TPV_Object*> remembered;
+  Major_Gc major_gc;
+  Gc_Config gc_config;
+  Gc_Stats gc_stats;
+  // small leaf functions are spliced into their callers at load time, see
+  // inliner.hpp
+  Inline_Config inline_config;
+  Inline_Stats inline_stats;
+  // arrays of NEW_ARRAY_SCRATCH, see escape.hpp. Owned here and not by the
+  // collector, it scans the ones of running frames like their registers
+  std::vector<std::unique_ptr<TPV_ObjArray>> scratch;
   std::vector<Error> errors;
   FLAGS flags;
   bool is_running;
-
-  uint8_t next_8_bit();
-  std::vector<uint8_t> next_16_bit();
-  std::vector<uint8_t> next_32_bit();
-  std::vector<uint8_t> next_string();
+  Dispatch dispatch;
+  // hot loops and functions run as native code where the JIT is available
+  bool use_jit;
 
  public:
-  VM();
+  explicit VM(Dispatch dispatch = DEFAULT_DISPATCH);
   ~VM() = default;
 
+  // back to how the constructor left it, keeping the memory of the frames,
+  // register stack, tables, nursery and heap for the next program. dispatch,
+  // use_jit, gc_config and inline_config stay as they are
+  void reset();
+
   bool load_bytes(const std::vector<uint8_t> bytes);
   bool run_bytecode_file(std::string_view path);
   bool run_src_file(std::string_view path);
   VM_Result eval_all();
   VM_Result eval_one();
 
+  // argument idx of the next CALL from the running frame, written in place
+  // past its window so the call copies nothing. Skipped arguments are int 0
+  void set_arg(uint32_t idx, Value value) {
+    auto& frame = frames.back();
+    const auto slot = size_t{frame.base} + frame.num_registers + idx;
+    if (slot >= register_stack.size()) {
+      grow_register_stack(slot + 1);
+    }
+    auto* args = frame.registers + frame.num_registers;
+    if (idx >= frame.arg_count) {
+      std::fill(args + frame.arg_count, args + idx, Value{});
+      frame.arg_count = idx + 1;
+    }
+    args[idx] = value;
+  }
+
+  // a frame for target's function, called from the running frame with the
+  // arguments set_arg put past its window, those become the callee's. The
+  // callee's registers start as int 0. The caller checks MAX_FRAME and the
+  // arity and takes the arguments off arg_count
+  void push_frame(const Call_Target& target, uint8_t result) {
+    const auto& caller = frames.back();
+    const auto base = caller.base + caller.num_registers + target.arity;
+    const auto count = target.num_registers;
+    if (size_t{base} + count > register_stack.size()) {
+      grow_register_stack(size_t{base} + count);
+    }
+    auto* registers = register_stack.data() + base;
+    std::fill(registers, registers + count, Value{});
+    frames.push_back(Frame{.registers = registers,
+                           .base = base,
+                           .num_registers = count,
+                           .arg_count = 0,
+                           .result = result,
+                           .stack = {},
+                           .pc = 0,
+                           .function = target.function,
+                           .scratch_base = caller.scratch_base +
+                                           caller.function->scratch_arrays});
+  }
+
+  // run target's function in the running frame instead, for a tail call. The
+  // arguments set_arg put past the window move down to where the frame's own
+  // arguments were, the new window follows them and starts as int 0. The
+  // frame keeps its caller's result register. The caller checks the arity
+  // and takes the arguments off arg_count
+  void replace_frame(const Call_Target& target) {
+    auto& frame = frames.back();
+    const auto first_arg =
+        frame.base - static_cast<uint32_t>(frame.function->arity);
+    const auto base = first_arg + target.arity;
+    const auto count = target.num_registers;
+    if (size_t{base} + count > register_stack.size()) {
+      grow_register_stack(size_t{base} + count);
+    }
+    // the arguments only move down, so copying forward is safe
+    auto* args = register_stack.data() + frame.base + frame.num_registers;
+    std::copy(args, args + target.arity, register_stack.data() + first_arg);
+    auto* registers = register_stack.data() + base;
+    std::fill(registers, registers + count, Value{});
+    frame.registers = registers;
+    frame.base = base;
+    frame.num_registers = count;
+    frame.stack.clear();
+    frame.pc = 0;
+    release_scratch(frame);
+    frame.function = target.function;
+  }
+
+  // leave the running function, value goes to the register its CALL named.
+  // Not for main
+  void pop_frame(Value value) {
+    const auto result = frames.back().result;
+    release_scratch(frames.back());
+    frames.pop_back();
+    frames.back().registers[result] = value;
+  }
+
+  // the running frame's scratch array slot, emptied. Only its
+  // NEW_ARRAY_SCRATCH uses it, and what that made last time is dead by now
+  TPV_ObjArray* scratch_array(uint32_t slot) {
+    const auto idx = size_t{frames.back().scratch_base} + slot;
+    while (idx >= scratch.size()) {
+      scratch.push_back(std::make_unique<TPV_ObjArray>());
+      scratch.back()->scratch = true;
+    }
+    auto* array = scratch[idx].get();
+    array->clear();
+    return array;
+  }
+
+  // empty the scratch arrays of a frame that is done, all at once. They keep
+  // their buffers, and the collector finds nothing stale in them once a frame
+  // takes them again
+  void release_scratch(const Frame& frame) {
+    const auto first = size_t{frame.scratch_base};
+    const auto last =
+        std::min(scratch.size(), first + frame.function->scratch_arrays);
+    for (auto idx = first; idx < last; idx++) {
+      scratch[idx]->clear();
+    }
+  }
+
+  // room for this many values in the int and float tables before STORE has
+  // to grow them
+  void reserve_tables(size_t ints, size_t floats) {
+    int32_table.reserve(ints);
+    float32_table.reserve(floats);
+  }
+  Table_Snapshot snapshot_tables() const {
+    return {.ints = int32_table, .floats = float32_table};
+  }
+  // the tables as they were at snapshot, indices STORE returned since then
+  // are gone
+  void restore_tables(Table_Snapshot snapshot) {
+    int32_table = std::move(snapshot.ints);
+    float32_table = std::move(snapshot.floats);
+  }
+
+  // handle of the string table's string equal to str, added if there is none
+  String_Table::Handle intern(std::string_view str);
+
+  // count bytes an object's buffers grew by: a young one's count towards
+  // GC_NURSERY_LIMIT, an old one's towards gc_stats.threshold, and reaching
+  // either collects or starts a major collection. Objects a handler still
+  // uses must be in a register, a stack or the string table by then, handlers
+  // make at most one object and store it before they track anything else
+  void track_growth(const TPV_Object* obj, size_t bytes);
+
+  // value was just stored into obj. An old object that now points at a young
+  // one is remembered, the next minor collection treats it as a root. While
+  // marking, an unmarked old value is marked so no marked object points at
+  // an unmarked one
+  void write_barrier(TPV_Object* obj, Value value) {
+    if (value.type() != ValueType::TPV_OBJ) {
+      return;
+    }
+    auto* target = as_object(value);
+    if (nursery.contains(target)) {
+      if (!obj->remembered && !nursery.contains(obj)) {
+        obj->remembered = true;
+        remembered.push_back(obj);
+      }
+    } else if (major_gc.phase == Gc_Phase::MARK && !target->marked) {
+      target->marked = true;
+      major_gc.gray.push_back(target);
+    }
+  }
+
+  // a T in the nursery, Values hold the pointer
+  template <typename T, typename... Args>
+  T* new_object(Args&&... args) {
+    // built before a collection can run, args may point into an object that
+    // collection moves
+    T obj(std::forward<Args>(args)...);
+    return new (young_slot(sizeof(T), object_bytes(obj))) T(std::move(obj));
+  }
+
   // For Debugging
   void print_regs();
   void print_str_table();
+  void print_gc_stats();
+  void print_inline_stats();
+
+ private:
+  // the main function, frames[0] runs it
+  std::unique_ptr<TPV_Function> main_function;
+
+  // fill func.str_constants from func.str_literals
+  void intern_literals(TPV_Function& func);
+  // fill func.call_targets and point the imm of every CALL and TAILCALL at
+  // its entry. Only once the callees are in functions and their code is final
+  void link_calls(TPV_Function& func);
+  // register_stack holds at least size values, every Frame::registers is
+  // pointed at the moved windows
+  void grow_register_stack(size_t size);
+  // size bytes of the nursery for an object holding bytes in all, after a
+  // minor collection if it is full
+  void* young_slot(size_t size, size_t bytes);
 };
 
 }  // namespace TPV
@@ -0,0 +1,60 @@
+#include "vm_pool.hpp"
+
+#include <memory>
+#include <mutex>
+#include <utility>
+
+#include "../jit/jit.hpp"
+
+namespace TPV {
+
+VM_Pool::Handle::~Handle() {
+  if (vm) {
+    pool->release(std::move(vm));
+  }
+}
+
+VM_Pool::Handle& VM_Pool::Handle::operator=(Handle&& other) noexcept {
+  if (this != &other) {
+    if (vm) {
+      pool->release(std::move(vm));
+    }
+    pool = other.pool;
+    vm = std::move(other.vm);
+  }
+  return *this;
+}
+
+VM_Pool::Handle VM_Pool::acquire() {
+  {
+    std::lock_guard lock(mutex);
+    if (!vms.empty()) {
+      auto vm = std::move(vms.back());
+      vms.pop_back();
+      return Handle(*this, std::move(vm));
+    }
+  }
+  return Handle(*this, std::make_unique<VM>(dispatch));
+}
+
+size_t VM_Pool::idle() {
+  std::lock_guard lock(mutex);
+  return vms.size();
+}
+
+void VM_Pool::release(std::unique_ptr<VM> vm) {
+  // reset outside the lock, it frees every object the program made
+  vm->reset();
+  // settings the last program changed go back to what a new VM has
+  vm->dispatch = dispatch;
+  vm->use_jit = TPV_HAS_JIT;
+  vm->gc_config = {};
+  vm->inline_config = {};
+
+  std::lock_guard lock(mutex);
+  if (vms.size() < max_idle) {
+    vms.push_back(std::move(vm));
+  }
+}
+
+}  // namespace TPV
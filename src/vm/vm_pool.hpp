@@ -0,0 +1,59 @@
+#ifndef VM_POOL_HPP
+#define VM_POOL_HPP
+
+#include <cstddef>
+#include <memory>
+#include <mutex>
+#include <vector>
+
+#include "vm.hpp"
+
+namespace TPV {
+
+// VMs kept around between programs. A VM handed back is reset, so the next
+// acquire gets one with its frames, register stack, tables and heap memory
+// already there instead of constructing a new one
+class VM_Pool {
+ public:
+  // a VM from the pool, given back when the handle goes
+  class Handle {
+   public:
+    Handle(VM_Pool& pool, std::unique_ptr<VM> vm)
+        : pool(&pool), vm(std::move(vm)) {}
+    ~Handle();
+    Handle(Handle&& other) noexcept = default;
+    Handle& operator=(Handle&& other) noexcept;
+    Handle(const Handle&) = delete;
+    Handle& operator=(const Handle&) = delete;
+
+    VM& operator*() const { return *vm; }
+    VM* operator->() const { return vm.get(); }
+
+   private:
+    VM_Pool* pool;
+    std::unique_ptr<VM> vm;
+  };
+
+  // at most max_idle VMs are kept, more are destroyed when given back
+  explicit VM_Pool(Dispatch dispatch = DEFAULT_DISPATCH, size_t max_idle = 16)
+      : dispatch(dispatch), max_idle(max_idle) {}
+
+  // an idle VM, or a new one if there is none. Safe to call from several
+  // threads, a VM is only used by one at a time
+  Handle acquire();
+  // VMs waiting in the pool
+  size_t idle();
+
+ private:
+  // reset vm and keep it if there is room
+  void release(std::unique_ptr<VM> vm);
+
+  Dispatch dispatch;
+  size_t max_idle;
+  std::mutex mutex;
+  std::vector<std::unique_ptr<VM>> vms;
+};
+
+}  // namespace TPV
+
+#endif  // !VM_POOL_HPP
@@ -6,6 +6,13 @@ set_languages("c++23")
 
 add_rules("plugin.compile_commands.autoupdate", {outputdir = "build"})
 
+option("dispatch")
+    set_default("goto")
+    set_showmenu(true)
+    set_values("switch", "goto", "tailcall")
+    set_description("Default dispatch backend of the VM")
+option_end()
+
 target("tea_party_vm")
     set_kind("binary")
     add_files("src/*.cpp")
@@ -13,6 +20,18 @@ target("tea_party_vm")
     add_files("src/parser/*.cpp")
     add_files("src/repl/*.cpp")
     add_files("src/vm/*.cpp")
+    add_files("src/jit/*.cpp")
+    add_files("src/optimizer/*.cpp")
     add_includedirs("src")
+    add_options("dispatch")
+    if is_config("dispatch", "switch") then
+        add_defines("TPV_DISPATCH_SWITCH")
+    elseif is_config("dispatch", "tailcall") then
+        add_defines("TPV_DISPATCH_TAILCALL")
+    end
+    -- verified code runs without bounds checks, debug builds keep them
+    if is_mode("debug") then
+        add_defines("TPV_VM_CHECKED")
+    end
 
 set_optimize("faster")